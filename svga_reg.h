@@ -110,6 +110,8 @@
 #define SVGA_IRQFLAG_ANY_FENCE            0x1    /* Any fence was passed */
 #define SVGA_IRQFLAG_FIFO_PROGRESS        0x2    /* Made forward progress in the FIFO */
 #define SVGA_IRQFLAG_FENCE_GOAL           0x4    /* SVGA_FIFO_FENCE_GOAL reached */
+#define SVGA_IRQFLAG_COMMAND_BUFFER       0x8    /* Command buffer completed */
+#define SVGA_IRQFLAG_ERROR                0x10   /* Error while processing commands */
 
 /*
  * Registers
@@ -304,6 +306,144 @@ struct SVGAGuestPtr {
 } SVGAGuestPtr;
 
 
+/*
+ * Command buffers.
+ *
+ * When SVGA_CAP_COMMAND_BUFFERS is present, commands may be submitted
+ * in guest memory instead of through the FIFO. Each command buffer
+ * starts with an SVGACBHeader, which must be 64-byte aligned, and is
+ * submitted by writing the upper 32 bits of the header's physical
+ * address to SVGA_REG_COMMAND_HIGH and then the lower 32 bits, or'ed
+ * with the SVGACBContext, to SVGA_REG_COMMAND_LOW.
+ *
+ * Command buffers within a context are processed in submission order.
+ * When the device is done with a buffer, it writes the status field
+ * and, unless SVGA_CB_FLAG_NO_IRQ is set, raises
+ * SVGA_IRQFLAG_COMMAND_BUFFER.
+ */
+
+#define SVGA_CB_MAX_SIZE (512 * 1024)  /* 512 KB */
+#define SVGA_CB_MAX_QUEUED_PER_CONTEXT 32
+
+typedef __le64 PA;
+
+typedef enum {
+   SVGA_CB_CONTEXT_DEVICE = 0x3f,
+   SVGA_CB_CONTEXT_0      = 0x0,
+   SVGA_CB_CONTEXT_MAX    = 0x1,
+} SVGACBContext;
+
+#define SVGA_CB_CONTEXT_MASK 0x3f
+
+typedef enum {
+   /*
+    * The guest is supposed to write SVGA_CB_STATUS_NONE to the status
+    * field before submitting the command buffer header, the host will
+    * change the value when it is done with the command buffer.
+    */
+   SVGA_CB_STATUS_NONE = 0,
+
+   /*
+    * Written by the host when a command buffer completes successfully.
+    */
+   SVGA_CB_STATUS_COMPLETED = 1,
+
+   /*
+    * Written by the host if the guest requested submitting a command
+    * buffer when the host queue was full.
+    */
+   SVGA_CB_STATUS_QUEUE_FULL = 2,
+
+   /*
+    * Written by the host when an error was detected parsing a command
+    * buffer. errorOffset is written to contain the offset to the first
+    * byte of the failing command. The context is stopped until it is
+    * restarted through the device context.
+    */
+   SVGA_CB_STATUS_COMMAND_ERROR = 3,
+
+   /*
+    * Written by the host if there is an error parsing the command buffer
+    * header.
+    */
+   SVGA_CB_STATUS_CB_HEADER_ERROR = 4,
+
+   /*
+    * Written by the host if the guest requested the host to preempt the
+    * command buffer.
+    */
+   SVGA_CB_STATUS_PREEMPTED = 5,
+
+   /*
+    * Written by the host synchronously with the command buffer submission
+    * to indicate the command buffer was not submitted.
+    */
+   SVGA_CB_STATUS_SUBMISSION_ERROR = 6,
+} SVGACBStatus;
+
+typedef enum {
+   SVGA_CB_FLAG_NONE       = 0,
+   SVGA_CB_FLAG_NO_IRQ     = 1 << 0,
+   SVGA_CB_FLAG_DX_CONTEXT = 1 << 1,
+   SVGA_CB_FLAG_MOB        = 1 << 2,
+} SVGACBFlags;
+
+typedef
+struct {
+   volatile SVGACBStatus status;
+   volatile uint32 errorOffset;
+   __le64 id;
+   SVGACBFlags flags;
+   uint32 length;
+   union {
+      PA pa;
+      struct {
+         uint32 mobid;
+         uint32 mobOffset;
+      } mob;
+   } ptr;
+   uint32 offset; /* Valid if CMD_BUFFERS_2 cap set, must be zero otherwise */
+   uint32 dxContext; /* Valid if DX_CONTEXT flag set, must be zero otherwise */
+   uint32 mustBeZero[6];
+}
+__attribute__((__packed__))
+SVGACBHeader;
+
+/*
+ * Commands for the device context, SVGA_CB_CONTEXT_DEVICE.
+ */
+
+typedef enum {
+   SVGA_DC_CMD_NOP                   = 0,
+   SVGA_DC_CMD_START_STOP_CONTEXT    = 1,
+   SVGA_DC_CMD_PREEMPT               = 2,
+   SVGA_DC_CMD_MAX                   = 3,
+} SVGADeviceContextCmdId;
+
+typedef
+struct {
+   uint32 enable;
+   SVGACBContext context;
+}
+__attribute__((__packed__))
+SVGADCCmdStartStop;
+
+/*
+ * SVGA_DC_CMD_PREEMPT --
+ *
+ *    Preempt the command buffers of a context. Buffers that have not
+ *    completed are handed back with SVGA_CB_STATUS_PREEMPTED.
+ */
+
+typedef
+struct {
+   SVGACBContext context;
+   uint32 ignoreIDZero;
+}
+__attribute__((__packed__))
+SVGADCCmdPreempt;
+
+
 /*
  * SVGAGMRImageFormat --
  *
@@ -0,0 +1,11 @@
+/*
+ * Userspace stand-in for the kernel's <asm/page.h>.
+ */
+#ifndef _VMW_TEST_ASM_PAGE_H_
+#define _VMW_TEST_ASM_PAGE_H_
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+
+#endif
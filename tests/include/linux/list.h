@@ -0,0 +1,12 @@
+/*
+ * Userspace stand-in for the kernel's <linux/list.h>. The helpers under
+ * test only embed list heads, they never walk them.
+ */
+#ifndef _VMW_TEST_LINUX_LIST_H_
+#define _VMW_TEST_LINUX_LIST_H_
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#endif
@@ -0,0 +1,4 @@
+/*
+ * Userspace stand-in for the kernel's <linux/pci_ids.h>. Nothing under
+ * test uses the PCI ids.
+ */
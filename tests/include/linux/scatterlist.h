@@ -0,0 +1,14 @@
+/*
+ * Userspace stand-in for the kernel's <linux/scatterlist.h>. Tests only
+ * drive struct vmw_piter in array mode, so the sg iterator is opaque.
+ */
+#ifndef _VMW_TEST_LINUX_SCATTERLIST_H_
+#define _VMW_TEST_LINUX_SCATTERLIST_H_
+
+struct page;
+
+struct sg_page_iter {
+	unsigned int sg_pgoffset;
+};
+
+#endif
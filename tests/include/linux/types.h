@@ -0,0 +1,26 @@
+/*
+ * Userspace stand-in for the kernel's <linux/types.h>, adding the kernel
+ * types used by the helpers under test to the uapi header.
+ */
+#ifndef _VMW_TEST_LINUX_TYPES_H_
+#define _VMW_TEST_LINUX_TYPES_H_
+
+#include_next <linux/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__LP64__) && !defined(CONFIG_64BIT)
+#define CONFIG_64BIT
+#endif
+
+#define __user
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int32_t s32;
+typedef uint64_t dma_addr_t;
+
+#endif
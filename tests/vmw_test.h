@@ -0,0 +1,31 @@
+/*
+ * Minimal test harness for the userspace vmwgfx helper tests.
+ */
+#ifndef _VMW_TEST_H_
+#define _VMW_TEST_H_
+
+#include <stdio.h>
+
+static int vmw_test_failures;
+
+#define VMW_TEST_CHECK(cond)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+				__FILE__, __LINE__, __func__, #cond);	\
+			vmw_test_failures++;				\
+		}							\
+	} while (0)
+
+#define VMW_TEST_RUN(test)						\
+	do {								\
+		int _failures = vmw_test_failures;			\
+									\
+		test();							\
+		printf("%s %s\n", _failures == vmw_test_failures ?	\
+		       "PASS" : "FAIL", #test);				\
+	} while (0)
+
+#define VMW_TEST_EXIT() (vmw_test_failures ? 1 : 0)
+
+#endif
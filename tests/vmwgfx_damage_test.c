@@ -0,0 +1,238 @@
+/*
+ * Trace-driven tests for vmw_damage_coalesce().
+ *
+ * Each trace is a set of damage rects as a client would send them with a
+ * dirty fb or surface / dma buffer present call. Besides the expected
+ * result of the hand-written traces, every trace is checked for the
+ * invariants the blit paths rely on: each damaged pixel is still covered,
+ * no rect grows outside the bounding box of the damage and the rect limit
+ * holds.
+ */
+
+#include <string.h>
+#include <linux/kernel.h>
+
+#include "vmw_test.h"
+#include "vmwgfx_damage.h"
+
+#define TEST_MAX_CLIPS 256
+#define TEST_WIDTH 256
+#define TEST_HEIGHT 256
+
+static bool test_contains(const struct drm_clip_rect *outer,
+			  const struct drm_clip_rect *inner)
+{
+	return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+		outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+/*
+ * Coalesce @clips and check the invariants. Returns the number of rects
+ * in @out.
+ */
+static unsigned test_coalesce(const struct drm_clip_rect *clips,
+			      unsigned num_clips, int increment,
+			      unsigned max_rects, unsigned waste_pct,
+			      struct drm_clip_rect *out)
+{
+	static unsigned char damaged[TEST_HEIGHT][TEST_WIDTH];
+	struct drm_clip_rect box = { TEST_WIDTH, TEST_HEIGHT, 0, 0 };
+	unsigned num, i, x, y;
+	const struct drm_clip_rect *clip;
+
+	num = vmw_damage_coalesce(clips, num_clips, increment, max_rects,
+				  waste_pct, out);
+
+	if (max_rects != 0)
+		VMW_TEST_CHECK(num <= max_rects);
+	VMW_TEST_CHECK(num <= num_clips);
+
+	memset(damaged, 0, sizeof(damaged));
+	for (i = 0, clip = clips; i < num_clips; ++i, clip += increment) {
+		if (clip->x1 >= clip->x2 || clip->y1 >= clip->y2)
+			continue;
+		for (y = clip->y1; y < clip->y2; ++y)
+			for (x = clip->x1; x < clip->x2; ++x)
+				damaged[y][x] = 1;
+		box.x1 = min(box.x1, clip->x1);
+		box.y1 = min(box.y1, clip->y1);
+		box.x2 = max(box.x2, clip->x2);
+		box.y2 = max(box.y2, clip->y2);
+	}
+
+	for (i = 0; i < num; ++i) {
+		VMW_TEST_CHECK(out[i].x1 < out[i].x2 && out[i].y1 < out[i].y2);
+		VMW_TEST_CHECK(test_contains(&box, &out[i]));
+		for (y = out[i].y1; y < out[i].y2; ++y)
+			for (x = out[i].x1; x < out[i].x2; ++x)
+				damaged[y][x] = 0;
+	}
+
+	for (y = 0; y < TEST_HEIGHT; ++y)
+		for (x = 0; x < TEST_WIDTH; ++x)
+			if (damaged[y][x]) {
+				VMW_TEST_CHECK(!damaged[y][x]);
+				return num;
+			}
+
+	return num;
+}
+
+static void test_empty(void)
+{
+	struct drm_clip_rect clips[3] = {
+		{ 10, 10, 10, 20 },
+		{ 10, 10, 20, 10 },
+		{ 30, 30, 20, 40 },
+	};
+	struct drm_clip_rect out[3];
+
+	VMW_TEST_CHECK(test_coalesce(clips, 0, 1, 32, 25, out) == 0);
+	VMW_TEST_CHECK(test_coalesce(clips, 3, 1, 32, 25, out) == 0);
+}
+
+static void test_cursor_blink(void)
+{
+	struct drm_clip_rect clips[16];
+	struct drm_clip_rect out[16];
+	struct drm_clip_rect cursor = { 40, 100, 48, 116 };
+	unsigned i;
+
+	/* The same small rect, redrawn over and over. */
+	for (i = 0; i < 16; ++i)
+		clips[i] = cursor;
+
+	VMW_TEST_CHECK(test_coalesce(clips, 16, 1, 32, 0, out) == 1);
+	VMW_TEST_CHECK(memcmp(&out[0], &cursor, sizeof(cursor)) == 0);
+}
+
+static void test_console_scroll(void)
+{
+	struct drm_clip_rect clips[16];
+	struct drm_clip_rect out[16];
+	struct drm_clip_rect screen = { 0, 0, 256, 256 };
+	unsigned i;
+
+	/* Full-width text lines, sent bottom up. Adjacent rects always merge. */
+	for (i = 0; i < 16; ++i) {
+		clips[i].x1 = 0;
+		clips[i].x2 = 256;
+		clips[i].y1 = (15 - i) * 16;
+		clips[i].y2 = (16 - i) * 16;
+	}
+
+	VMW_TEST_CHECK(test_coalesce(clips, 16, 1, 32, 0, out) == 1);
+	VMW_TEST_CHECK(memcmp(&out[0], &screen, sizeof(screen)) == 0);
+}
+
+static void test_separate_windows(void)
+{
+	struct drm_clip_rect clips[4] = {
+		{ 0, 0, 64, 64 },
+		{ 8, 8, 32, 32 },
+		{ 192, 192, 256, 256 },
+		{ 200, 200, 224, 224 },
+	};
+	struct drm_clip_rect out[4];
+	unsigned num;
+
+	/* Contained rects fold into their window, the windows stay apart. */
+	num = test_coalesce(clips, 4, 1, 32, 25, out);
+	VMW_TEST_CHECK(num == 2);
+
+	/* Unless everything must go in a single rect. */
+	num = test_coalesce(clips, 4, 1, 1, 25, out);
+	VMW_TEST_CHECK(num == 1);
+	VMW_TEST_CHECK(out[0].x1 == 0 && out[0].y1 == 0 &&
+		       out[0].x2 == 256 && out[0].y2 == 256);
+}
+
+static void test_waste_threshold(void)
+{
+	/*
+	 * An L shape: the bounding box is 100 x 100, of which 1900 pixels
+	 * are damaged, so 81% of it is not.
+	 */
+	struct drm_clip_rect clips[2] = {
+		{ 0, 0, 100, 10 },
+		{ 0, 10, 10, 100 },
+	};
+	struct drm_clip_rect out[2];
+
+	VMW_TEST_CHECK(test_coalesce(clips, 2, 1, 32, 80, out) == 2);
+	VMW_TEST_CHECK(test_coalesce(clips, 2, 1, 32, 81, out) == 1);
+
+	/* Overlap is only counted once. */
+	clips[0] = (struct drm_clip_rect) { 0, 0, 60, 100 };
+	clips[1] = (struct drm_clip_rect) { 40, 0, 100, 100 };
+	VMW_TEST_CHECK(test_coalesce(clips, 2, 1, 32, 0, out) == 1);
+}
+
+static void test_annotated_copies(void)
+{
+	/*
+	 * Surface copies interleave destination and source rects. Only the
+	 * destination rects are damage.
+	 */
+	struct drm_clip_rect clips[4] = {
+		{ 0, 0, 16, 16 },
+		{ 128, 128, 144, 144 },
+		{ 16, 0, 32, 16 },
+		{ 200, 200, 216, 216 },
+	};
+	struct drm_clip_rect out[2];
+
+	VMW_TEST_CHECK(test_coalesce(clips, 2, 2, 32, 0, out) == 1);
+	VMW_TEST_CHECK(out[0].x1 == 0 && out[0].y1 == 0 &&
+		       out[0].x2 == 32 && out[0].y2 == 16);
+}
+
+/*
+ * Pseudo-random traces: small scattered rects as from a busy desktop,
+ * checked against the invariants with and without a rect limit.
+ */
+static void test_random_traces(void)
+{
+	static const unsigned limits[] = { 0, 1, 4, 32 };
+	static const unsigned wastes[] = { 0, 25, 100 };
+	struct drm_clip_rect clips[TEST_MAX_CLIPS];
+	struct drm_clip_rect out[TEST_MAX_CLIPS];
+	unsigned seed = 1;
+	unsigned trace, i, l, w, num_clips;
+
+	for (trace = 0; trace < 64; ++trace) {
+		num_clips = 1 + trace * 4 % TEST_MAX_CLIPS;
+		for (i = 0; i < num_clips; ++i) {
+			unsigned x, y;
+
+			seed = seed * 1103515245 + 12345;
+			x = (seed >> 8) % (TEST_WIDTH - 1);
+			y = (seed >> 20) % (TEST_HEIGHT - 1);
+			clips[i].x1 = x;
+			clips[i].y1 = y;
+			seed = seed * 1103515245 + 12345;
+			clips[i].x2 = min(x + 1 + (seed >> 8) % 24,
+					  (unsigned) TEST_WIDTH);
+			clips[i].y2 = min(y + 1 + (seed >> 20) % 24,
+					  (unsigned) TEST_HEIGHT);
+		}
+
+		for (l = 0; l < sizeof(limits) / sizeof(limits[0]); ++l)
+			for (w = 0; w < sizeof(wastes) / sizeof(wastes[0]); ++w)
+				(void) test_coalesce(clips, num_clips, 1,
+						     limits[l], wastes[w], out);
+	}
+}
+
+int main(void)
+{
+	VMW_TEST_RUN(test_empty);
+	VMW_TEST_RUN(test_cursor_blink);
+	VMW_TEST_RUN(test_console_scroll);
+	VMW_TEST_RUN(test_separate_windows);
+	VMW_TEST_RUN(test_waste_threshold);
+	VMW_TEST_RUN(test_annotated_copies);
+	VMW_TEST_RUN(test_random_traces);
+
+	return VMW_TEST_EXIT();
+}
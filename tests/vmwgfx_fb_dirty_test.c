@@ -0,0 +1,271 @@
+/*
+ * Page-write simulation tests for the fbdev damage set.
+ *
+ * Pixel writes to a simulated shadow framebuffer dirty the pages they
+ * touch, the way fbdev deferred I/O tracks them. The sorted dirty pages
+ * are turned into runs and added to a damage set like vmw_deferred_io()
+ * does, and every written visible pixel must end up covered.
+ */
+
+#include <string.h>
+#include <linux/kernel.h>
+#include <asm/page.h>
+
+#include "vmw_test.h"
+#include "vmwgfx_damage.h"
+
+#define TEST_MAX_PAGES 1024
+
+/**
+ * struct test_fb - A simulated deferred I/O framebuffer.
+ *
+ * @width: Visible width in pixels.
+ * @height: Height in scanlines.
+ * @pitch: Scanline length in bytes, may include padding.
+ * @cpp: Bytes per pixel.
+ * @dirty: Pages written since the last flush.
+ * @written: Visible pixels written since the last flush.
+ */
+struct test_fb {
+	unsigned width;
+	unsigned height;
+	unsigned long pitch;
+	unsigned cpp;
+	bool dirty[TEST_MAX_PAGES];
+	unsigned char written[512][2048];
+};
+
+static struct test_fb fb;
+
+static void test_fb_init(unsigned width, unsigned height,
+			 unsigned long pitch, unsigned cpp)
+{
+	memset(&fb, 0, sizeof(fb));
+	fb.width = width;
+	fb.height = height;
+	fb.pitch = pitch;
+	fb.cpp = cpp;
+	VMW_TEST_CHECK(DIV_ROUND_UP(pitch * height, PAGE_SIZE) <=
+		       TEST_MAX_PAGES);
+}
+
+static unsigned long test_fb_size(void)
+{
+	return fb.pitch * fb.height;
+}
+
+/* Write a pixel. Pixels past @width land in the scanline padding. */
+static void test_fb_write(unsigned x, unsigned y)
+{
+	unsigned long offset = y * fb.pitch + x * fb.cpp;
+
+	fb.dirty[offset >> PAGE_SHIFT] = true;
+	fb.dirty[(offset + fb.cpp - 1) >> PAGE_SHIFT] = true;
+	if (x < fb.width)
+		fb.written[y][x] = 1;
+}
+
+/*
+ * Hand the dirty pages to the damage set in index order, one range per
+ * run of contiguous pages, as vmw_deferred_io() does.
+ */
+static void test_fb_deferred_io(struct vmw_damage_set *set)
+{
+	unsigned long num_pages = DIV_ROUND_UP(test_fb_size(), PAGE_SIZE);
+	unsigned long start = 0, end = 0;
+	bool in_run = false;
+	unsigned long i;
+
+	for (i = 0; i < num_pages; ++i) {
+		unsigned long offset = i << PAGE_SHIFT;
+
+		if (!fb.dirty[i])
+			continue;
+
+		if (in_run && offset == end) {
+			end += PAGE_SIZE;
+			continue;
+		}
+
+		if (in_run)
+			vmw_damage_set_add_range(set, start, end, fb.pitch,
+						 fb.cpp, fb.width,
+						 test_fb_size());
+
+		start = offset;
+		end = offset + PAGE_SIZE;
+		in_run = true;
+	}
+
+	if (in_run)
+		vmw_damage_set_add_range(set, start, end, fb.pitch, fb.cpp,
+					 fb.width, test_fb_size());
+}
+
+/* Check that the damage set covers all written pixels. */
+static void test_fb_check(const struct vmw_damage_set *set)
+{
+	unsigned i, x, y;
+
+	VMW_TEST_CHECK(set->num_rects <= VMW_DAMAGE_SET_RECTS);
+	for (i = 0; i < set->num_rects; ++i) {
+		const struct drm_clip_rect *rect = &set->rects[i];
+
+		VMW_TEST_CHECK(rect->x1 < rect->x2 && rect->y1 < rect->y2);
+		VMW_TEST_CHECK(rect->x2 <= fb.width);
+		for (y = rect->y1; y < rect->y2 && y < fb.height; ++y)
+			for (x = rect->x1; x < rect->x2; ++x)
+				fb.written[y][x] = 0;
+	}
+
+	for (y = 0; y < fb.height; ++y)
+		for (x = 0; x < fb.width; ++x)
+			if (fb.written[y][x]) {
+				VMW_TEST_CHECK(!fb.written[y][x]);
+				return;
+			}
+}
+
+static void test_set_add(void)
+{
+	struct vmw_damage_set set;
+
+	memset(&set, 0, sizeof(set));
+
+	/* Empty rects are ignored, the first real one starts the flush. */
+	VMW_TEST_CHECK(!vmw_damage_set_add(&set, 10, 10, 10, 20));
+	VMW_TEST_CHECK(set.num_rects == 0);
+	VMW_TEST_CHECK(vmw_damage_set_add(&set, 0, 0, 10, 10));
+	VMW_TEST_CHECK(!vmw_damage_set_add(&set, 5, 5, 15, 15));
+	VMW_TEST_CHECK(set.num_rects == 1);
+	VMW_TEST_CHECK(set.rects[0].x2 == 15 && set.rects[0].y2 == 15);
+
+	/* Touching rects merge, distant ones take free slots. */
+	VMW_TEST_CHECK(!vmw_damage_set_add(&set, 15, 0, 20, 5));
+	VMW_TEST_CHECK(set.num_rects == 1);
+	(void) vmw_damage_set_add(&set, 100, 100, 110, 110);
+	(void) vmw_damage_set_add(&set, 200, 0, 210, 10);
+	(void) vmw_damage_set_add(&set, 0, 200, 10, 210);
+	VMW_TEST_CHECK(set.num_rects == 4);
+
+	/* With the set full, the rect growing the least absorbs the next. */
+	(void) vmw_damage_set_add(&set, 115, 100, 120, 110);
+	VMW_TEST_CHECK(set.num_rects == 4);
+	VMW_TEST_CHECK(set.rects[1].x1 == 100 && set.rects[1].x2 == 120);
+	VMW_TEST_CHECK(set.rects[1].y1 == 100 && set.rects[1].y2 == 110);
+}
+
+static void test_single_page_in_scanline(void)
+{
+	struct vmw_damage_set set;
+
+	/* 1024 pixels of 4 bytes: each scanline holds two full pages. */
+	memset(&set, 0, sizeof(set));
+	test_fb_init(2048, 16, 2048 * 4, 4);
+	test_fb_write(1500, 3);
+	test_fb_deferred_io(&set);
+	test_fb_check(&set);
+
+	/* Only the written page's half of the scanline is dirty. */
+	VMW_TEST_CHECK(set.num_rects == 1);
+	VMW_TEST_CHECK(set.rects[0].x1 == 1024 && set.rects[0].x2 == 2048);
+	VMW_TEST_CHECK(set.rects[0].y1 == 3 && set.rects[0].y2 == 4);
+}
+
+static void test_page_spans_scanlines(void)
+{
+	struct vmw_damage_set set;
+
+	/* 400 pixels of 4 bytes: a page spans several scanlines. */
+	memset(&set, 0, sizeof(set));
+	test_fb_init(400, 300, 400 * 4, 4);
+	test_fb_write(399, 10);
+	test_fb_deferred_io(&set);
+	test_fb_check(&set);
+
+	VMW_TEST_CHECK(set.num_rects == 1);
+	VMW_TEST_CHECK(set.rects[0].x1 == 0 && set.rects[0].x2 == 400);
+}
+
+static void test_separate_runs(void)
+{
+	struct vmw_damage_set set;
+	unsigned y;
+
+	/*
+	 * Two cursors blinking far apart dirty two separate page runs,
+	 * which must not be flushed as a single rect spanning the gap.
+	 */
+	memset(&set, 0, sizeof(set));
+	test_fb_init(1024, 300, 1024 * 4, 4);
+	for (y = 20; y < 36; ++y)
+		test_fb_write(8, y);
+	for (y = 250; y < 266; ++y)
+		test_fb_write(900, y);
+	test_fb_deferred_io(&set);
+	test_fb_check(&set);
+
+	VMW_TEST_CHECK(set.num_rects == 2);
+	VMW_TEST_CHECK(set.rects[0].y2 <= 36 && set.rects[1].y1 >= 250);
+}
+
+static void test_padding(void)
+{
+	struct vmw_damage_set set;
+
+	/*
+	 * A pitch wider than the visible area. Writes to the padding dirty
+	 * pages, but no rect may extend past the visible width.
+	 */
+	memset(&set, 0, sizeof(set));
+	test_fb_init(1000, 64, 1024 * 4, 4);
+	test_fb_write(1010, 5);
+	test_fb_write(1023, 40);
+	test_fb_deferred_io(&set);
+	test_fb_check(&set);
+
+	/* Also with a range ending past the framebuffer. */
+	vmw_damage_set_add_range(&set, test_fb_size() - 16,
+				 test_fb_size() + PAGE_SIZE, fb.pitch, fb.cpp,
+				 fb.width, test_fb_size());
+	test_fb_check(&set);
+}
+
+static void test_random_writes(void)
+{
+	struct vmw_damage_set set;
+	unsigned seed = 1;
+	unsigned round, i;
+
+	/*
+	 * Bursts of random pixel writes, with enough separate runs to
+	 * overflow the set, at 16 and 32 bpp and with and without padding.
+	 */
+	for (round = 0; round < 32; ++round) {
+		unsigned cpp = (round & 1) ? 2 : 4;
+		unsigned width = (round & 2) ? 640 : 600;
+		unsigned long pitch = (round & 2) ? width * cpp : 640 * cpp;
+
+		memset(&set, 0, sizeof(set));
+		test_fb_init(width, 480, pitch, cpp);
+		for (i = 0; i < 1 + round * 3; ++i) {
+			seed = seed * 1103515245 + 12345;
+			test_fb_write((seed >> 8) % (pitch / cpp),
+				      (seed >> 20) % 480);
+		}
+		test_fb_deferred_io(&set);
+		test_fb_check(&set);
+	}
+}
+
+int main(void)
+{
+	VMW_TEST_RUN(test_set_add);
+	VMW_TEST_RUN(test_single_page_in_scanline);
+	VMW_TEST_RUN(test_page_spans_scanlines);
+	VMW_TEST_RUN(test_separate_runs);
+	VMW_TEST_RUN(test_padding);
+	VMW_TEST_RUN(test_random_writes);
+
+	return VMW_TEST_EXIT();
+}
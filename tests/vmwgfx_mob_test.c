@@ -0,0 +1,172 @@
+/*
+ * Tests for the mob page table shortcuts in vmwgfx_mob.h.
+ *
+ * The data pages are described by synthetic DMA address arrays, walked by
+ * a struct vmw_piter in the same array mode vmw_piter_start() uses for
+ * coherent pages.
+ */
+
+#include <string.h>
+
+#include "vmw_test.h"
+#include "vmwgfx_mob.h"
+
+#define TEST_BASE ((dma_addr_t) 0x100000)
+
+static bool test_piter_next(struct vmw_piter *viter)
+{
+	return ++(viter->i) < viter->num_pages;
+}
+
+static dma_addr_t test_piter_dma_addr(struct vmw_piter *viter)
+{
+	return viter->addrs[viter->i];
+}
+
+/*
+ * Start an iterator at page @p_offs of @addrs, positioned on that page as
+ * vmw_mob_bind() does after its first vmw_piter_next().
+ */
+static void test_piter_start(struct vmw_piter *viter,
+			     const dma_addr_t *addrs,
+			     unsigned long num_pages,
+			     unsigned long p_offs)
+{
+	memset(viter, 0, sizeof(*viter));
+	viter->addrs = addrs;
+	viter->num_pages = num_pages;
+	viter->i = p_offs - 1;
+	viter->next = test_piter_next;
+	viter->dma_address = test_piter_dma_addr;
+	VMW_TEST_CHECK(vmw_piter_next(viter));
+}
+
+static void test_fill_contig(dma_addr_t *addrs, unsigned long num,
+			     dma_addr_t base)
+{
+	unsigned long i;
+
+	for (i = 0; i < num; ++i)
+		addrs[i] = base + i * PAGE_SIZE;
+}
+
+static void test_single_page(void)
+{
+	dma_addr_t addrs[1] = { TEST_BASE };
+	struct vmw_piter iter;
+	struct vmw_mob mob;
+
+	memset(&mob, 0, sizeof(mob));
+	test_piter_start(&iter, addrs, 1, 0);
+	VMW_TEST_CHECK(vmw_mob_is_contig(iter, 1));
+	VMW_TEST_CHECK(vmw_mob_set_direct(&mob, &iter, 1, false));
+	VMW_TEST_CHECK(mob.pt_level == VMW_MOBFMT_PTDEPTH_0);
+	VMW_TEST_CHECK(mob.pt_root_page == TEST_BASE);
+}
+
+static void test_contig_range(void)
+{
+	dma_addr_t addrs[16];
+	struct vmw_piter iter;
+	struct vmw_mob mob;
+
+	memset(&mob, 0, sizeof(mob));
+	test_fill_contig(addrs, 16, TEST_BASE);
+	test_piter_start(&iter, addrs, 16, 0);
+	VMW_TEST_CHECK(vmw_mob_is_contig(iter, 16));
+	VMW_TEST_CHECK(vmw_mob_set_direct(&mob, &iter, 16,
+					  vmw_mob_is_contig(iter, 16)));
+	VMW_TEST_CHECK(mob.pt_level == SVGA3D_MOBFMT_RANGE);
+	VMW_TEST_CHECK(mob.pt_root_page == TEST_BASE);
+}
+
+static void test_gap_needs_page_table(void)
+{
+	dma_addr_t addrs[16];
+	struct vmw_piter iter;
+	struct vmw_mob mob;
+
+	memset(&mob, 0, sizeof(mob));
+	mob.pt_level = VMW_MOBFMT_PTDEPTH_2;
+	test_fill_contig(addrs, 8, TEST_BASE);
+	test_fill_contig(addrs + 8, 8, TEST_BASE + 9 * PAGE_SIZE);
+	test_piter_start(&iter, addrs, 16, 0);
+
+	VMW_TEST_CHECK(!vmw_mob_is_contig(iter, 16));
+	/* The contiguous head alone is fine. */
+	VMW_TEST_CHECK(vmw_mob_is_contig(iter, 8));
+	VMW_TEST_CHECK(!vmw_mob_is_contig(iter, 9));
+
+	VMW_TEST_CHECK(!vmw_mob_set_direct(&mob, &iter, 16,
+					   vmw_mob_is_contig(iter, 16)));
+	VMW_TEST_CHECK(mob.pt_level == VMW_MOBFMT_PTDEPTH_2);
+	VMW_TEST_CHECK(mob.pt_root_page == 0);
+}
+
+static void test_out_of_order(void)
+{
+	dma_addr_t addrs[4];
+	struct vmw_piter iter;
+	unsigned long i;
+
+	/* Descending addresses are adjacent, but not a range. */
+	for (i = 0; i < 4; ++i)
+		addrs[i] = TEST_BASE + (3 - i) * PAGE_SIZE;
+	test_piter_start(&iter, addrs, 4, 0);
+	VMW_TEST_CHECK(!vmw_mob_is_contig(iter, 4));
+
+	/* Neither is the same page mapped twice. */
+	addrs[0] = addrs[1] = TEST_BASE;
+	test_piter_start(&iter, addrs, 4, 0);
+	VMW_TEST_CHECK(!vmw_mob_is_contig(iter, 2));
+}
+
+static void test_offset_start(void)
+{
+	dma_addr_t addrs[8];
+	struct vmw_piter iter;
+	struct vmw_mob mob;
+
+	/*
+	 * An otable at page offset 4 of a buffer whose first half is
+	 * scattered and whose second half is contiguous.
+	 */
+	memset(&mob, 0, sizeof(mob));
+	addrs[0] = TEST_BASE + 40 * PAGE_SIZE;
+	addrs[1] = TEST_BASE + 20 * PAGE_SIZE;
+	addrs[2] = TEST_BASE + 30 * PAGE_SIZE;
+	addrs[3] = TEST_BASE + 10 * PAGE_SIZE;
+	test_fill_contig(addrs + 4, 4, TEST_BASE);
+	test_piter_start(&iter, addrs, 8, 4);
+
+	VMW_TEST_CHECK(vmw_mob_is_contig(iter, 4));
+	/* The iterator is passed by value and must not move. */
+	VMW_TEST_CHECK(iter.i == 4);
+	VMW_TEST_CHECK(vmw_mob_set_direct(&mob, &iter, 4, true));
+	VMW_TEST_CHECK(mob.pt_level == SVGA3D_MOBFMT_RANGE);
+	VMW_TEST_CHECK(mob.pt_root_page == TEST_BASE);
+}
+
+static void test_short_list(void)
+{
+	dma_addr_t addrs[4];
+	struct vmw_piter iter;
+
+	/* Running out of pages is not a contiguous range. */
+	test_fill_contig(addrs, 4, TEST_BASE);
+	test_piter_start(&iter, addrs, 4, 0);
+	VMW_TEST_CHECK(vmw_mob_is_contig(iter, 4));
+	VMW_TEST_CHECK(!vmw_mob_is_contig(iter, 5));
+}
+
+int main(void)
+{
+	VMW_TEST_RUN(test_single_page);
+	VMW_TEST_RUN(test_contig_range);
+	VMW_TEST_RUN(test_gap_needs_page_table);
+	VMW_TEST_RUN(test_out_of_order);
+	VMW_TEST_RUN(test_offset_start);
+	VMW_TEST_RUN(test_short_list);
+
+	return VMW_TEST_EXIT();
+}
@@ -131,6 +131,15 @@ struct ttm_placement vmw_sys_ne_placement = {
 	.busy_placement = &sys_ne_placement_flags
 };
 
+struct ttm_placement vmw_gmr_ne_placement = {
+	.fpfn = 0,
+	.lpfn = 0,
+	.num_placement = 1,
+	.placement = &gmr_ne_placement_flags,
+	.num_busy_placement = 1,
+	.busy_placement = &gmr_ne_placement_flags
+};
+
 static uint32_t evictable_placement_flags[] = {
 	TTM_PL_FLAG_SYSTEM | TTM_PL_FLAG_CACHED,
 	TTM_PL_FLAG_VRAM | TTM_PL_FLAG_CACHED,
@@ -171,6 +180,7 @@ struct vmw_ttm_backend {
 	unsigned long num_pages;
 	struct vmw_private *dev_priv;
 	int gmr_id;
+	struct vmw_gmr_desc_cache gmr_desc;
 	struct vmw_mob *mob;
 	int mem_type;
 	struct sg_table sgt;
@@ -438,6 +448,9 @@ static void vmw_ttm_unmap_dma(struct vmw_ttm_backend *vmw_be)
 	if (!vmw_be->mapped)
 		return;
 
+	/* Cached GMR descriptors refer to the DMA addresses going away. */
+	vmw_gmr_desc_cache_release(dev_priv, &vmw_be->gmr_desc);
+
 	switch (dev_priv->map_mode) {
 	case vmw_dma_map_bind:
 	case vmw_dma_map_populate:
@@ -535,7 +548,8 @@ static int vmw_ttm_bind(struct ttm_backend *backend, struct ttm_mem_reg *bo_mem)
 	switch (bo_mem->mem_type) {
 	case VMW_PL_GMR:
 		return vmw_gmr_bind(vmw_be->dev_priv, &vmw_be->vsgt,
-				    vmw_be->num_pages, vmw_be->gmr_id);
+				    vmw_be->num_pages, vmw_be->gmr_id,
+				    &vmw_be->gmr_desc);
 	case VMW_PL_MOB:
 		if (unlikely(vmw_be->mob == NULL)) {
 			vmw_be->mob =
@@ -596,6 +610,7 @@ static void vmw_ttm_destroy(struct ttm_backend *backend)
 
 	if (vmw_be->mob)
 		vmw_mob_destroy(vmw_be->mob);
+	vmw_gmr_desc_cache_release(vmw_be->dev_priv, &vmw_be->gmr_desc);
 	kfree(vmw_be);
 }
 
@@ -617,6 +632,7 @@ struct ttm_backend *vmw_ttm_backend_init(struct ttm_bo_device *bdev)
 
 	vmw_be->backend.func = &vmw_ttm_func;
 	vmw_be->dev_priv = container_of(bdev, struct vmw_private, bdev);
+	INIT_LIST_HEAD(&vmw_be->gmr_desc.pages);
 	vmw_be->mob = NULL;
 
 	return &vmw_be->backend;
@@ -788,6 +804,7 @@ static void vmw_swap_notify(struct ttm_buffer_object *bo)
 	spin_lock(&bdev->fence_lock);
 	ttm_bo_wait(bo, false, false, false);
 	spin_unlock(&bdev->fence_lock);
+	vmw_resource_swap_notify(bo);
 }
 
 
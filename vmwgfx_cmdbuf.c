@@ -0,0 +1,984 @@
+/**************************************************************************
+ *
+ * Copyright © 2015 VMware, Inc., Palo Alto, CA., USA
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#include "vmwgfx_drv.h"
+
+/*
+ * Size of the command buffers in the pool, including the header.
+ * Larger reservations get a dedicated buffer.
+ */
+#define VMW_CMDBUF_ALLOC_SIZE (64 * 1024)
+#define VMW_CMDBUF_NUM_BUFFERS 16
+#define VMW_CMDBUF_TIMEOUT (3 * HZ)
+
+/**
+ * struct vmw_cmdbuf_header - A command buffer and its device header.
+ *
+ * @man: The manager this buffer belongs to.
+ * @cb_header: Virtual address of the device header. The commands
+ * immediately follow the header.
+ * @cmd: Virtual address of the command area.
+ * @handle: Bus address of the device header.
+ * @size: Size of the command area in bytes.
+ * @start: Offset into the command area of the first submitted byte.
+ * Non-zero when the tail of a buffer is resubmitted after a command error.
+ * @cb_context: The device context this buffer is submitted to.
+ * @list: List head for the manager free-, submitted- or retired lists.
+ * @dedicated: Whether this buffer is not part of the pool but was
+ * allocated for a single large reservation.
+ */
+struct vmw_cmdbuf_header {
+	struct vmw_cmdbuf_man *man;
+	SVGACBHeader *cb_header;
+	u8 *cmd;
+	dma_addr_t handle;
+	size_t size;
+	u32 start;
+	SVGACBContext cb_context;
+	struct list_head list;
+	bool dedicated;
+};
+
+/**
+ * struct vmw_cmdbuf_man - Command buffer manager.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @cur_mutex: Protects @cur, @cur_pos and @reserved. Held from
+ * vmw_cmdbuf_reserve() to vmw_cmdbuf_commit(), and serializes
+ * submission so that buffers reach the device in order.
+ * @submit_mutex: Serializes handing buffers to the device with command
+ * error recovery, which reorders the buffers in the device queue.
+ * @dev_mutex: Serializes the use of @dheader.
+ * @lock: Protects the buffer lists, @num_submitted and @error.
+ * @free: Pool buffers available for reservation.
+ * @submitted: Buffers handed to the device, in submission order.
+ * @retired: Dedicated buffers the device is done with, waiting to be
+ * freed in a context where that is allowed.
+ * @num_submitted: Number of buffers on @submitted.
+ * @cur: The buffer currently being filled, if any.
+ * @cur_pos: Number of committed bytes in @cur.
+ * @reserved: Number of bytes reserved in @cur but not yet committed.
+ * @error: Buffer that failed with a command error. The device stopped
+ * context 0, which needs to be restarted.
+ * @work: Worker that recovers from command errors outside of waits.
+ * @dheader: Buffer used for device context commands.
+ * @pool: The pool buffers.
+ */
+struct vmw_cmdbuf_man {
+	struct vmw_private *dev_priv;
+	struct mutex cur_mutex;
+	struct mutex submit_mutex;
+	struct mutex dev_mutex;
+	spinlock_t lock;
+	struct list_head free;
+	struct list_head submitted;
+	struct list_head retired;
+	unsigned int num_submitted;
+	struct vmw_cmdbuf_header *cur;
+	size_t cur_pos;
+	size_t reserved;
+	struct vmw_cmdbuf_header *error;
+	struct work_struct work;
+	struct vmw_cmdbuf_header dheader;
+	struct vmw_cmdbuf_header pool[VMW_CMDBUF_NUM_BUFFERS];
+};
+
+/**
+ * vmw_cmdbuf_header_init - Allocate the device memory of a command buffer.
+ *
+ * @man: The command buffer manager.
+ * @header: The command buffer to initialize.
+ * @size: Size of the command area in bytes.
+ *
+ * The header and the command area are allocated as a single coherent
+ * chunk, so the device header is always page aligned.
+ */
+static int vmw_cmdbuf_header_init(struct vmw_cmdbuf_man *man,
+				  struct vmw_cmdbuf_header *header,
+				  size_t size)
+{
+	void *virt;
+
+	virt = dma_alloc_coherent(man->dev_priv->dev->dev,
+				  size + sizeof(SVGACBHeader),
+				  &header->handle, GFP_KERNEL);
+	if (unlikely(virt == NULL))
+		return -ENOMEM;
+
+	header->man = man;
+	header->cb_header = virt;
+	header->cmd = (u8 *) virt + sizeof(SVGACBHeader);
+	header->size = size;
+	header->start = 0;
+	header->cb_context = SVGA_CB_CONTEXT_0;
+	header->dedicated = false;
+	INIT_LIST_HEAD(&header->list);
+
+	return 0;
+}
+
+/**
+ * vmw_cmdbuf_header_fini - Free the device memory of a command buffer.
+ *
+ * @header: The command buffer.
+ */
+static void vmw_cmdbuf_header_fini(struct vmw_cmdbuf_header *header)
+{
+	dma_free_coherent(header->man->dev_priv->dev->dev,
+			  header->size + sizeof(SVGACBHeader),
+			  header->cb_header, header->handle);
+	header->cb_header = NULL;
+}
+
+/**
+ * vmw_cmdbuf_header_free - Free a dedicated command buffer.
+ *
+ * @header: The command buffer.
+ */
+static void vmw_cmdbuf_header_free(struct vmw_cmdbuf_header *header)
+{
+	BUG_ON(!header->dedicated);
+	vmw_cmdbuf_header_fini(header);
+	kfree(header);
+}
+
+/**
+ * vmw_cmdbuf_header_write - Hand a command buffer to the device.
+ *
+ * @header: The command buffer. Its device header must be filled in.
+ */
+static void vmw_cmdbuf_header_write(struct vmw_cmdbuf_header *header)
+{
+	struct vmw_private *dev_priv = header->man->dev_priv;
+	u32 val = upper_32_bits(header->handle);
+
+	/* Make the header and commands visible before submitting. */
+	wmb();
+
+	mutex_lock(&dev_priv->hw_mutex);
+	vmw_write(dev_priv, SVGA_REG_COMMAND_HIGH, val);
+	val = lower_32_bits(header->handle);
+	val |= header->cb_context & SVGA_CB_CONTEXT_MASK;
+	vmw_write(dev_priv, SVGA_REG_COMMAND_LOW, val);
+	mutex_unlock(&dev_priv->hw_mutex);
+}
+
+/**
+ * vmw_cmdbuf_header_prepare - Fill in the device header of a command
+ * buffer.
+ *
+ * @header: The command buffer.
+ * @length: Number of command bytes to submit.
+ */
+static void vmw_cmdbuf_header_prepare(struct vmw_cmdbuf_header *header,
+				      size_t length)
+{
+	SVGACBHeader *cb_header = header->cb_header;
+
+	header->start = 0;
+	memset(cb_header, 0, sizeof(*cb_header));
+	cb_header->status = SVGA_CB_STATUS_NONE;
+	cb_header->flags = SVGA_CB_FLAG_NONE;
+	cb_header->length = length;
+	cb_header->ptr.pa = cpu_to_le64(header->handle +
+					sizeof(SVGACBHeader));
+}
+
+/**
+ * __vmw_cmdbuf_retire - Put a buffer the device is done with back.
+ *
+ * @man: The command buffer manager. @man::lock must be held.
+ * @header: The command buffer.
+ *
+ * Pool buffers go back on the free list. Dedicated buffers are freed
+ * later by vmw_cmdbuf_free_retired().
+ */
+static void __vmw_cmdbuf_retire(struct vmw_cmdbuf_man *man,
+				struct vmw_cmdbuf_header *header)
+{
+	if (header->dedicated)
+		list_add_tail(&header->list, &man->retired);
+	else
+		list_add(&header->list, &man->free);
+}
+
+/**
+ * vmw_cmdbuf_submit - Hand a prepared command buffer to the device.
+ *
+ * @man: The command buffer manager. The caller must hold
+ * @man::submit_mutex.
+ * @header: The command buffer.
+ */
+static void vmw_cmdbuf_submit(struct vmw_cmdbuf_man *man,
+			      struct vmw_cmdbuf_header *header)
+{
+	spin_lock(&man->lock);
+	list_add_tail(&header->list, &man->submitted);
+	++man->num_submitted;
+	spin_unlock(&man->lock);
+
+	vmw_cmdbuf_header_write(header);
+}
+
+/**
+ * vmw_cmdbuf_process - Retire command buffers the device is done with.
+ *
+ * @man: The command buffer manager.
+ *
+ * Buffers in a context complete in submission order, so the submitted
+ * list is walked until the first buffer the device hasn't touched.
+ * A buffer that failed with a command error is set aside for
+ * vmw_cmdbuf_recover(), and preempted buffers are left for it to resubmit.
+ * Only takes a spinlock, so it's safe to call from wait conditions.
+ */
+static void vmw_cmdbuf_process(struct vmw_cmdbuf_man *man)
+{
+	struct vmw_cmdbuf_header *entry, *next;
+
+	spin_lock(&man->lock);
+	list_for_each_entry_safe(entry, next, &man->submitted, list) {
+		SVGACBStatus status = entry->cb_header->status;
+
+		if (status == SVGA_CB_STATUS_NONE ||
+		    status == SVGA_CB_STATUS_PREEMPTED)
+			break;
+
+		list_del_init(&entry->list);
+		--man->num_submitted;
+
+		if (status == SVGA_CB_STATUS_COMMAND_ERROR) {
+			/* The context is stopped behind this buffer. */
+			man->error = entry;
+			break;
+		}
+
+		if (status != SVGA_CB_STATUS_COMPLETED)
+			DRM_ERROR("Command buffer error status %u.\n",
+				  (unsigned int) status);
+
+		__vmw_cmdbuf_retire(man, entry);
+	}
+	spin_unlock(&man->lock);
+}
+
+/**
+ * vmw_cmdbuf_free_retired - Free dedicated buffers the device is done with.
+ *
+ * @man: The command buffer manager.
+ */
+static void vmw_cmdbuf_free_retired(struct vmw_cmdbuf_man *man)
+{
+	struct vmw_cmdbuf_header *entry, *next;
+	LIST_HEAD(retired);
+
+	spin_lock(&man->lock);
+	list_splice_init(&man->retired, &retired);
+	spin_unlock(&man->lock);
+
+	list_for_each_entry_safe(entry, next, &retired, list) {
+		list_del(&entry->list);
+		vmw_cmdbuf_header_free(entry);
+	}
+}
+
+static bool vmw_cmdbuf_free_avail(struct vmw_cmdbuf_man *man)
+{
+	bool ret;
+
+	vmw_cmdbuf_process(man);
+	spin_lock(&man->lock);
+	ret = !list_empty(&man->free) || man->error != NULL;
+	spin_unlock(&man->lock);
+
+	return ret;
+}
+
+static bool vmw_cmdbuf_queue_room(struct vmw_cmdbuf_man *man)
+{
+	bool ret;
+
+	vmw_cmdbuf_process(man);
+	spin_lock(&man->lock);
+	ret = man->num_submitted < SVGA_CB_MAX_QUEUED_PER_CONTEXT ||
+		man->error != NULL;
+	spin_unlock(&man->lock);
+
+	return ret;
+}
+
+static bool vmw_cmdbuf_man_idle(struct vmw_cmdbuf_man *man)
+{
+	bool ret;
+
+	vmw_cmdbuf_process(man);
+	spin_lock(&man->lock);
+	ret = list_empty(&man->submitted) || man->error != NULL;
+	spin_unlock(&man->lock);
+
+	return ret;
+}
+
+/**
+ * vmw_cmdbuf_send_device_command - Synchronously execute a device
+ * context command.
+ *
+ * @man: The command buffer manager.
+ * @command: The command.
+ * @size: Size of the command in bytes.
+ *
+ * Returns 0 if the device completed the command, -EBUSY on timeout and
+ * -EINVAL if the device failed it.
+ */
+static int vmw_cmdbuf_send_device_command(struct vmw_cmdbuf_man *man,
+					  const void *command, size_t size)
+{
+	struct vmw_private *dev_priv = man->dev_priv;
+	struct vmw_cmdbuf_header *header = &man->dheader;
+	SVGACBStatus status;
+	long ret;
+
+	BUG_ON(size > header->size);
+
+	mutex_lock(&man->dev_mutex);
+	memcpy(header->cmd, command, size);
+	vmw_cmdbuf_header_prepare(header, size);
+
+	vmw_cmdbuf_waiter_add(dev_priv);
+	vmw_cmdbuf_header_write(header);
+	ret = wait_event_timeout(dev_priv->cmdbuf_queue,
+				 header->cb_header->status !=
+				 SVGA_CB_STATUS_NONE,
+				 VMW_CMDBUF_TIMEOUT);
+	vmw_cmdbuf_waiter_remove(dev_priv);
+
+	status = header->cb_header->status;
+	mutex_unlock(&man->dev_mutex);
+
+	if (unlikely(ret == 0)) {
+		DRM_ERROR("Device context command timeout.\n");
+		return -EBUSY;
+	}
+
+	if (unlikely(status != SVGA_CB_STATUS_COMPLETED)) {
+		DRM_ERROR("Device context command failed with status %u.\n",
+			  (unsigned int) status);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/**
+ * vmw_cmdbuf_startstop - Start or stop command buffer context 0.
+ *
+ * @man: The command buffer manager.
+ * @enable: Whether to start or stop the context.
+ */
+static int vmw_cmdbuf_startstop(struct vmw_cmdbuf_man *man, bool enable)
+{
+	struct {
+		uint32 id;
+		SVGADCCmdStartStop body;
+	} __packed cmd;
+
+	cmd.id = SVGA_DC_CMD_START_STOP_CONTEXT;
+	cmd.body.enable = (enable) ? 1 : 0;
+	cmd.body.context = SVGA_CB_CONTEXT_0;
+
+	return vmw_cmdbuf_send_device_command(man, &cmd, sizeof(cmd));
+}
+
+/**
+ * vmw_cmdbuf_preempt - Preempt command buffer context 0.
+ *
+ * @man: The command buffer manager.
+ *
+ * Buffers the context hasn't completed are handed back with status
+ * SVGA_CB_STATUS_PREEMPTED.
+ */
+static int vmw_cmdbuf_preempt(struct vmw_cmdbuf_man *man)
+{
+	struct {
+		uint32 id;
+		SVGADCCmdPreempt body;
+	} __packed cmd;
+
+	cmd.id = SVGA_DC_CMD_PREEMPT;
+	cmd.body.context = SVGA_CB_CONTEXT_0;
+	cmd.body.ignoreIDZero = 0;
+
+	return vmw_cmdbuf_send_device_command(man, &cmd, sizeof(cmd));
+}
+
+/**
+ * vmw_cmdbuf_cmd_size - Size of a command in a command buffer.
+ *
+ * @cmd: The command.
+ * @left: Number of bytes from @cmd to the end of the buffer.
+ *
+ * Returns the size of the command in bytes, or 0 if the command is
+ * unknown or truncated.
+ */
+static u32 vmw_cmdbuf_cmd_size(const u8 *cmd, u32 left)
+{
+	const uint32_t *data = (const uint32_t *) cmd;
+	const SVGAFifoCmdRemapGMR2 *remap;
+	uint32_t id, size, num_ppns;
+
+	if (left < sizeof(uint32_t))
+		return 0;
+
+	id = le32_to_cpu(data[0]);
+	if (id >= SVGA_3D_CMD_BASE && id < SVGA_3D_CMD_MAX) {
+		if (left < sizeof(SVGA3dCmdHeader))
+			return 0;
+		size = sizeof(SVGA3dCmdHeader) + le32_to_cpu(data[1]);
+		return (size <= left) ? size : 0;
+	}
+
+	size = sizeof(uint32_t);
+	switch (id) {
+	case SVGA_CMD_UPDATE:
+		size += sizeof(SVGAFifoCmdUpdate);
+		break;
+	case SVGA_CMD_FENCE:
+		size += sizeof(SVGAFifoCmdFence);
+		break;
+	case SVGA_CMD_DEFINE_GMRFB:
+		size += sizeof(SVGAFifoCmdDefineGMRFB);
+		break;
+	case SVGA_CMD_BLIT_GMRFB_TO_SCREEN:
+		size += sizeof(SVGAFifoCmdBlitGMRFBToScreen);
+		break;
+	case SVGA_CMD_BLIT_SCREEN_TO_GMRFB:
+		size += sizeof(SVGAFifoCmdBlitScreenToGMRFB);
+		break;
+	case SVGA_CMD_DESTROY_SCREEN:
+		size += sizeof(SVGAFifoCmdDestroyScreen);
+		break;
+	case SVGA_CMD_DEFINE_SCREEN:
+		/* Variable length, starting with the structSize member. */
+		if (left < 2 * sizeof(uint32_t))
+			return 0;
+		size += le32_to_cpu(data[1]);
+		break;
+	case SVGA_CMD_DEFINE_GMR2:
+		size += sizeof(SVGAFifoCmdDefineGMR2);
+		break;
+	case SVGA_CMD_REMAP_GMR2:
+		size += sizeof(*remap);
+		if (left < size)
+			return 0;
+		remap = (const SVGAFifoCmdRemapGMR2 *) &data[1];
+		if (remap->flags & SVGA_REMAP_GMR2_VIA_GMR) {
+			size += sizeof(SVGAGuestPtr);
+			break;
+		}
+		num_ppns = (remap->flags & SVGA_REMAP_GMR2_SINGLE_PPN) ?
+			1 : remap->numPages;
+		size += num_ppns * ((remap->flags & SVGA_REMAP_GMR2_PPN64) ?
+				    sizeof(uint64_t) : sizeof(uint32_t));
+		break;
+	default:
+		return 0;
+	}
+
+	return (size <= left) ? size : 0;
+}
+
+/**
+ * vmw_cmdbuf_resubmit - Resubmit a command buffer the device handed back.
+ *
+ * @man: The command buffer manager. The caller must hold
+ * @man::submit_mutex.
+ * @header: The command buffer.
+ * @skip: Number of already submitted bytes to skip.
+ */
+static void vmw_cmdbuf_resubmit(struct vmw_cmdbuf_man *man,
+				struct vmw_cmdbuf_header *header,
+				u32 skip)
+{
+	SVGACBHeader *cb_header = header->cb_header;
+	u32 length = cb_header->length - skip;
+
+	header->start += skip;
+	memset(cb_header, 0, sizeof(*cb_header));
+	cb_header->status = SVGA_CB_STATUS_NONE;
+	cb_header->flags = SVGA_CB_FLAG_NONE;
+	cb_header->length = length;
+	cb_header->ptr.pa = cpu_to_le64(header->handle +
+					sizeof(SVGACBHeader) +
+					header->start);
+
+	vmw_cmdbuf_submit(man, header);
+}
+
+/**
+ * vmw_cmdbuf_recover - Recover from a command error.
+ *
+ * @man: The command buffer manager.
+ *
+ * The device stops context 0 at a failing command. The buffers queued
+ * behind the failing one are preempted, the context is restarted and the
+ * commands following the failing one are resubmitted, followed by the
+ * preempted buffers, so that later commands, in particular fences, still
+ * execute in order. If the size of the failing command can't be
+ * determined, the rest of its buffer is dropped.
+ *
+ * Returns true if there was an error to recover from.
+ */
+static bool vmw_cmdbuf_recover(struct vmw_cmdbuf_man *man)
+{
+	struct vmw_cmdbuf_header *error, *entry, *next;
+	SVGACBHeader *cb_header;
+	LIST_HEAD(preempted);
+	u32 offset, size;
+
+	mutex_lock(&man->submit_mutex);
+	spin_lock(&man->lock);
+	error = man->error;
+	man->error = NULL;
+	spin_unlock(&man->lock);
+
+	if (error == NULL) {
+		mutex_unlock(&man->submit_mutex);
+		return false;
+	}
+
+	if (vmw_cmdbuf_preempt(man) != 0)
+		DRM_ERROR("Failed preempting command buffer context.\n");
+
+	spin_lock(&man->lock);
+	list_for_each_entry_safe(entry, next, &man->submitted, list) {
+		if (entry->cb_header->status != SVGA_CB_STATUS_PREEMPTED)
+			continue;
+		list_move_tail(&entry->list, &preempted);
+		--man->num_submitted;
+	}
+	spin_unlock(&man->lock);
+
+	cb_header = error->cb_header;
+	offset = cb_header->errorOffset;
+	DRM_ERROR("Command buffer error at offset %u.\n",
+		  (unsigned int) offset);
+
+	size = 0;
+	if (offset < cb_header->length)
+		size = vmw_cmdbuf_cmd_size(error->cmd + error->start + offset,
+					   cb_header->length - offset);
+	if (size == 0) {
+		DRM_ERROR("Unknown failing command. "
+			  "Dropping the rest of the buffer.\n");
+		offset = cb_header->length;
+	}
+
+	if (vmw_cmdbuf_startstop(man, true) != 0)
+		DRM_ERROR("Failed restarting command buffer context.\n");
+
+	if (offset + size < cb_header->length) {
+		vmw_cmdbuf_resubmit(man, error, offset + size);
+	} else {
+		spin_lock(&man->lock);
+		__vmw_cmdbuf_retire(man, error);
+		spin_unlock(&man->lock);
+	}
+
+	list_for_each_entry_safe(entry, next, &preempted, list) {
+		list_del_init(&entry->list);
+		vmw_cmdbuf_resubmit(man, entry, 0);
+	}
+	mutex_unlock(&man->submit_mutex);
+
+	wake_up_all(&man->dev_priv->cmdbuf_queue);
+
+	return true;
+}
+
+/**
+ * vmw_cmdbuf_work_func - Recover from command errors outside of waits.
+ *
+ * @work: The manager's work struct.
+ */
+static void vmw_cmdbuf_work_func(struct work_struct *work)
+{
+	struct vmw_cmdbuf_man *man =
+		container_of(work, struct vmw_cmdbuf_man, work);
+
+	vmw_cmdbuf_process(man);
+	(void) vmw_cmdbuf_recover(man);
+}
+
+/**
+ * vmw_cmdbuf_kick - Check for command errors and recover from them.
+ *
+ * @man: The command buffer manager.
+ *
+ * Called from the interrupt handler and by fence waiters, so that a
+ * context stopped by a command error is restarted even if nobody waits
+ * on the manager itself. May be called from atomic context.
+ */
+void vmw_cmdbuf_kick(struct vmw_cmdbuf_man *man)
+{
+	schedule_work(&man->work);
+}
+
+/**
+ * vmw_cmdbuf_wait - Wait for a command buffer manager condition.
+ *
+ * @man: The command buffer manager.
+ * @cond: The condition. Also returns true if a command error needs to be
+ * recovered from.
+ * @interruptible: Whether to wait interruptible.
+ * @timeout: Timeout in jiffies.
+ *
+ * Returns 0 on success, -EBUSY on timeout and -ERESTARTSYS if
+ * interrupted by a signal.
+ */
+static int vmw_cmdbuf_wait(struct vmw_cmdbuf_man *man,
+			   bool (*cond)(struct vmw_cmdbuf_man *),
+			   bool interruptible, unsigned long timeout)
+{
+	struct vmw_private *dev_priv = man->dev_priv;
+	long ret;
+
+	for (;;) {
+		if (cond(man)) {
+			if (vmw_cmdbuf_recover(man))
+				continue;
+			return 0;
+		}
+
+		vmw_cmdbuf_waiter_add(dev_priv);
+		if (interruptible)
+			ret = wait_event_interruptible_timeout
+				(dev_priv->cmdbuf_queue, cond(man), timeout);
+		else
+			ret = wait_event_timeout
+				(dev_priv->cmdbuf_queue, cond(man), timeout);
+		vmw_cmdbuf_waiter_remove(dev_priv);
+
+		if (unlikely(ret == 0)) {
+			DRM_ERROR("SVGA device lockup.\n");
+			return -EBUSY;
+		} else if (unlikely(ret < 0))
+			return ret;
+	}
+}
+
+/**
+ * vmw_cmdbuf_cur_submit - Submit the buffer currently being filled.
+ *
+ * @man: The command buffer manager. The caller must hold
+ * @man::cur_mutex.
+ */
+static void vmw_cmdbuf_cur_submit(struct vmw_cmdbuf_man *man)
+{
+	struct vmw_cmdbuf_header *header = man->cur;
+
+	if (header == NULL)
+		return;
+
+	man->cur = NULL;
+	if (man->cur_pos == 0) {
+		if (header->dedicated) {
+			vmw_cmdbuf_header_free(header);
+		} else {
+			spin_lock(&man->lock);
+			list_add(&header->list, &man->free);
+			spin_unlock(&man->lock);
+		}
+		return;
+	}
+
+	/*
+	 * On timeout the buffer is submitted anyway. The device will then
+	 * report a full queue, which is logged on retirement.
+	 */
+	(void) vmw_cmdbuf_wait(man, vmw_cmdbuf_queue_room, false,
+			       VMW_CMDBUF_TIMEOUT);
+
+	vmw_cmdbuf_header_prepare(header, man->cur_pos);
+	mutex_lock(&man->submit_mutex);
+	vmw_cmdbuf_submit(man, header);
+	mutex_unlock(&man->submit_mutex);
+}
+
+/**
+ * vmw_cmdbuf_get - Get an empty command buffer.
+ *
+ * @man: The command buffer manager.
+ * @size: Minimum size of the command area.
+ *
+ * Returns NULL on failure.
+ */
+static struct vmw_cmdbuf_header *vmw_cmdbuf_get(struct vmw_cmdbuf_man *man,
+						size_t size)
+{
+	struct vmw_cmdbuf_header *header;
+	int ret;
+
+	if (size > man->pool[0].size) {
+		if (unlikely(size > SVGA_CB_MAX_SIZE)) {
+			DRM_ERROR("Command buffer reservation too large.\n");
+			return NULL;
+		}
+
+		header = kzalloc(sizeof(*header), GFP_KERNEL);
+		if (unlikely(header == NULL))
+			return NULL;
+
+		ret = vmw_cmdbuf_header_init(man, header, size);
+		if (unlikely(ret != 0)) {
+			kfree(header);
+			return NULL;
+		}
+
+		header->dedicated = true;
+		return header;
+	}
+
+	ret = vmw_cmdbuf_wait(man, vmw_cmdbuf_free_avail, false,
+			      VMW_CMDBUF_TIMEOUT);
+	if (unlikely(ret != 0))
+		return NULL;
+
+	spin_lock(&man->lock);
+	header = list_first_entry(&man->free, struct vmw_cmdbuf_header,
+				  list);
+	list_del_init(&header->list);
+	spin_unlock(&man->lock);
+
+	return header;
+}
+
+/**
+ * vmw_cmdbuf_reserve - Reserve space for commands.
+ *
+ * @man: The command buffer manager.
+ * @size: Number of bytes to reserve.
+ *
+ * Space is reserved at the end of the buffer currently being filled,
+ * which is submitted first if the reservation doesn't fit.
+ * On success, the reservation must be closed with vmw_cmdbuf_commit().
+ *
+ * Returns a pointer to the reserved space, or NULL on failure.
+ */
+void *vmw_cmdbuf_reserve(struct vmw_cmdbuf_man *man, size_t size)
+{
+	struct vmw_cmdbuf_header *header;
+
+	mutex_lock(&man->cur_mutex);
+	vmw_cmdbuf_free_retired(man);
+
+	if (man->cur != NULL && man->cur_pos + size > man->cur->size)
+		vmw_cmdbuf_cur_submit(man);
+
+	if (man->cur == NULL) {
+		header = vmw_cmdbuf_get(man, size);
+		if (unlikely(header == NULL)) {
+			mutex_unlock(&man->cur_mutex);
+			return NULL;
+		}
+
+		man->cur = header;
+		man->cur_pos = 0;
+	}
+
+	man->reserved = size;
+	return man->cur->cmd + man->cur_pos;
+}
+
+/**
+ * vmw_cmdbuf_commit - Commit commands written to a reservation.
+ *
+ * @man: The command buffer manager.
+ * @size: Number of bytes to commit. May be smaller than the reservation.
+ * @flush: Whether to submit the current buffer to the device. Otherwise
+ * the commands are batched with subsequent ones until a later flush or
+ * until the buffer fills up.
+ */
+void vmw_cmdbuf_commit(struct vmw_cmdbuf_man *man, size_t size, bool flush)
+{
+	BUG_ON((size & 3) != 0);
+	BUG_ON(size > man->reserved);
+
+	man->cur_pos += size;
+	man->reserved = 0;
+
+	if (flush)
+		vmw_cmdbuf_cur_submit(man);
+
+	mutex_unlock(&man->cur_mutex);
+}
+
+/**
+ * vmw_cmdbuf_flush - Submit any batched commands to the device.
+ *
+ * @man: The command buffer manager.
+ */
+void vmw_cmdbuf_flush(struct vmw_cmdbuf_man *man)
+{
+	mutex_lock(&man->cur_mutex);
+	vmw_cmdbuf_cur_submit(man);
+	mutex_unlock(&man->cur_mutex);
+}
+
+/**
+ * vmw_cmdbuf_idle - Flush and wait for the device to finish all
+ * submitted command buffers.
+ *
+ * @man: The command buffer manager.
+ * @interruptible: Whether to wait interruptible.
+ * @timeout: Timeout in jiffies.
+ */
+int vmw_cmdbuf_idle(struct vmw_cmdbuf_man *man, bool interruptible,
+		    unsigned long timeout)
+{
+	vmw_cmdbuf_flush(man);
+	return vmw_cmdbuf_wait(man, vmw_cmdbuf_man_idle, interruptible,
+			       timeout);
+}
+
+/**
+ * vmw_cmdbuf_man_create - Create a command buffer manager and start
+ * command buffer context 0.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ *
+ * Returns a pointer to the manager or an error pointer on failure.
+ */
+struct vmw_cmdbuf_man *vmw_cmdbuf_man_create(struct vmw_private *dev_priv)
+{
+	struct vmw_cmdbuf_man *man;
+	int i, ret;
+
+	man = kzalloc(sizeof(*man), GFP_KERNEL);
+	if (unlikely(man == NULL))
+		return ERR_PTR(-ENOMEM);
+
+	man->dev_priv = dev_priv;
+	mutex_init(&man->cur_mutex);
+	mutex_init(&man->submit_mutex);
+	mutex_init(&man->dev_mutex);
+	spin_lock_init(&man->lock);
+	INIT_LIST_HEAD(&man->free);
+	INIT_LIST_HEAD(&man->submitted);
+	INIT_LIST_HEAD(&man->retired);
+	INIT_WORK(&man->work, vmw_cmdbuf_work_func);
+
+	ret = vmw_cmdbuf_header_init(man, &man->dheader,
+				     PAGE_SIZE - sizeof(SVGACBHeader));
+	if (unlikely(ret != 0))
+		goto out_no_dheader;
+	man->dheader.cb_context = SVGA_CB_CONTEXT_DEVICE;
+
+	for (i = 0; i < VMW_CMDBUF_NUM_BUFFERS; ++i) {
+		ret = vmw_cmdbuf_header_init(man, &man->pool[i],
+					     VMW_CMDBUF_ALLOC_SIZE -
+					     sizeof(SVGACBHeader));
+		if (unlikely(ret != 0))
+			goto out_no_pool;
+		list_add_tail(&man->pool[i].list, &man->free);
+	}
+
+	ret = vmw_cmdbuf_startstop(man, true);
+	if (unlikely(ret != 0))
+		goto out_no_pool;
+
+	vmw_cmdbuf_error_irq(dev_priv, true);
+
+	return man;
+
+out_no_pool:
+	while (--i >= 0)
+		vmw_cmdbuf_header_fini(&man->pool[i]);
+	vmw_cmdbuf_header_fini(&man->dheader);
+out_no_dheader:
+	kfree(man);
+	return ERR_PTR(ret);
+}
+
+/**
+ * vmw_cmdbuf_man_destroy - Idle the device, stop command buffer context
+ * 0 and free the manager.
+ *
+ * @man: The command buffer manager.
+ *
+ * Buffers that didn't complete are preempted before the context is
+ * stopped. If the device still owns any buffer after that, the buffer
+ * memory is leaked rather than freed under the device.
+ */
+void vmw_cmdbuf_man_destroy(struct vmw_cmdbuf_man *man)
+{
+	struct vmw_cmdbuf_header *entry, *next;
+	LIST_HEAD(busy);
+	bool idle;
+	int i;
+
+	if (vmw_cmdbuf_idle(man, false, 10 * HZ) != 0 &&
+	    vmw_cmdbuf_preempt(man) != 0)
+		DRM_ERROR("Failed preempting command buffer context.\n");
+
+	if (vmw_cmdbuf_startstop(man, false) != 0)
+		DRM_ERROR("Failed stopping command buffer context.\n");
+
+	vmw_cmdbuf_error_irq(man->dev_priv, false);
+	cancel_work_sync(&man->work);
+
+	vmw_cmdbuf_process(man);
+	spin_lock(&man->lock);
+	list_splice_init(&man->submitted, &busy);
+	man->num_submitted = 0;
+	if (man->error != NULL) {
+		list_add_tail(&man->error->list, &busy);
+		man->error = NULL;
+	}
+	spin_unlock(&man->lock);
+
+	idle = (man->dheader.cb_header->status != SVGA_CB_STATUS_NONE);
+	list_for_each_entry(entry, &busy, list)
+		if (entry->cb_header->status == SVGA_CB_STATUS_NONE)
+			idle = false;
+
+	if (unlikely(!idle)) {
+		DRM_ERROR("Device still owns command buffers. "
+			  "Leaking them.\n");
+		kfree(man);
+		return;
+	}
+
+	list_for_each_entry_safe(entry, next, &busy, list) {
+		list_del(&entry->list);
+		if (entry->dedicated)
+			vmw_cmdbuf_header_free(entry);
+	}
+	vmw_cmdbuf_free_retired(man);
+	for (i = 0; i < VMW_CMDBUF_NUM_BUFFERS; ++i)
+		vmw_cmdbuf_header_fini(&man->pool[i]);
+	vmw_cmdbuf_header_fini(&man->dheader);
+	kfree(man);
+}
@@ -61,7 +61,9 @@ struct vmw_cmdbuf_res {
  * @list: List of commited command buffer resources.
  * @dev_priv: Pointer to a device private structure.
  *
- * @resources and @list are protected by the cmdbuf mutex for now.
+ * @resources and @list are protected by the cmdbuf mutex of the file
+ * owning the context during command submission. The context holds a
+ * reference during submission, so destruction can't race with it.
  */
 struct vmw_cmdbuf_res_manager {
 	struct drm_open_hash resources;
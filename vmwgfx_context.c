@@ -266,7 +266,7 @@ static int vmw_gb_context_create(struct vmw_resource *res)
 	cmd->header.id = SVGA_3D_CMD_DEFINE_GB_CONTEXT;
 	cmd->header.size = sizeof(cmd->body);
 	cmd->body.cid = res->id;
-	vmw_fifo_commit(dev_priv, sizeof(*cmd));
+	vmw_fifo_commit_noflush(dev_priv, sizeof(*cmd));
 	(void) vmw_3d_resource_inc(dev_priv, false);
 
 	return 0;
@@ -302,7 +302,7 @@ static int vmw_gb_context_bind(struct vmw_resource *res,
 	cmd->body.mobid = bo->mem.start;
 	cmd->body.validContents = res->backup_dirty;
 	res->backup_dirty = false;
-	vmw_fifo_commit(dev_priv, sizeof(*cmd));
+	vmw_fifo_commit_noflush(dev_priv, sizeof(*cmd));
 
 	return 0;
 }
@@ -357,7 +357,7 @@ static int vmw_gb_context_unbind(struct vmw_resource *res,
 	cmd2->body.cid = res->id;
 	cmd2->body.mobid = SVGA3D_INVALID_ID;
 
-	vmw_fifo_commit(dev_priv, submit_size);
+	vmw_fifo_commit_noflush(dev_priv, submit_size);
 	mutex_unlock(&dev_priv->binding_mutex);
 
 	/*
@@ -452,47 +452,52 @@ int vmw_context_destroy_ioctl(struct drm_device *dev, void *data,
 	return ttm_ref_object_base_unref(tfile, arg->cid, TTM_REF_USAGE);
 }
 
-int vmw_context_define_ioctl(struct drm_device *dev, void *data,
-			     struct drm_file *file_priv)
+/**
+ * vmw_context_acc_size - Graphics memory accounted per user context.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ */
+uint64_t vmw_context_acc_size(struct vmw_private *dev_priv)
 {
-	struct vmw_private *dev_priv = vmw_priv(dev);
-	struct vmw_user_context *ctx;
-	struct vmw_resource *res;
-	struct vmw_resource *tmp;
-	struct drm_vmw_context_arg *arg = (struct drm_vmw_context_arg *)data;
-	struct ttm_object_file *tfile = vmw_fpriv(file_priv)->tfile;
-	int ret;
-
-
 	/*
 	 * Approximate idr memory usage with 128 bytes. It will be limited
 	 * by maximum number_of contexts anyway.
 	 */
 
 	if (unlikely(vmw_user_context_size == 0))
-		vmw_user_context_size = ttm_round_pot(sizeof(*ctx)) + 128 +
-		  ((dev_priv->has_mob) ? vmw_cmdbuf_res_man_size() : 0);
+		vmw_user_context_size =
+			ttm_round_pot(sizeof(struct vmw_user_context)) + 128 +
+			((dev_priv->has_mob) ? vmw_cmdbuf_res_man_size() : 0);
 
-	ret = ttm_read_lock(&dev_priv->reservation_sem, true);
-	if (unlikely(ret != 0))
-		return ret;
+	return vmw_user_context_size;
+}
 
-	ret = ttm_mem_global_alloc(vmw_mem_glob(dev_priv),
-				   vmw_user_context_size,
-				   false, true);
-	if (unlikely(ret != 0)) {
-		if (ret != -ERESTARTSYS)
-			DRM_ERROR("Out of graphics memory for context"
-				  " creation.\n");
-		goto out_unlock;
-	}
+/**
+ * vmw_context_define - Create a user context.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @tfile: The ttm object file the context handle is registered with.
+ * @cid: Assigned the handle of the new context on success.
+ *
+ * The caller must hold the reservation_sem in read mode and must already
+ * have accounted vmw_context_acc_size() bytes of graphics memory for the
+ * context. That accounting is handed over to the context and released
+ * by its destructor, or by this function on failure.
+ */
+int vmw_context_define(struct vmw_private *dev_priv,
+		       struct ttm_object_file *tfile,
+		       uint32_t *cid)
+{
+	struct vmw_user_context *ctx;
+	struct vmw_resource *res;
+	struct vmw_resource *tmp;
+	int ret;
 
 	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
 	if (unlikely(ctx == NULL)) {
 		ttm_mem_global_free(vmw_mem_glob(dev_priv),
-				    vmw_user_context_size);
-		ret = -ENOMEM;
-		goto out_unlock;
+				    vmw_context_acc_size(dev_priv));
+		return -ENOMEM;
 	}
 
 	res = &ctx->res;
@@ -505,7 +510,7 @@ int vmw_context_define_ioctl(struct drm_device *dev, void *data,
 
 	ret = vmw_context_init(dev_priv, res, vmw_user_context_free);
 	if (unlikely(ret != 0))
-		goto out_unlock;
+		return ret;
 
 	tmp = vmw_resource_reference(&ctx->res);
 	ret = ttm_base_object_init(tfile, &ctx->base, false, VMW_RES_CONTEXT,
@@ -516,9 +521,35 @@ int vmw_context_define_ioctl(struct drm_device *dev, void *data,
 		goto out_err;
 	}
 
-	arg->cid = ctx->base.hash.key;
+	*cid = ctx->base.hash.key;
 out_err:
 	vmw_resource_unreference(&res);
+	return ret;
+}
+
+int vmw_context_define_ioctl(struct drm_device *dev, void *data,
+			     struct drm_file *file_priv)
+{
+	struct vmw_private *dev_priv = vmw_priv(dev);
+	struct drm_vmw_context_arg *arg = (struct drm_vmw_context_arg *)data;
+	struct ttm_object_file *tfile = vmw_fpriv(file_priv)->tfile;
+	int ret;
+
+	ret = ttm_read_lock(&dev_priv->reservation_sem, true);
+	if (unlikely(ret != 0))
+		return ret;
+
+	ret = ttm_mem_global_alloc(vmw_mem_glob(dev_priv),
+				   vmw_context_acc_size(dev_priv),
+				   false, true);
+	if (unlikely(ret != 0)) {
+		if (ret != -ERESTARTSYS)
+			DRM_ERROR("Out of graphics memory for context"
+				  " creation.\n");
+		goto out_unlock;
+	}
+
+	ret = vmw_context_define(dev_priv, tfile, &arg->cid);
 out_unlock:
 	ttm_read_unlock(&dev_priv->reservation_sem);
 	return ret;
@@ -0,0 +1,267 @@
+/**************************************************************************
+ *
+ * Copyright © 2009 VMware, Inc., Palo Alto, CA., USA
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * Damage rect helpers. They only operate on struct drm_clip_rect and
+ * take their limits as arguments, so that tests/ can build them in
+ * userspace.
+ */
+
+#include <linux/kernel.h>
+#include "vmwgfx_damage.h"
+
+static u64 vmw_damage_area(const struct drm_clip_rect *rect)
+{
+	return (u64) (rect->x2 - rect->x1) * (rect->y2 - rect->y1);
+}
+
+/**
+ * vmw_damage_try_merge - Merge two damage rects if little enough
+ * undamaged area is added.
+ *
+ * @a: The first rect. Replaced with the bounding box on merge.
+ * @b: The second rect.
+ * @waste_pct: Maximum undamaged part of the bounding box, in percent.
+ *
+ * Rects contained in, or exactly adjacent to, each other always merge.
+ */
+static bool vmw_damage_try_merge(struct drm_clip_rect *a,
+				 const struct drm_clip_rect *b,
+				 unsigned waste_pct)
+{
+	struct drm_clip_rect box, isect;
+	u64 box_area, damaged;
+
+	box.x1 = min(a->x1, b->x1);
+	box.y1 = min(a->y1, b->y1);
+	box.x2 = max(a->x2, b->x2);
+	box.y2 = max(a->y2, b->y2);
+
+	isect.x1 = max(a->x1, b->x1);
+	isect.y1 = max(a->y1, b->y1);
+	isect.x2 = min(a->x2, b->x2);
+	isect.y2 = min(a->y2, b->y2);
+
+	damaged = vmw_damage_area(a) + vmw_damage_area(b);
+	if (isect.x1 < isect.x2 && isect.y1 < isect.y2)
+		damaged -= vmw_damage_area(&isect);
+
+	box_area = vmw_damage_area(&box);
+	if ((box_area - damaged) * 100 > (u64) waste_pct * box_area)
+		return false;
+
+	*a = box;
+	return true;
+}
+
+/**
+ * vmw_damage_merge_pass - Merge damage rects pairwise.
+ *
+ * @rects: The damage rects.
+ * @num: Number of rects.
+ * @waste_pct: Merge threshold as for vmw_damage_try_merge().
+ * @target: Stop merging when this number of rects is reached.
+ *
+ * Returns the new number of rects.
+ */
+static unsigned vmw_damage_merge_pass(struct drm_clip_rect *rects,
+				      unsigned num, unsigned waste_pct,
+				      unsigned target)
+{
+	unsigned i, j;
+
+	for (i = 0; i < num && num > target; ++i) {
+		for (j = i + 1; j < num && num > target;) {
+			if (vmw_damage_try_merge(&rects[i], &rects[j],
+						 waste_pct)) {
+				rects[j] = rects[--num];
+				/* rects[i] grew. Recheck from the start. */
+				j = i + 1;
+			} else
+				++j;
+		}
+	}
+
+	return num;
+}
+
+/**
+ * vmw_damage_coalesce - Reduce a set of framebuffer damage rects.
+ *
+ * @clips: The damage rects as given by user-space.
+ * @num_clips: Number of damage rects.
+ * @increment: Stride of @clips, 2 for annotated copies.
+ * @max_rects: Maximum number of rects to return, or 0 for no limit.
+ * @waste_pct: Maximum undamaged part of a merged rect, in percent.
+ * @out: Array with room for @num_clips rects receiving the result.
+ *
+ * Drops empty rects and merges duplicate, contained, adjacent and
+ * overlapping rects as long as the merged rect isn't more than
+ * @waste_pct percent undamaged. If more than @max_rects rects remain,
+ * the threshold is raised until they fit. Returns the number of rects in
+ * @out, which may be zero.
+ */
+unsigned vmw_damage_coalesce(const struct drm_clip_rect *clips,
+			     unsigned num_clips, int increment,
+			     unsigned max_rects, unsigned waste_pct,
+			     struct drm_clip_rect *out)
+{
+	unsigned num = 0;
+	unsigned prev;
+	unsigned i;
+
+	for (i = 0; i < num_clips; ++i, clips += increment) {
+		if (clips->x1 >= clips->x2 || clips->y1 >= clips->y2)
+			continue;
+		out[num++] = *clips;
+	}
+
+	do {
+		prev = num;
+		num = vmw_damage_merge_pass(out, num, waste_pct, 1);
+	} while (num < prev);
+
+	while (max_rects != 0 && num > max_rects) {
+		waste_pct = min(waste_pct * 2 + 1, 100U);
+		num = vmw_damage_merge_pass(out, num, waste_pct, max_rects);
+	}
+
+	return num;
+}
+
+static u64 vmw_damage_box_area(unsigned x1, unsigned y1,
+			       unsigned x2, unsigned y2)
+{
+	return (u64) (x2 - x1) * (y2 - y1);
+}
+
+static void vmw_damage_union(struct drm_clip_rect *rect,
+			     unsigned x1, unsigned y1,
+			     unsigned x2, unsigned y2)
+{
+	rect->x1 = min_t(unsigned, rect->x1, x1);
+	rect->y1 = min_t(unsigned, rect->y1, y1);
+	rect->x2 = max_t(unsigned, rect->x2, x2);
+	rect->y2 = max_t(unsigned, rect->y2, y2);
+}
+
+/**
+ * vmw_damage_set_add - Add a rect to a damage set.
+ *
+ * @set: The damage set.
+ * @x1, y1, x2, y2: The rect to add.
+ *
+ * The rect is merged into an existing one that it overlaps or touches.
+ * Otherwise it takes a free slot, or if none is left, it is merged into
+ * the rect whose area grows the least. Callers serialize access to @set.
+ * Returns true if the set was empty.
+ */
+bool vmw_damage_set_add(struct vmw_damage_set *set,
+			unsigned x1, unsigned y1,
+			unsigned x2, unsigned y2)
+{
+	struct drm_clip_rect *rect;
+	struct drm_clip_rect *best = NULL;
+	u64 best_growth = ~0ULL;
+	bool was_empty = set->num_rects == 0;
+	unsigned i;
+
+	if (x1 >= x2 || y1 >= y2)
+		return false;
+
+	for (i = 0; i < set->num_rects; i++) {
+		u64 growth;
+
+		rect = &set->rects[i];
+		if (x1 <= rect->x2 && rect->x1 <= x2 &&
+		    y1 <= rect->y2 && rect->y1 <= y2) {
+			vmw_damage_union(rect, x1, y1, x2, y2);
+			return false;
+		}
+
+		growth = vmw_damage_box_area(min_t(unsigned, rect->x1, x1),
+					     min_t(unsigned, rect->y1, y1),
+					     max_t(unsigned, rect->x2, x2),
+					     max_t(unsigned, rect->y2, y2)) -
+			vmw_damage_area(rect);
+		if (growth < best_growth) {
+			best_growth = growth;
+			best = rect;
+		}
+	}
+
+	if (set->num_rects < VMW_DAMAGE_SET_RECTS) {
+		rect = &set->rects[set->num_rects++];
+		rect->x1 = x1;
+		rect->y1 = y1;
+		rect->x2 = x2;
+		rect->y2 = y2;
+	} else {
+		vmw_damage_union(best, x1, y1, x2, y2);
+	}
+
+	return was_empty;
+}
+
+/**
+ * vmw_damage_set_add_range - Add a dirty byte range of a linear
+ * framebuffer to a damage set.
+ *
+ * @set: The damage set.
+ * @start: Offset of the first dirty byte.
+ * @end: Offset one past the last dirty byte.
+ * @pitch: Framebuffer scanline length in bytes.
+ * @cpp: Bytes per pixel.
+ * @width: Visible width in pixels.
+ * @size: Framebuffer size in bytes.
+ *
+ * A range within a single scanline only dirties the pixels it covers,
+ * otherwise it dirties full scanlines. Callers serialize access to @set.
+ */
+void vmw_damage_set_add_range(struct vmw_damage_set *set,
+			      unsigned long start, unsigned long end,
+			      unsigned long pitch, unsigned cpp,
+			      unsigned width, unsigned long size)
+{
+	unsigned x1, y1, x2, y2;
+
+	end = min(end, size);
+	if (start >= end)
+		return;
+
+	y1 = start / pitch;
+	y2 = (end - 1) / pitch + 1;
+	if (y2 - y1 == 1) {
+		x1 = (start % pitch) / cpp;
+		x2 = ((end - 1) % pitch) / cpp + 1;
+	} else {
+		x1 = 0;
+		x2 = width;
+	}
+
+	(void) vmw_damage_set_add(set, x1, y1, min(x2, width), y2);
+}
@@ -0,0 +1,58 @@
+/**************************************************************************
+ *
+ * Copyright © 2009 VMware, Inc., Palo Alto, CA., USA
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#ifndef _VMWGFX_DAMAGE_H_
+#define _VMWGFX_DAMAGE_H_
+
+#include "drm.h"
+
+#define VMW_DAMAGE_SET_RECTS 4
+
+/**
+ * struct vmw_damage_set - A fixed size set of damage rects.
+ *
+ * @num_rects: Number of rects in use.
+ * @rects: The rects.
+ */
+struct vmw_damage_set {
+	unsigned num_rects;
+	struct drm_clip_rect rects[VMW_DAMAGE_SET_RECTS];
+};
+
+unsigned vmw_damage_coalesce(const struct drm_clip_rect *clips,
+			     unsigned num_clips, int increment,
+			     unsigned max_rects, unsigned waste_pct,
+			     struct drm_clip_rect *out);
+bool vmw_damage_set_add(struct vmw_damage_set *set,
+			unsigned x1, unsigned y1,
+			unsigned x2, unsigned y2);
+void vmw_damage_set_add_range(struct vmw_damage_set *set,
+			      unsigned long start, unsigned long end,
+			      unsigned long pitch, unsigned cpp,
+			      unsigned width, unsigned long size);
+
+#endif
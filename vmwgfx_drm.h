@@ -64,6 +64,7 @@
 #define DRM_VMW_GB_SURFACE_CREATE    23
 #define DRM_VMW_GB_SURFACE_REF       24
 #define DRM_VMW_SYNCCPU              25
+#define DRM_VMW_BULK_DEFINE          26
 
 /*************************************************************************/
 /**
@@ -75,6 +76,33 @@
  *
  * DRM_VMW_PARAM_OVERLAY_IOCTL:
  * Does the driver support the overlay ioctl.
+ *
+ * DRM_VMW_PARAM_EXECBUF_ALLOCS_AVOIDED:
+ * Number of validation and relocation entries the last command submission
+ * on this file reused instead of allocating.
+ *
+ * DRM_VMW_PARAM_DOORBELLS_SENT:
+ * Number of fifo doorbells (SVGA_REG_SYNC writes) sent to the host.
+ *
+ * DRM_VMW_PARAM_DOORBELLS_SAVED:
+ * Number of fifo doorbells skipped because the host was busy, or
+ * deferred and merged with later ones.
+ *
+ * DRM_VMW_PARAM_RES_HITS(type):
+ * Number of validations of resources of the given DRM_VMW_RES_TYPE_x
+ * that were already present on the device.
+ *
+ * DRM_VMW_PARAM_RES_EVICTIONS(type):
+ * Number of resources of the given type evicted from the device.
+ *
+ * DRM_VMW_PARAM_RES_READBACKS(type):
+ * Number of those evictions that needed their contents read back.
+ *
+ * DRM_VMW_PARAM_PT_POOL_HITS:
+ * Number of mob page tables set up in a pooled page table buffer.
+ *
+ * DRM_VMW_PARAM_PT_POOL_MISSES:
+ * Number of mob page tables that needed a new page table buffer.
  */
 
 #define DRM_VMW_PARAM_NUM_STREAMS      0
@@ -88,6 +116,21 @@
 #define DRM_VMW_PARAM_3D_CAPS_SIZE     8
 #define DRM_VMW_PARAM_MAX_MOB_MEMORY   9
 #define DRM_VMW_PARAM_MAX_MOB_SIZE     10
+#define DRM_VMW_PARAM_EXECBUF_ALLOCS_AVOIDED 11
+#define DRM_VMW_PARAM_DOORBELLS_SENT   12
+#define DRM_VMW_PARAM_DOORBELLS_SAVED  13
+#define DRM_VMW_PARAM_PT_POOL_HITS     14
+#define DRM_VMW_PARAM_PT_POOL_MISSES   15
+#define DRM_VMW_PARAM_RES_HITS(_type)        (0x100 + (_type))
+#define DRM_VMW_PARAM_RES_EVICTIONS(_type)   (0x110 + (_type))
+#define DRM_VMW_PARAM_RES_READBACKS(_type)   (0x120 + (_type))
+
+/* Resource types for the DRM_VMW_PARAM_RES_x parameters. */
+#define DRM_VMW_RES_TYPE_CONTEXT 0
+#define DRM_VMW_RES_TYPE_SURFACE 1
+#define DRM_VMW_RES_TYPE_STREAM  2
+#define DRM_VMW_RES_TYPE_SHADER  3
+#define DRM_VMW_RES_TYPE_MAX     16
 
 /**
  * enum drm_vmw_handle_type - handle type for ref ioctls
@@ -1060,4 +1103,54 @@ struct drm_vmw_synccpu_arg {
 	uint32_t pad64;
 };
 
+
+/*************************************************************************/
+/**
+ * DRM_VMW_BULK_DEFINE - Create a number of resources of the same type.
+ *
+ * Creates @count contexts, guest-backed surfaces or shaders in a single
+ * call, charging graphics memory accounting once for the whole batch.
+ * The per-resource input and output formats are the same as for the
+ * corresponding single-resource ioctls. Either all resources are
+ * created, or none is and an error is returned.
+ */
+
+#define DRM_VMW_BULK_DEFINE_MAX 1024
+
+/**
+ * enum drm_vmw_bulk_define_type - Resource type to create.
+ *
+ * @drm_vmw_bulk_context:    Contexts. No request data. The reply is an
+ *                           array of struct drm_vmw_context_arg.
+ * @drm_vmw_bulk_gb_surface: Guest-backed surfaces. The request is an array
+ *                           of struct drm_vmw_gb_surface_create_req and the
+ *                           reply an array of
+ *                           struct drm_vmw_gb_surface_create_rep.
+ * @drm_vmw_bulk_shader:     Shaders. Both request and reply are arrays of
+ *                           struct drm_vmw_shader_create_arg, where the
+ *                           reply carries the new shader handle.
+ */
+enum drm_vmw_bulk_define_type {
+	drm_vmw_bulk_context,
+	drm_vmw_bulk_gb_surface,
+	drm_vmw_bulk_shader
+};
+
+/**
+ * struct drm_vmw_bulk_define_arg
+ *
+ * @type:  Resource type as described above.
+ * @count: Number of resources to create. At most DRM_VMW_BULK_DEFINE_MAX.
+ * @req:   User-space pointer to the request array cast to an uint64_t.
+ * @rep:   User-space pointer to the reply array cast to an uint64_t.
+ *
+ * Argument to the DRM_VMW_BULK_DEFINE Ioctl.
+ */
+struct drm_vmw_bulk_define_arg {
+	uint32_t type;
+	uint32_t count;
+	uint64_t req;
+	uint64_t rep;
+};
+
 #endif
@@ -127,6 +127,9 @@
 #define DRM_IOCTL_VMW_SYNCCPU					\
 	DRM_IOW(DRM_COMMAND_BASE + DRM_VMW_SYNCCPU,		\
 		 struct drm_vmw_synccpu_arg)
+#define DRM_IOCTL_VMW_BULK_DEFINE				\
+	DRM_IOW(DRM_COMMAND_BASE + DRM_VMW_BULK_DEFINE,		\
+		 struct drm_vmw_bulk_define_arg)
 
 /**
  * The core DRM version of this macro doesn't account for
@@ -207,6 +210,9 @@ static struct drm_ioctl_desc vmw_ioctls[] = {
 	VMW_IOCTL_DEF(DRM_IOCTL_VMW_SYNCCPU,
 		      vmw_user_dmabuf_synccpu_ioctl,
 		      DRM_AUTH | DRM_UNLOCKED | DRM_RENDER_ALLOW),
+	VMW_IOCTL_DEF(DRM_IOCTL_VMW_BULK_DEFINE,
+		      vmw_bulk_define_ioctl,
+		      DRM_AUTH | DRM_UNLOCKED | DRM_RENDER_ALLOW),
 };
 
 static struct pci_device_id vmw_pci_id_list[] = {
@@ -230,6 +236,12 @@ int force_no_3d;
 static int vmw_force_iommu;
 static int vmw_restrict_iommu;
 static int vmw_force_coherent;
+static int vmw_fence_coalesce;
+static unsigned int vmw_doorbell_delay_us;
+static int vmw_evict_policy;
+static unsigned int vmw_damage_max_rects = 32;
+static unsigned int vmw_damage_waste_pct = 25;
+static int vmw_fbdev_zero_copy;
 
 static int vmw_probe(struct pci_dev *, const struct pci_device_id *);
 static void vmw_master_init(struct vmw_master *);
@@ -244,6 +256,18 @@ MODULE_PARM_DESC(restrict_iommu, "Try to limit IOMMU usage for TTM pages");
 module_param_named(restrict_iommu, vmw_restrict_iommu, int, 0600);
 MODULE_PARM_DESC(force_coherent, "Force coherent TTM pages");
 module_param_named(force_coherent, vmw_force_coherent, int, 0600);
+MODULE_PARM_DESC(fence_coalesce, "Share one device fence between back-to-back submissions");
+module_param_named(fence_coalesce, vmw_fence_coalesce, int, 0600);
+MODULE_PARM_DESC(doorbell_delay_us, "Defer fifo doorbells rung less than this many microseconds apart");
+module_param_named(doorbell_delay_us, vmw_doorbell_delay_us, uint, 0600);
+MODULE_PARM_DESC(evict_policy, "Resource eviction policy: 0 LRU, 1 clean first, 2 size weighted");
+module_param_named(evict_policy, vmw_evict_policy, int, 0600);
+MODULE_PARM_DESC(damage_max_rects, "Merge framebuffer damage down to at most this many rects, 0 for no limit");
+module_param_named(damage_max_rects, vmw_damage_max_rects, uint, 0600);
+MODULE_PARM_DESC(damage_waste_pct, "Merge damage rects if at most this percentage of the merged rect is undamaged");
+module_param_named(damage_waste_pct, vmw_damage_waste_pct, uint, 0600);
+MODULE_PARM_DESC(fbdev_zero_copy, "Let fbdev render into a GMR and blit from it, on screen object devices");
+module_param_named(fbdev_zero_copy, vmw_fbdev_zero_copy, int, 0600);
 
 #ifdef VMWGFX_STANDALONE
 MODULE_PARM_DESC(force_stealth, "Force stealth mode");
@@ -365,6 +389,20 @@ static int vmw_request_device(struct vmw_private *dev_priv)
 		return ret;
 	}
 	vmw_fence_fifo_up(dev_priv->fman);
+
+	/*
+	 * Command buffer completion is tracked using interrupts only.
+	 */
+	if ((dev_priv->capabilities & SVGA_CAP_COMMAND_BUFFERS) &&
+	    (dev_priv->capabilities & SVGA_CAP_IRQMASK)) {
+		dev_priv->cman = vmw_cmdbuf_man_create(dev_priv);
+		if (IS_ERR(dev_priv->cman)) {
+			DRM_INFO("Command buffers unavailable. "
+				 "Using the fifo for command submission.\n");
+			dev_priv->cman = NULL;
+		}
+	}
+
 	if (dev_priv->has_mob) {
 		ret = vmw_otables_setup(dev_priv);
 		if (unlikely(ret != 0)) {
@@ -383,6 +421,10 @@ out_no_query_bo:
 	if (dev_priv->has_mob)
 		vmw_otables_takedown(dev_priv);
 out_no_mob:
+	if (dev_priv->cman) {
+		vmw_cmdbuf_man_destroy(dev_priv->cman);
+		dev_priv->cman = NULL;
+	}
 	vmw_fence_fifo_down(dev_priv->fman);
 	vmw_fifo_release(dev_priv, &dev_priv->fifo);
 	return ret;
@@ -400,6 +442,10 @@ static void vmw_release_device(struct vmw_private *dev_priv)
 	ttm_bo_unref(&dev_priv->dummy_query_bo);
 	if (dev_priv->has_mob)
 		vmw_otables_takedown(dev_priv);
+	if (dev_priv->cman) {
+		vmw_cmdbuf_man_destroy(dev_priv->cman);
+		dev_priv->cman = NULL;
+	}
 	vmw_fence_fifo_down(dev_priv->fman);
 	vmw_fifo_release(dev_priv, &dev_priv->fifo);
 }
@@ -589,12 +635,21 @@ static int vmw_driver_load(struct drm_device *dev, unsigned long chipset)
 	for (i = vmw_res_context; i < vmw_res_max; ++i) {
 		idr_init(&dev_priv->res_idr[i]);
 		INIT_LIST_HEAD(&dev_priv->res_lru[i]);
+		spin_lock_init(&dev_priv->res_lru_lock[i]);
 	}
+	vmw_resource_backup_pool_init(dev_priv);
+	vmw_mob_pt_pool_init(dev_priv);
+
+	ret = vmw_surface_layout_cache_init(dev_priv);
+	if (unlikely(ret != 0))
+		goto out_no_layout_cache;
 
 	mutex_init(&dev_priv->init_mutex);
 	init_waitqueue_head(&dev_priv->fence_queue);
 	init_waitqueue_head(&dev_priv->fifo_queue);
+	init_waitqueue_head(&dev_priv->cmdbuf_queue);
 	dev_priv->fence_queue_waiters = 0;
+	dev_priv->cmdbuf_waiters = 0;
 	atomic_set(&dev_priv->fifo_queue_waiters, 0);
 
 	dev_priv->used_memory_size = 0;
@@ -608,6 +663,14 @@ static int vmw_driver_load(struct drm_device *dev, unsigned long chipset)
 #else
 	dev_priv->enable_fb = enable_fbdev && !force_stealth;
 #endif
+	dev_priv->fence_coalesce = !!vmw_fence_coalesce;
+	dev_priv->fb_zero_copy = !!vmw_fbdev_zero_copy;
+	dev_priv->doorbell_delay_us = vmw_doorbell_delay_us;
+	dev_priv->evict_policy = (vmw_evict_policy >= 0 &&
+				  vmw_evict_policy < vmw_evict_max) ?
+		vmw_evict_policy : vmw_evict_lru;
+	dev_priv->damage_max_rects = vmw_damage_max_rects;
+	dev_priv->damage_waste_pct = min(vmw_damage_waste_pct, 100U);
 
 	mutex_lock(&dev_priv->hw_mutex);
 
@@ -842,6 +905,9 @@ static int vmw_driver_load(struct drm_device *dev, unsigned long chipset)
 
 	dev_priv->pm_nb.notifier_call = vmwgfx_pm_notifier;
 	register_pm_notifier(&dev_priv->pm_nb);
+	dev_priv->backup_shrinker.shrink = &vmw_surface_backup_shrink;
+	dev_priv->backup_shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&dev_priv->backup_shrinker);
 
 	return 0;
 
@@ -875,10 +941,13 @@ out_err3:
 	drm_mtrr_del(dev_priv->mmio_mtrr, dev_priv->mmio_start,
 		     dev_priv->mmio_size, DRM_MTRR_WC);
 
+	vmw_mob_pt_pool_release(dev_priv);
 	(void)ttm_bo_device_release(&dev_priv->bdev);
 out_err1:
 	vmw_ttm_global_release(dev_priv);
 out_err0:
+	vmw_surface_layout_cache_takedown(dev_priv);
+out_no_layout_cache:
 	for (i = vmw_res_context; i < vmw_res_max; ++i)
 		idr_destroy(&dev_priv->res_idr[i]);
 
@@ -891,12 +960,9 @@ static int vmw_driver_unload(struct drm_device *dev)
 	struct vmw_private *dev_priv = vmw_priv(dev);
 	enum vmw_res_type i;
 
+	unregister_shrinker(&dev_priv->backup_shrinker);
 	unregister_pm_notifier(&dev_priv->pm_nb);
 
-	if (dev_priv->ctx.res_ht_initialized)
-		drm_ht_remove(&dev_priv->ctx.res_ht);
-	if (dev_priv->ctx.cmd_bounce)
-		vfree(dev_priv->ctx.cmd_bounce);
 	if (dev_priv->enable_fb) {
 		vmw_fb_close(dev_priv);
 		vmw_kms_restore_vga(dev_priv);
@@ -905,6 +971,10 @@ static int vmw_driver_unload(struct drm_device *dev)
 	vmw_kms_close(dev_priv);
 	vmw_overlay_close(dev_priv);
 
+	cancel_work_sync(&dev_priv->backup_pool_work);
+	vmw_resource_backup_pool_release(dev_priv);
+	vmw_mob_pt_pool_release(dev_priv);
+
 	if (dev_priv->has_mob)
 		(void) ttm_bo_clean_mm(&dev_priv->bdev, VMW_PL_MOB);
 	if (dev_priv->has_gmr)
@@ -927,6 +997,7 @@ static int vmw_driver_unload(struct drm_device *dev)
 		     dev_priv->mmio_size, DRM_MTRR_WC);
 	(void)ttm_bo_device_release(&dev_priv->bdev);
 	vmw_ttm_global_release(dev_priv);
+	vmw_surface_layout_cache_takedown(dev_priv);
 
 	for (i = vmw_res_context; i < vmw_res_max; ++i)
 		idr_destroy(&dev_priv->res_idr[i]);
@@ -961,6 +1032,7 @@ static void vmw_postclose(struct drm_device *dev,
 		drm_master_put(&vmw_fp->locked_master);
 	}
 
+	vmw_execbuf_sw_context_free(vmw_fp);
 	ttm_object_file_release(&vmw_fp->tfile);
 	kfree(vmw_fp);
 }
@@ -979,6 +1051,7 @@ static int vmw_driver_open(struct drm_device *dev, struct drm_file *file_priv)
 		return ret;
 
 	INIT_LIST_HEAD(&vmw_fp->fence_events);
+	mutex_init(&vmw_fp->cmdbuf_mutex);
 	vmw_fp->tfile = ttm_object_file_init(dev_priv->tdev, 10);
 	if (unlikely(vmw_fp->tfile == NULL))
 		goto out_no_tfile;
@@ -33,12 +33,14 @@
 #include "vmwgfx_drm.h"
 #include "drm_hashtab.h"
 #include "linux/suspend.h"
+#include "linux/hrtimer.h"
 #include "ttm/ttm_bo_driver.h"
 #include "ttm/ttm_object.h"
 #include "ttm/ttm_lock.h"
 #include "ttm/ttm_execbuf_util.h"
 #include "ttm/ttm_module.h"
 #include "vmwgfx_fence.h"
+#include "vmwgfx_piter.h"
 
 #define VMWGFX_DRIVER_DATE "20141114"
 #define VMWGFX_DRIVER_MAJOR 2
@@ -64,6 +66,19 @@
 			VMWGFX_NUM_GB_SURFACE +\
 			VMWGFX_NUM_GB_SCREEN_TARGET)
 
+/*
+ * Resource backup buffer cache limits. Buffers of VMW_BACKUP_POOL_ORDERS
+ * page orders and above are never cached.
+ */
+#define VMW_BACKUP_POOL_ORDERS 11
+#define VMW_BACKUP_POOL_MAX_PAGES 4096
+
+/*
+ * Mob page table buffer pool limits, in the same manner.
+ */
+#define VMW_PT_POOL_ORDERS 10
+#define VMW_PT_POOL_MAX_PAGES 1024
+
 #define VMW_PL_GMR TTM_PL_PRIV0
 #define VMW_PL_FLAG_GMR TTM_PL_FLAG_PRIV0
 #define VMW_PL_MOB TTM_PL_PRIV1
@@ -75,30 +90,42 @@
 #define VMW_RES_FENCE ttm_driver_type3
 #define VMW_RES_SHADER ttm_driver_type4
 
+struct vmw_sw_context;
+
+/**
+ * struct vmw_fpriv - Per open file driver private information.
+ *
+ * @cmdbuf_mutex: Serializes command submission from this file and protects
+ * @sw_context.
+ * @sw_context: Software context used for command verification of
+ * submissions from this file. Allocated on first use.
+ */
 struct vmw_fpriv {
 	struct drm_master *locked_master;
 	struct ttm_object_file *tfile;
 	struct list_head fence_events;
 	bool gb_aware;
+	struct mutex cmdbuf_mutex;
+	struct vmw_sw_context *sw_context;
 };
 
 struct vmw_dma_buffer {
 	struct ttm_buffer_object base;
 	struct list_head res_list;
+	struct list_head pool_head;
+	struct ttm_placement *pool_placement;
 };
 
 /**
  * struct vmw_validate_buffer - Carries validation info about buffers.
  *
  * @base: Validation info for TTM.
- * @hash: Hash entry for quick lookup of the TTM buffer object.
  *
  * This structure contains also driver private validation info
  * on top of the info needed by TTM.
  */
 struct vmw_validate_buffer {
 	struct ttm_validate_buffer base;
-	struct drm_hash_item hash;
 	bool validate_as_mob;
 };
 
@@ -115,7 +142,7 @@ struct vmw_resource {
 	unsigned long backup_offset;
 	unsigned long pin_count; /* Protected by resource reserved */
 	const struct vmw_res_func *func;
-	struct list_head lru_head; /* Protected by the resource lock */
+	struct list_head lru_head; /* Protected by the lru lock of its type */
 	struct list_head mob_head; /* Protected by @backup reserved */
 	struct list_head binding_head; /* Protected by binding_mutex */
 	void (*res_free) (struct vmw_resource *res);
@@ -134,6 +161,16 @@ enum vmw_res_type {
 	vmw_res_max
 };
 
+/*
+ * Policies for picking a resource to evict on device resource shortage.
+ */
+enum vmw_evict_policy {
+	vmw_evict_lru,
+	vmw_evict_clean_first,
+	vmw_evict_size_weighted,
+	vmw_evict_max
+};
+
 /*
  * Resources that are managed using command streams.
  */
@@ -142,6 +179,8 @@ enum vmw_cmdbuf_res_type {
 };
 
 struct vmw_cmdbuf_res_manager;
+struct vmw_cmdbuf_man;
+struct vmw_fifo_batch;
 
 struct vmw_cursor_snooper {
 	struct drm_crtc *crtc;
@@ -151,6 +190,7 @@ struct vmw_cursor_snooper {
 
 struct vmw_framebuffer;
 struct vmw_surface_offset;
+struct vmw_surface_layout;
 
 struct vmw_surface {
 	struct vmw_resource res;
@@ -166,6 +206,26 @@ struct vmw_surface {
 	struct vmw_surface_offset *offsets;
 	SVGA3dTextureFilter autogen_filter;
 	uint32_t multisample_count;
+	struct vmw_surface_layout *layout; /* Shared @sizes and @offsets */
+	SVGA3dBox *dirty; /* Per-image host damage. Legacy surfaces only */
+	bool dirty_tracked; /* Backup holds contents outside @dirty */
+};
+
+#define VMW_SURFACE_DIRTY_STAGED 4
+
+/**
+ * struct vmw_surface_dirty - Surface damage staged by the command verifier.
+ *
+ * @all: Whether the whole surface may have been modified.
+ * @num: Number of valid entries in @subres and @box.
+ * @subres: Image index of each staged box.
+ * @box: Staged damage bounding box of each image.
+ */
+struct vmw_surface_dirty {
+	bool all;
+	unsigned int num;
+	uint32_t subres[VMW_SURFACE_DIRTY_STAGED];
+	SVGA3dBox box[VMW_SURFACE_DIRTY_STAGED];
 };
 
 struct vmw_marker_queue {
@@ -179,12 +239,52 @@ struct vmw_fifo_state {
 	unsigned long reserved_size;
 	__le32 *dynamic_buffer;
 	__le32 *static_buffer;
+	const __le32 *src_buffer;
 	unsigned long static_buffer_size;
 	bool using_bounce_buffer;
 	uint32_t capabilities;
 	struct mutex fifo_mutex;
 	struct rw_semaphore rwsem;
 	struct vmw_marker_queue marker_queue;
+
+	/*
+	 * Verified command batches waiting for fifo space.
+	 * The queue and its byte count are protected by submit_lock,
+	 * draining is serialized by submit_mutex. A reservation made
+	 * while batches are queued is staged in a batch of its own,
+	 * protected by fifo_mutex, and queued on commit. The worker
+	 * backs off after failing to drain and drops the queue once
+	 * the device is considered hung.
+	 */
+	struct list_head submit_queue;
+	unsigned long submit_bytes;
+	spinlock_t submit_lock;
+	struct mutex submit_mutex;
+	struct delayed_work submit_work;
+	unsigned int submit_failures;
+	struct vmw_fifo_batch *staged;
+
+	/*
+	 * Fence coalescing. The pending fence seqno is handed out to
+	 * submitters until the fence command is emitted. fence_pending
+	 * and pending_seqno are protected by submit_lock, fence emission
+	 * is serialized by fence_mutex.
+	 */
+	bool fence_pending;
+	uint32_t pending_seqno;
+	struct mutex fence_mutex;
+	struct delayed_work fence_work;
+
+	/*
+	 * Doorbell batching and statistics. A deferred doorbell is timed
+	 * by doorbell_timer and rung from doorbell_work, since ringing
+	 * takes the hw_mutex.
+	 */
+	ktime_t last_doorbell;
+	struct hrtimer doorbell_timer;
+	struct work_struct doorbell_work;
+	atomic_t doorbells_sent;
+	atomic_t doorbells_saved;
 };
 
 struct vmw_relocation {
@@ -240,28 +340,15 @@ struct vmw_sg_table {
 };
 
 /**
- * struct vmw_piter - Page iterator that iterates over a list of pages
- * and DMA addresses that could be either a scatter-gather list or
- * arrays
+ * struct vmw_gmr_desc_cache - Legacy GMR descriptor pages of a buffer,
+ * kept across binds as long as the buffer's DMA addresses are unchanged.
  *
- * @pages: Array of page pointers to the pages.
- * @addrs: DMA addresses to the pages if coherent pages are used.
- * @iter: Scatter-gather page iterator. Current position in SG list.
- * @i: Current position in arrays.
- * @num_pages: Number of pages total.
- * @next: Function to advance the iterator. Returns false if past the list
- * of pages, true otherwise.
- * @dma_address: Function to return the DMA address of the current page.
+ * @pages: Descriptor pages, linked through their lru list heads.
+ * @first_dma: DMA address of the first descriptor page.
  */
-struct vmw_piter {
-	struct page **pages;
-	const dma_addr_t *addrs;
-	struct sg_page_iter iter;
-	unsigned long i;
-	unsigned long num_pages;
-	bool (*next)(struct vmw_piter *);
-	dma_addr_t (*dma_address)(struct vmw_piter *);
-	struct page *(*page)(struct vmw_piter *);
+struct vmw_gmr_desc_cache {
+	struct list_head pages;
+	dma_addr_t first_dma;
 };
 
 /*
@@ -330,9 +417,26 @@ struct vmw_ctx_binding_state {
 	struct vmw_ctx_binding shaders[SVGA3D_SHADERTYPE_MAX];
 };
 
+/**
+ * struct vmw_val_ht_entry - Slot of the execbuf validation lookup table.
+ *
+ * @key: Pointer to the resource or buffer object looked up.
+ * @item: The struct vmw_resource_val_node or struct vmw_validate_buffer
+ * tracking @key.
+ * @gen: Submission generation the slot was filled in. Slots of older
+ * generations are free.
+ */
+struct vmw_val_ht_entry {
+	unsigned long key;
+	void *item;
+	uint32_t gen;
+};
+
 struct vmw_sw_context{
-	struct drm_open_hash res_ht;
-	bool res_ht_initialized;
+	struct vmw_val_ht_entry *val_ht;
+	unsigned int val_ht_order;
+	unsigned int val_ht_fill;
+	uint32_t val_ht_gen;
 	bool kernel; /**< is the called made from the kernel */
 	struct vmw_fpriv *fp;
 	struct list_head validate_nodes;
@@ -353,6 +457,10 @@ struct vmw_sw_context{
 	struct vmw_resource *error_resource;
 	struct vmw_ctx_binding_state staged_bindings;
 	struct list_head staged_cmd_res;
+	bool device_locked; /**< holds dev_priv::cmdbuf_mutex */
+	struct list_head val_free; /**< recycled validation nodes */
+	struct list_head reloc_free; /**< recycled resource relocations */
+	uint32_t allocs_avoided; /**< recycled entries used by last submit */
 };
 
 struct vmw_legacy_display;
@@ -378,6 +486,7 @@ struct vmw_private {
 	struct drm_global_reference mem_global_ref;
 
 	struct vmw_fifo_state fifo;
+	struct vmw_cmdbuf_man *cman;
 
 	struct drm_device *dev;
 	unsigned long vmw_chipset;
@@ -456,6 +565,8 @@ struct vmw_private {
 	int fence_queue_waiters; /* Protected by hw_mutex */
 	int goal_queue_waiters; /* Protected by hw_mutex */
 	atomic_t fifo_queue_waiters;
+	wait_queue_head_t cmdbuf_queue;
+	int cmdbuf_waiters; /* Protected by hw_mutex */
 	uint32_t last_read_seqno;
 	spinlock_t irq_lock;
 	struct vmw_fence_manager *fman;
@@ -473,13 +584,23 @@ struct vmw_private {
 	 * Execbuf
 	 */
 	/**
-	 * Protected by the cmdbuf mutex.
+	 * The cmdbuf mutex serializes the device side of command
+	 * submission. Command verification uses per-file software
+	 * contexts and runs outside of it.
 	 */
 
-	struct vmw_sw_context ctx;
 	struct mutex cmdbuf_mutex;
 	struct mutex binding_mutex;
 
+	/*
+	 * Dirty update scratch buffers, protected by dirty_mutex.
+	 * Taken outside of the cmdbuf_mutex.
+	 */
+
+	struct mutex dirty_mutex;
+	struct drm_clip_rect *dirty_rects;
+	void *dirty_cmd;
+
 	/**
 	 * Operating mode.
 	 */
@@ -487,6 +608,11 @@ struct vmw_private {
 	bool stealth;
 	bool is_opened;
 	bool enable_fb;
+	bool fb_zero_copy;
+	bool fence_coalesce;
+	unsigned int doorbell_delay_us;
+	unsigned int damage_max_rects;
+	unsigned int damage_waste_pct;
 
 	/**
 	 * Master management.
@@ -495,6 +621,7 @@ struct vmw_private {
 	struct vmw_master *active_master;
 	struct vmw_master fbdev_master;
 	struct notifier_block pm_nb;
+	struct shrinker backup_shrinker;
 	bool suspended;
 
 	struct mutex release_mutex;
@@ -517,15 +644,52 @@ struct vmw_private {
 	bool dummy_query_bo_pinned;
 
 	/*
-	 * Surface swapping. The "surface_lru" list is protected by the
-	 * resource lock in order to be able to destroy a surface and take
-	 * it off the lru atomically. "used_memory_size" is currently
-	 * protected by the cmdbuf mutex for simplicity.
+	 * Surface swapping. Each "res_lru" list is protected by its
+	 * "res_lru_lock", which nests inside the resource lock so that
+	 * a resource can be destroyed and taken off the lru atomically.
+	 * "used_memory_size" is currently protected by the cmdbuf mutex
+	 * for simplicity.
 	 */
 
 	struct list_head res_lru[vmw_res_max];
+	spinlock_t res_lru_lock[vmw_res_max];
 	uint32_t used_memory_size;
 
+	/*
+	 * Legacy surface layouts shared between identically shaped
+	 * surfaces. Protected by the surface layout lock.
+	 */
+
+	spinlock_t surface_layout_lock;
+	struct drm_open_hash surface_layouts;
+
+	/*
+	 * Resource eviction policy and per-type statistics.
+	 */
+	enum vmw_evict_policy evict_policy;
+	atomic_t res_hits[vmw_res_max];
+	atomic_t res_evictions[vmw_res_max];
+	atomic_t res_readbacks[vmw_res_max];
+
+	/*
+	 * Cache of idle resource backup buffers, bucketed by size order.
+	 * Protected by backup_pool_lock.
+	 */
+	spinlock_t backup_pool_lock;
+	struct list_head backup_pool[VMW_BACKUP_POOL_ORDERS];
+	unsigned long backup_pool_pages;
+	struct work_struct backup_pool_work;
+
+	/*
+	 * Pool of idle mob page table buffers, bucketed by size order.
+	 * Protected by pt_pool_lock.
+	 */
+	spinlock_t pt_pool_lock;
+	struct list_head pt_pool[VMW_PT_POOL_ORDERS];
+	unsigned long pt_pool_pages;
+	atomic_t pt_pool_hits;
+	atomic_t pt_pool_misses;
+
 	/*
 	 * Guest Backed stuff
 	 */
@@ -585,8 +749,11 @@ void vmw_3d_resource_dec(struct vmw_private *dev_priv, bool hide_svga);
 extern int vmw_gmr_bind(struct vmw_private *dev_priv,
 			const struct vmw_sg_table *vsgt,
 			unsigned long num_pages,
-			int gmr_id);
+			int gmr_id,
+			struct vmw_gmr_desc_cache *desc_cache);
 extern void vmw_gmr_unbind(struct vmw_private *dev_priv, int gmr_id);
+extern void vmw_gmr_desc_cache_release(struct vmw_private *dev_priv,
+				       struct vmw_gmr_desc_cache *desc_cache);
 
 /**
  * Resource utilities - vmwgfx_resource.c
@@ -600,6 +767,7 @@ vmw_resource_reference_unless_doomed(struct vmw_resource *res);
 extern int vmw_resource_validate(struct vmw_resource *res);
 extern int vmw_resource_reserve(struct vmw_resource *res, bool no_backup);
 extern bool vmw_resource_needs_backup(const struct vmw_resource *res);
+extern bool vmw_resource_backup_retained(const struct vmw_resource *res);
 extern int vmw_user_lookup_handle(struct vmw_private *dev_priv,
 				  struct ttm_object_file *tfile,
 				  uint32_t handle,
@@ -650,12 +818,21 @@ extern int vmw_user_stream_lookup(struct vmw_private *dev_priv,
 extern void vmw_resource_unreserve(struct vmw_resource *res,
 				   struct vmw_dma_buffer *new_backup,
 				   unsigned long new_backup_offset);
+extern void vmw_resource_unreserve_deferred(struct vmw_resource *res,
+					    struct vmw_dma_buffer *new_backup,
+					    unsigned long new_backup_offset,
+					    struct list_head *lru_batch);
+extern void vmw_resource_lru_splice(struct vmw_private *dev_priv,
+				    struct list_head *lru_batch);
 extern void vmw_resource_move_notify(struct ttm_buffer_object *bo,
 				     struct ttm_mem_reg *mem);
 extern void vmw_fence_single_bo(struct ttm_buffer_object *bo,
 				struct vmw_fence_obj *fence,
 				void *sync_obj_arg);
 extern void vmw_resource_evict_all(struct vmw_private *dev_priv);
+extern void vmw_resource_swap_notify(struct ttm_buffer_object *bo);
+extern void vmw_resource_backup_pool_init(struct vmw_private *dev_priv);
+extern void vmw_resource_backup_pool_release(struct vmw_private *dev_priv);
 extern int vmw_dumb_create(struct drm_file *file_priv,
 			   struct drm_device *dev,
 			   struct drm_mode_create_dumb *args);
@@ -703,6 +880,8 @@ extern int vmw_present_ioctl(struct drm_device *dev, void *data,
 			     struct drm_file *file_priv);
 extern int vmw_present_readback_ioctl(struct drm_device *dev, void *data,
 				      struct drm_file *file_priv);
+extern int vmw_bulk_define_ioctl(struct drm_device *dev, void *data,
+				 struct drm_file *file_priv);
 extern unsigned int vmw_fops_poll(struct file *filp,
 				  struct poll_table_struct *wait);
 extern ssize_t vmw_fops_read(struct file *filp, char __user *buffer,
@@ -718,8 +897,15 @@ extern void vmw_fifo_release(struct vmw_private *dev_priv,
 			     struct vmw_fifo_state *fifo);
 extern void *vmw_fifo_reserve(struct vmw_private *dev_priv, uint32_t bytes);
 extern void vmw_fifo_commit(struct vmw_private *dev_priv, uint32_t bytes);
+extern void vmw_fifo_commit_noflush(struct vmw_private *dev_priv,
+				    uint32_t bytes);
+extern void vmw_fifo_flush(struct vmw_private *dev_priv);
+extern bool vmw_fifo_submit_pending(struct vmw_private *dev_priv);
+extern int vmw_fifo_emit(struct vmw_private *dev_priv, const void *buf,
+			 uint32_t bytes);
 extern int vmw_fifo_send_fence(struct vmw_private *dev_priv,
 			       uint32_t *seqno);
+extern int vmw_fifo_fence_flush(struct vmw_private *dev_priv);
 extern void vmw_fifo_ping_host(struct vmw_private *dev_priv, uint32_t reason);
 extern bool vmw_fifo_have_3d(struct vmw_private *dev_priv);
 extern bool vmw_fifo_have_pitchlock(struct vmw_private *dev_priv);
@@ -745,6 +931,7 @@ extern struct ttm_placement vmw_vram_gmr_placement;
 extern struct ttm_placement vmw_vram_gmr_ne_placement;
 extern struct ttm_placement vmw_sys_placement;
 extern struct ttm_placement vmw_sys_ne_placement;
+extern struct ttm_placement vmw_gmr_ne_placement;
 extern struct ttm_placement vmw_evictable_placement;
 extern struct ttm_placement vmw_srf_placement;
 extern struct ttm_placement vmw_mob_placement;
@@ -758,42 +945,6 @@ extern void vmw_piter_start(struct vmw_piter *viter,
 			    const struct vmw_sg_table *vsgt,
 			    unsigned long p_offs);
 
-/**
- * vmw_piter_next - Advance the iterator one page.
- *
- * @viter: Pointer to the iterator to advance.
- *
- * Returns false if past the list of pages, true otherwise.
- */
-static inline bool vmw_piter_next(struct vmw_piter *viter)
-{
-	return viter->next(viter);
-}
-
-/**
- * vmw_piter_dma_addr - Return the DMA address of the current page.
- *
- * @viter: Pointer to the iterator
- *
- * Returns the DMA address of the page pointed to by @viter.
- */
-static inline dma_addr_t vmw_piter_dma_addr(struct vmw_piter *viter)
-{
-	return viter->dma_address(viter);
-}
-
-/**
- * vmw_piter_page - Return a pointer to the current page.
- *
- * @viter: Pointer to the iterator
- *
- * Returns the DMA address of the page pointed to by @viter.
- */
-static inline struct page *vmw_piter_page(struct vmw_piter *viter)
-{
-	return viter->page(viter);
-}
-
 /**
  * Command submission - vmwgfx_execbuf.c
  */
@@ -812,6 +963,7 @@ extern int vmw_execbuf_process(struct drm_file *file_priv,
 extern void __vmw_execbuf_release_pinned_bo(struct vmw_private *dev_priv,
 					    struct vmw_fence_obj *fence);
 extern void vmw_execbuf_release_pinned_bo(struct vmw_private *dev_priv);
+extern void vmw_execbuf_sw_context_free(struct vmw_fpriv *vmw_fp);
 
 extern int vmw_execbuf_fence_commands(struct drm_file *file_priv,
 				      struct vmw_private *dev_priv,
@@ -850,6 +1002,9 @@ extern void vmw_seqno_waiter_add(struct vmw_private *dev_priv);
 extern void vmw_seqno_waiter_remove(struct vmw_private *dev_priv);
 extern void vmw_goal_waiter_add(struct vmw_private *dev_priv);
 extern void vmw_goal_waiter_remove(struct vmw_private *dev_priv);
+extern void vmw_cmdbuf_waiter_add(struct vmw_private *dev_priv);
+extern void vmw_cmdbuf_waiter_remove(struct vmw_private *dev_priv);
+extern void vmw_cmdbuf_error_irq(struct vmw_private *dev_priv, bool enable);
 
 /**
  * Rudimentary fence-like objects currently used only for throttling -
@@ -964,6 +1119,8 @@ extern void vmw_mob_unbind(struct vmw_private *dev_priv,
 extern void vmw_mob_destroy(struct vmw_mob *mob);
 extern struct vmw_mob *vmw_mob_create(unsigned long data_pages);
 extern int vmw_otables_setup(struct vmw_private *dev_priv);
+extern void vmw_mob_pt_pool_init(struct vmw_private *dev_priv);
+extern void vmw_mob_pt_pool_release(struct vmw_private *dev_priv);
 extern void vmw_otables_takedown(struct vmw_private *dev_priv);
 
 /*
@@ -976,6 +1133,10 @@ extern int vmw_context_check(struct vmw_private *dev_priv,
 			     struct ttm_object_file *tfile,
 			     int id,
 			     struct vmw_resource **p_res);
+extern uint64_t vmw_context_acc_size(struct vmw_private *dev_priv);
+extern int vmw_context_define(struct vmw_private *dev_priv,
+			      struct ttm_object_file *tfile,
+			      uint32_t *cid);
 extern int vmw_context_define_ioctl(struct drm_device *dev, void *data,
 				    struct drm_file *file_priv);
 extern int vmw_context_destroy_ioctl(struct drm_device *dev, void *data,
@@ -1004,6 +1165,12 @@ extern int vmw_surface_define_ioctl(struct drm_device *dev, void *data,
 				    struct drm_file *file_priv);
 extern int vmw_surface_reference_ioctl(struct drm_device *dev, void *data,
 				       struct drm_file *file_priv);
+extern uint64_t vmw_gb_surface_acc_size(void);
+extern int
+vmw_gb_surface_define(struct vmw_private *dev_priv,
+		      struct drm_file *file_priv,
+		      const struct drm_vmw_gb_surface_create_req *req,
+		      struct drm_vmw_gb_surface_create_rep *rep);
 extern int vmw_gb_surface_define_ioctl(struct drm_device *dev, void *data,
 				       struct drm_file *file_priv);
 extern int vmw_gb_surface_reference_ioctl(struct drm_device *dev, void *data,
@@ -1013,6 +1180,16 @@ extern int vmw_surface_check(struct vmw_private *dev_priv,
 			     uint32_t handle, int *id);
 extern int vmw_surface_validate(struct vmw_private *dev_priv,
 				struct vmw_surface *srf);
+extern void vmw_surface_dirty_stage(struct vmw_resource *res,
+				    struct vmw_surface_dirty *dirty,
+				    uint32_t face, uint32_t mip,
+				    const SVGA3dBox *box);
+extern void vmw_surface_dirty_commit(struct vmw_resource *res,
+				     const struct vmw_surface_dirty *dirty);
+extern int vmw_surface_layout_cache_init(struct vmw_private *dev_priv);
+extern void vmw_surface_layout_cache_takedown(struct vmw_private *dev_priv);
+extern int vmw_surface_backup_shrink(struct shrinker *shrink, int nr_to_scan,
+				     gfp_t gfp_mask);
 
 /*
  * Shader management - vmwgfx_shader.c
@@ -1020,6 +1197,10 @@ extern int vmw_surface_validate(struct vmw_private *dev_priv,
 
 extern const struct vmw_user_resource_conv *user_shader_converter;
 
+extern uint64_t vmw_shader_acc_size(void);
+extern int vmw_shader_define(struct vmw_private *dev_priv,
+			     struct ttm_object_file *tfile,
+			     struct drm_vmw_shader_create_arg *arg);
 extern int vmw_shader_define_ioctl(struct drm_device *dev, void *data,
 				   struct drm_file *file_priv);
 extern int vmw_shader_destroy_ioctl(struct drm_device *dev, void *data,
@@ -1061,6 +1242,20 @@ extern int vmw_cmdbuf_res_remove(struct vmw_cmdbuf_res_manager *man,
 				 u32 user_key,
 				 struct list_head *list);
 
+/*
+ * Command buffer submission - vmwgfx_cmdbuf.c
+ */
+
+extern struct vmw_cmdbuf_man *
+vmw_cmdbuf_man_create(struct vmw_private *dev_priv);
+extern void vmw_cmdbuf_man_destroy(struct vmw_cmdbuf_man *man);
+extern void *vmw_cmdbuf_reserve(struct vmw_cmdbuf_man *man, size_t size);
+extern void vmw_cmdbuf_commit(struct vmw_cmdbuf_man *man, size_t size,
+			      bool flush);
+extern void vmw_cmdbuf_flush(struct vmw_cmdbuf_man *man);
+extern void vmw_cmdbuf_kick(struct vmw_cmdbuf_man *man);
+extern int vmw_cmdbuf_idle(struct vmw_cmdbuf_man *man, bool interruptible,
+			   unsigned long timeout);
 
 /**
  * Inline helper functions
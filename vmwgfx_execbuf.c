@@ -29,8 +29,9 @@
 #include "vmwgfx_reg.h"
 #include "ttm/ttm_bo_api.h"
 #include "ttm/ttm_placement.h"
+#include <linux/hash.h>
 
-#define VMW_RES_HT_ORDER 12
+#define VMW_VAL_HT_ORDER 12
 
 /**
  * struct vmw_resource_relocation - Relocation info for resources
@@ -50,7 +51,6 @@ struct vmw_resource_relocation {
  * struct vmw_resource_val_node - Validation info for resources
  *
  * @head: List head for the software context's resource list.
- * @hash: Hash entry for quick resouce to val_node lookup.
  * @res: Ref-counted pointer to the resource.
  * @switch_backup: Boolean whether to switch backup buffer on unreserve.
  * @new_backup: Refcounted pointer to the new backup buffer.
@@ -61,16 +61,23 @@ struct vmw_resource_relocation {
  * the command stream.
  * @no_buffer_needed: Resources do not need to allocate buffer backup on
  * reservation. The command stream will provide one.
+ * @srf_dirty: If @res is a surface, the damage caused by the command batch.
+ * @snoop_bo: If @res is a cursor surface, refcounted pointer to the source
+ * buffer of the last DMA to it.
+ * @snoop_header: The last DMA command to a cursor surface. It is snooped
+ * once the device is locked.
  */
 struct vmw_resource_val_node {
 	struct list_head head;
-	struct drm_hash_item hash;
 	struct vmw_resource *res;
 	struct vmw_dma_buffer *new_backup;
 	struct vmw_ctx_binding_state *staged_bindings;
 	unsigned long new_backup_offset;
 	bool first_usage;
 	bool no_buffer_needed;
+	struct vmw_surface_dirty srf_dirty;
+	struct vmw_dma_buffer *snoop_bo;
+	SVGA3dCmdHeader *snoop_header;
 };
 
 /**
@@ -92,17 +99,156 @@ struct vmw_cmd_entry {
 	[(_cmd) - SVGA_3D_CMD_BASE] = {(_func), (_user_allow),\
 				       (_gb_disable), (_gb_enable)}
 
+/**
+ * vmw_val_ht_add - Put an item into a free slot of a validation table.
+ *
+ * @table: The table.
+ * @order: Log2 of the number of slots in @table.
+ * @gen: The current generation.
+ * @key: The lookup key.
+ * @item: The item.
+ *
+ * Slots tagged with a generation other than @gen are free. The caller
+ * must make sure there is at least one free slot.
+ */
+static void vmw_val_ht_add(struct vmw_val_ht_entry *table,
+			   unsigned int order, uint32_t gen,
+			   unsigned long key, void *item)
+{
+	unsigned long mask = (1UL << order) - 1;
+	unsigned long i = hash_long(key, order);
+
+	while (table[i].gen == gen)
+		i = (i + 1) & mask;
+
+	table[i].key = key;
+	table[i].item = item;
+	table[i].gen = gen;
+}
+
+/**
+ * vmw_val_ht_find - Look up an item in the validation table.
+ *
+ * @sw_context: Pointer to the software context.
+ * @key: The lookup key.
+ *
+ * Returns the item, or NULL if @key wasn't inserted during this
+ * submission.
+ */
+static void *vmw_val_ht_find(struct vmw_sw_context *sw_context,
+			     unsigned long key)
+{
+	unsigned long mask = (1UL << sw_context->val_ht_order) - 1;
+	unsigned long i = hash_long(key, sw_context->val_ht_order);
+	struct vmw_val_ht_entry *entry;
+
+	for (;; i = (i + 1) & mask) {
+		entry = &sw_context->val_ht[i];
+		if (entry->gen != sw_context->val_ht_gen)
+			return NULL;
+		if (entry->key == key)
+			return entry->item;
+	}
+}
+
+/**
+ * vmw_val_ht_grow - Double the size of the validation table.
+ *
+ * @sw_context: Pointer to the software context.
+ */
+static int vmw_val_ht_grow(struct vmw_sw_context *sw_context)
+{
+	unsigned int order = sw_context->val_ht_order + 1;
+	struct vmw_val_ht_entry *table, *entry;
+	unsigned long i;
+
+	table = vzalloc(sizeof(*table) << order);
+	if (unlikely(table == NULL)) {
+		DRM_ERROR("Failed to grow the validation table.\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < (1UL << sw_context->val_ht_order); ++i) {
+		entry = &sw_context->val_ht[i];
+		if (entry->gen == sw_context->val_ht_gen)
+			vmw_val_ht_add(table, order, entry->gen,
+				       entry->key, entry->item);
+	}
+
+	vfree(sw_context->val_ht);
+	sw_context->val_ht = table;
+	sw_context->val_ht_order = order;
+
+	return 0;
+}
+
+/**
+ * vmw_val_ht_insert - Insert an item into the validation table.
+ *
+ * @sw_context: Pointer to the software context.
+ * @key: The lookup key. Must not already be in the table.
+ * @item: The item.
+ *
+ * The table is kept at most half full so that probe sequences stay short.
+ */
+static int vmw_val_ht_insert(struct vmw_sw_context *sw_context,
+			     unsigned long key, void *item)
+{
+	int ret;
+
+	if (unlikely((sw_context->val_ht_fill + 1) * 2 >
+		     (1U << sw_context->val_ht_order))) {
+		ret = vmw_val_ht_grow(sw_context);
+		if (unlikely(ret != 0))
+			return ret;
+	}
+
+	vmw_val_ht_add(sw_context->val_ht, sw_context->val_ht_order,
+		       sw_context->val_ht_gen, key, item);
+	sw_context->val_ht_fill++;
+
+	return 0;
+}
+
+/**
+ * vmw_val_ht_reset - Empty the validation table.
+ *
+ * @sw_context: Pointer to the software context.
+ *
+ * Bumps the table generation, which frees all slots at once. The table
+ * only needs clearing when the generation wraps.
+ */
+static void vmw_val_ht_reset(struct vmw_sw_context *sw_context)
+{
+	sw_context->val_ht_fill = 0;
+	if (unlikely(++sw_context->val_ht_gen == 0)) {
+		memset(sw_context->val_ht, 0,
+		       sizeof(*sw_context->val_ht) << sw_context->val_ht_order);
+		sw_context->val_ht_gen = 1;
+	}
+}
+
 /**
  * vmw_resource_unreserve - unreserve resources previously reserved for
  * command submission.
  *
+ * @dev_priv: Pointer to a device private struct.
  * @list_head: list of resources to unreserve.
  * @backoff: Whether command submission failed.
+ *
+ * Evictable resources are put back on the device lru lists in one
+ * batch per resource type.
  */
-static void vmw_resource_list_unreserve(struct list_head *list,
+static void vmw_resource_list_unreserve(struct vmw_private *dev_priv,
+					struct list_head *list,
 					bool backoff)
 {
 	struct vmw_resource_val_node *val;
+	struct list_head lru_batch[vmw_res_max];
+	enum vmw_res_type type;
+
+	for (type = vmw_res_context; type < vmw_res_max; ++type)
+		INIT_LIST_HEAD(&lru_batch[type]);
 
 	list_for_each_entry(val, list, head) {
 		struct vmw_resource *res = val->res;
@@ -121,10 +267,15 @@ static void vmw_resource_list_unreserve(struct list_head *list,
 			kfree(val->staged_bindings);
 			val->staged_bindings = NULL;
 		}
-		vmw_resource_unreserve(res, new_backup,
-			val->new_backup_offset);
+		if (!backoff && res->func->res_type == vmw_res_surface)
+			vmw_surface_dirty_commit(res, &val->srf_dirty);
+		vmw_resource_unreserve_deferred(res, new_backup,
+						val->new_backup_offset,
+						lru_batch);
 		vmw_dmabuf_unreference(&val->new_backup);
 	}
+
+	vmw_resource_lru_splice(dev_priv, lru_batch);
 }
 
 
@@ -142,31 +293,36 @@ static int vmw_resource_val_add(struct vmw_sw_context *sw_context,
 				struct vmw_resource_val_node **p_node)
 {
 	struct vmw_resource_val_node *node;
-	struct drm_hash_item *hash;
 	int ret;
 
-	if (likely(drm_ht_find_item(&sw_context->res_ht, (unsigned long) res,
-				    &hash) == 0)) {
-		node = container_of(hash, struct vmw_resource_val_node, hash);
+	node = vmw_val_ht_find(sw_context, (unsigned long) res);
+	if (likely(node != NULL)) {
 		node->first_usage = false;
 		if (unlikely(p_node != NULL))
 			*p_node = node;
 		return 0;
 	}
 
-	node = kzalloc(sizeof(*node), GFP_KERNEL);
-	if (unlikely(node == NULL)) {
-		DRM_ERROR("Failed to allocate a resource validation "
-			  "entry.\n");
-		return -ENOMEM;
+	if (likely(!list_empty(&sw_context->val_free))) {
+		node = list_first_entry(&sw_context->val_free,
+					struct vmw_resource_val_node, head);
+		list_del(&node->head);
+		memset(node, 0, sizeof(*node));
+		sw_context->allocs_avoided++;
+	} else {
+		node = kzalloc(sizeof(*node), GFP_KERNEL);
+		if (unlikely(node == NULL)) {
+			DRM_ERROR("Failed to allocate a resource validation "
+				  "entry.\n");
+			return -ENOMEM;
+		}
 	}
 
-	node->hash.key = (unsigned long) res;
-	ret = drm_ht_insert_item(&sw_context->res_ht, &node->hash);
+	ret = vmw_val_ht_insert(sw_context, (unsigned long) res, node);
 	if (unlikely(ret != 0)) {
 		DRM_ERROR("Failed to initialize a resource validation "
 			  "entry.\n");
-		kfree(node);
+		list_add(&node->head, &sw_context->val_free);
 		return ret;
 	}
 	list_add_tail(&node->head, &sw_context->resource_list);
@@ -220,43 +376,54 @@ static int vmw_resource_context_res_add(struct vmw_private *dev_priv,
 /**
  * vmw_resource_relocation_add - Add a relocation to the relocation list
  *
- * @list: Pointer to head of relocation list.
+ * @sw_context: Pointer to the software context.
  * @res: The resource.
  * @offset: Offset into the command buffer currently being parsed where the
  * id that needs fixup is located. Granularity is 4 bytes.
+ *
+ * Relocations are taken from the software context's free list if
+ * possible.
  */
-static int vmw_resource_relocation_add(struct list_head *list,
+static int vmw_resource_relocation_add(struct vmw_sw_context *sw_context,
 				       const struct vmw_resource *res,
 				       unsigned long offset)
 {
 	struct vmw_resource_relocation *rel;
 
-	rel = kmalloc(sizeof(*rel), GFP_KERNEL);
-	if (unlikely(rel == NULL)) {
-		DRM_ERROR("Failed to allocate a resource relocation.\n");
-		return -ENOMEM;
+	if (likely(!list_empty(&sw_context->reloc_free))) {
+		rel = list_first_entry(&sw_context->reloc_free,
+				       struct vmw_resource_relocation, head);
+		list_del(&rel->head);
+		sw_context->allocs_avoided++;
+	} else {
+		rel = kmalloc(sizeof(*rel), GFP_KERNEL);
+		if (unlikely(rel == NULL)) {
+			DRM_ERROR("Failed to allocate a resource "
+				  "relocation.\n");
+			return -ENOMEM;
+		}
 	}
 
 	rel->res = res;
 	rel->offset = offset;
-	list_add_tail(&rel->head, list);
+	list_add_tail(&rel->head, &sw_context->res_relocations);
 
 	return 0;
 }
 
 /**
- * vmw_resource_relocations_free - Free all relocations on a list
+ * vmw_resource_relocations_free - Release all relocations of a software
+ * context.
  *
- * @list: Pointer to the head of the relocation list.
+ * @sw_context: Pointer to the software context.
+ *
+ * The relocations are moved to the software context's free list for
+ * reuse by the next command submission.
  */
-static void vmw_resource_relocations_free(struct list_head *list)
+static void vmw_resource_relocations_free(struct vmw_sw_context *sw_context)
 {
-	struct vmw_resource_relocation *rel, *n;
-
-	list_for_each_entry_safe(rel, n, list, head) {
-		list_del(&rel->head);
-		kfree(rel);
-	}
+	list_splice_init(&sw_context->res_relocations,
+			 &sw_context->reloc_free);
 }
 
 /**
@@ -319,13 +486,10 @@ static int vmw_bo_to_validate_list(struct vmw_sw_context *sw_context,
 	uint32_t val_node;
 	struct vmw_validate_buffer *vval_buf;
 	struct ttm_validate_buffer *val_buf;
-	struct drm_hash_item *hash;
 	int ret;
 
-	if (likely(drm_ht_find_item(&sw_context->res_ht, (unsigned long) bo,
-				    &hash) == 0)) {
-		vval_buf = container_of(hash, struct vmw_validate_buffer,
-					hash);
+	vval_buf = vmw_val_ht_find(sw_context, (unsigned long) bo);
+	if (likely(vval_buf != NULL)) {
 		if (unlikely(vval_buf->validate_as_mob != validate_as_mob)) {
 			DRM_ERROR("Inconsistent buffer usage.\n");
 			return -EINVAL;
@@ -340,8 +504,8 @@ static int vmw_bo_to_validate_list(struct vmw_sw_context *sw_context,
 			return -EINVAL;
 		}
 		vval_buf = &sw_context->val_bufs[val_node];
-		vval_buf->hash.key = (unsigned long) bo;
-		ret = drm_ht_insert_item(&sw_context->res_ht, &vval_buf->hash);
+		ret = vmw_val_ht_insert(sw_context, (unsigned long) bo,
+					vval_buf);
 		if (unlikely(ret != 0)) {
 			DRM_ERROR("Failed to initialize a buffer validation "
 				  "entry.\n");
@@ -388,7 +552,7 @@ static int vmw_resources_reserve(struct vmw_sw_context *sw_context)
 		if (unlikely(ret != 0))
 			return ret;
 
-		if (res->backup) {
+		if (res->backup && !vmw_resource_backup_retained(res)) {
 			struct ttm_buffer_object *bo = &res->backup->base;
 
 			ret = vmw_bo_to_validate_list
@@ -410,7 +574,8 @@ static int vmw_resources_reserve(struct vmw_sw_context *sw_context)
  * @sw_context: Pointer to the software context.
  *
  * Before this function is called, all resource backup buffers must have
- * been validated.
+ * been validated. Create and bind commands emitted here are not flushed,
+ * but submitted together with the command batch and fence that follow.
  */
 static int vmw_resources_validate(struct vmw_sw_context *sw_context)
 {
@@ -454,7 +619,7 @@ static int vmw_cmd_res_reloc_add(struct vmw_private *dev_priv,
 	struct vmw_resource_val_node *node;
 
 	*p_val = NULL;
-	ret = vmw_resource_relocation_add(&sw_context->res_relocations,
+	ret = vmw_resource_relocation_add(sw_context,
 					  res,
 					  id_loc - sw_context->buf_start);
 	if (unlikely(ret != 0))
@@ -496,7 +661,7 @@ out_err:
 
 
 /**
- * vmw_cmd_res_check - Check that a resource is present and if so, put it
+ * vmw_cmd_res_lookup - Check that a resource is present and if so, put it
  * on the resource validate list unless it's already there.
  *
  * @dev_priv: Pointer to a device private structure.
@@ -507,14 +672,17 @@ out_err:
  * parsed from where the user-space resource id handle is located.
  * @p_val: Pointer to pointer to resource validalidation node. Populated
  * on exit.
+ *
+ * Unlike vmw_cmd_res_check(), this function doesn't mark surfaces as
+ * modified. Callers must stage any surface damage themselves.
  */
 static int
-vmw_cmd_res_check(struct vmw_private *dev_priv,
-		  struct vmw_sw_context *sw_context,
-		  enum vmw_res_type res_type,
-		  const struct vmw_user_resource_conv *converter,
-		  uint32_t *id_loc,
-		  struct vmw_resource_val_node **p_val)
+vmw_cmd_res_lookup(struct vmw_private *dev_priv,
+		   struct vmw_sw_context *sw_context,
+		   enum vmw_res_type res_type,
+		   const struct vmw_user_resource_conv *converter,
+		   uint32_t *id_loc,
+		   struct vmw_resource_val_node **p_val)
 {
 	struct vmw_res_cache_entry *rcache =
 		&sw_context->res_cache[res_type];
@@ -545,8 +713,7 @@ vmw_cmd_res_check(struct vmw_private *dev_priv,
 			*p_val = rcache->node;
 
 		return vmw_resource_relocation_add
-			(&sw_context->res_relocations, res,
-			 id_loc - sw_context->buf_start);
+			(sw_context, res, id_loc - sw_context->buf_start);
 	}
 
 	ret = vmw_user_resource_lookup_handle(dev_priv,
@@ -583,6 +750,46 @@ out_no_reloc:
 	return ret;
 }
 
+/**
+ * vmw_cmd_res_check - Check that a resource is present and if so, put it
+ * on the resource validate list unless it's already there.
+ *
+ * @dev_priv: Pointer to a device private structure.
+ * @sw_context: Pointer to the software context.
+ * @res_type: Resource type.
+ * @converter: User-space visisble type specific information.
+ * @id_loc: Pointer to the location in the command buffer currently being
+ * parsed from where the user-space resource id handle is located.
+ * @p_val: Pointer to pointer to resource validalidation node. Populated
+ * on exit.
+ *
+ * Surfaces are assumed to be modified in full by the command.
+ */
+static int
+vmw_cmd_res_check(struct vmw_private *dev_priv,
+		  struct vmw_sw_context *sw_context,
+		  enum vmw_res_type res_type,
+		  const struct vmw_user_resource_conv *converter,
+		  uint32_t *id_loc,
+		  struct vmw_resource_val_node **p_val)
+{
+	struct vmw_resource_val_node *node;
+	int ret;
+
+	ret = vmw_cmd_res_lookup(dev_priv, sw_context, res_type, converter,
+				 id_loc, &node);
+	if (unlikely(ret != 0))
+		return ret;
+
+	if (res_type == vmw_res_surface && node != NULL)
+		node->srf_dirty.all = true;
+
+	if (p_val)
+		*p_val = node;
+
+	return 0;
+}
+
 /**
  * vmw_rebind_contexts - Rebind all resources previously bound to
  * referenced contexts.
@@ -682,17 +889,39 @@ static int vmw_cmd_surface_copy_check(struct vmw_private *dev_priv,
 		SVGA3dCmdHeader header;
 		SVGA3dCmdSurfaceCopy body;
 	} *cmd;
+	struct vmw_resource_val_node *dst_node;
+	SVGA3dCopyBox *cb;
+	uint32_t num_boxes;
 	int ret;
 
 	cmd = container_of(header, struct vmw_sid_cmd, header);
-	ret = vmw_cmd_res_check(dev_priv, sw_context, vmw_res_surface,
-				user_surface_converter,
-				&cmd->body.src.sid, NULL);
+	ret = vmw_cmd_res_lookup(dev_priv, sw_context, vmw_res_surface,
+				 user_surface_converter,
+				 &cmd->body.src.sid, NULL);
 	if (unlikely(ret != 0))
 		return ret;
-	return vmw_cmd_res_check(dev_priv, sw_context, vmw_res_surface,
+	ret = vmw_cmd_res_lookup(dev_priv, sw_context, vmw_res_surface,
 				 user_surface_converter,
-				 &cmd->body.dest.sid, NULL);
+				 &cmd->body.dest.sid, &dst_node);
+	if (unlikely(ret != 0) || dst_node == NULL)
+		return ret;
+
+	if (unlikely(header->size < sizeof(cmd->body))) {
+		DRM_ERROR("Invalid surface copy command size.\n");
+		return -EINVAL;
+	}
+
+	cb = (SVGA3dCopyBox *) &cmd[1];
+	num_boxes = (header->size - sizeof(cmd->body)) / sizeof(*cb);
+	for (; num_boxes > 0; --num_boxes, ++cb) {
+		SVGA3dBox box = {cb->x, cb->y, cb->z, cb->w, cb->h, cb->d};
+
+		vmw_surface_dirty_stage(dst_node->res, &dst_node->srf_dirty,
+					cmd->body.dest.face,
+					cmd->body.dest.mipmap, &box);
+	}
+
+	return 0;
 }
 
 static int vmw_cmd_stretch_blt_check(struct vmw_private *dev_priv,
@@ -703,17 +932,25 @@ static int vmw_cmd_stretch_blt_check(struct vmw_private *dev_priv,
 		SVGA3dCmdHeader header;
 		SVGA3dCmdSurfaceStretchBlt body;
 	} *cmd;
+	struct vmw_resource_val_node *dst_node;
 	int ret;
 
 	cmd = container_of(header, struct vmw_sid_cmd, header);
-	ret = vmw_cmd_res_check(dev_priv, sw_context, vmw_res_surface,
-				user_surface_converter,
-				&cmd->body.src.sid, NULL);
+	ret = vmw_cmd_res_lookup(dev_priv, sw_context, vmw_res_surface,
+				 user_surface_converter,
+				 &cmd->body.src.sid, NULL);
 	if (unlikely(ret != 0))
 		return ret;
-	return vmw_cmd_res_check(dev_priv, sw_context, vmw_res_surface,
+	ret = vmw_cmd_res_lookup(dev_priv, sw_context, vmw_res_surface,
 				 user_surface_converter,
-				 &cmd->body.dest.sid, NULL);
+				 &cmd->body.dest.sid, &dst_node);
+	if (unlikely(ret != 0) || dst_node == NULL)
+		return ret;
+
+	vmw_surface_dirty_stage(dst_node->res, &dst_node->srf_dirty,
+				cmd->body.dest.face, cmd->body.dest.mipmap,
+				&cmd->body.boxDest);
+	return 0;
 }
 
 static int vmw_cmd_blt_surf_screen_check(struct vmw_private *dev_priv,
@@ -727,9 +964,9 @@ static int vmw_cmd_blt_surf_screen_check(struct vmw_private *dev_priv,
 
 	cmd = container_of(header, struct vmw_sid_cmd, header);
 
-	return vmw_cmd_res_check(dev_priv, sw_context, vmw_res_surface,
-				 user_surface_converter,
-				 &cmd->body.srcImage.sid, NULL);
+	return vmw_cmd_res_lookup(dev_priv, sw_context, vmw_res_surface,
+				  user_surface_converter,
+				  &cmd->body.srcImage.sid, NULL);
 }
 
 static int vmw_cmd_present_check(struct vmw_private *dev_priv,
@@ -744,9 +981,56 @@ static int vmw_cmd_present_check(struct vmw_private *dev_priv,
 
 	cmd = container_of(header, struct vmw_sid_cmd, header);
 
-	return vmw_cmd_res_check(dev_priv, sw_context, vmw_res_surface,
-				 user_surface_converter, &cmd->body.sid,
-				 NULL);
+	return vmw_cmd_res_lookup(dev_priv, sw_context, vmw_res_surface,
+				  user_surface_converter, &cmd->body.sid,
+				  NULL);
+}
+
+/**
+ * vmw_execbuf_lock_device - Take the device-wide command submission lock.
+ *
+ * @dev_priv: The device private structure.
+ * @sw_context: The software context used for this command submission.
+ *
+ * Command verification runs under the per-file submission lock only. Once
+ * device state needs to be examined or modified, this function is called to
+ * take the device-wide cmdbuf mutex. It is a no-op if the software context
+ * already holds the lock. Since the pinned query buffer may change while
+ * the lock is not held, the current query buffer is sampled here.
+ */
+static int vmw_execbuf_lock_device(struct vmw_private *dev_priv,
+				   struct vmw_sw_context *sw_context)
+{
+	int ret;
+
+	if (sw_context->device_locked)
+		return 0;
+
+	ret = mutex_lock_interruptible(&dev_priv->cmdbuf_mutex);
+	if (unlikely(ret != 0))
+		return -ERESTARTSYS;
+
+	sw_context->device_locked = true;
+	sw_context->cur_query_bo = dev_priv->pinned_bo;
+
+	return 0;
+}
+
+/**
+ * vmw_execbuf_unlock_device - Release the device-wide command submission
+ * lock if held.
+ *
+ * @dev_priv: The device private structure.
+ * @sw_context: The software context used for this command submission.
+ */
+static void vmw_execbuf_unlock_device(struct vmw_private *dev_priv,
+				      struct vmw_sw_context *sw_context)
+{
+	if (!sw_context->device_locked)
+		return;
+
+	sw_context->device_locked = false;
+	mutex_unlock(&dev_priv->cmdbuf_mutex);
 }
 
 /**
@@ -770,6 +1054,14 @@ static int vmw_query_bo_switch_prepare(struct vmw_private *dev_priv,
 		&sw_context->res_cache[vmw_res_context];
 	int ret;
 
+	/*
+	 * The pinned query buffer is device state. Hold on to the
+	 * device lock from here until the batch is submitted.
+	 */
+	ret = vmw_execbuf_lock_device(dev_priv, sw_context);
+	if (unlikely(ret != 0))
+		return ret;
+
 	BUG_ON(!ctx_entry->valid);
 	sw_context->last_query_ctx = ctx_entry->res;
 
@@ -1241,6 +1533,7 @@ static int vmw_cmd_dma(struct vmw_private *dev_priv,
 {
 	struct vmw_dma_buffer *vmw_bo = NULL;
 	struct vmw_surface *srf = NULL;
+	struct vmw_resource_val_node *node;
 	struct vmw_dma_cmd {
 		SVGA3dCmdHeader header;
 		SVGA3dCmdSurfaceDMA dma;
@@ -1276,9 +1569,9 @@ static int vmw_cmd_dma(struct vmw_private *dev_priv,
 	if (unlikely(suffix->maximumOffset > bo_size))
 		suffix->maximumOffset = bo_size;
 
-	ret = vmw_cmd_res_check(dev_priv, sw_context, vmw_res_surface,
-				user_surface_converter, &cmd->dma.host.sid,
-				NULL);
+	ret = vmw_cmd_res_lookup(dev_priv, sw_context, vmw_res_surface,
+				 user_surface_converter, &cmd->dma.host.sid,
+				 &node);
 	if (unlikely(ret != 0)) {
 		if (unlikely(ret != -ERESTARTSYS))
 			DRM_ERROR("could not find surface for DMA.\n");
@@ -1287,8 +1580,29 @@ static int vmw_cmd_dma(struct vmw_private *dev_priv,
 
 	srf = vmw_res_to_srf(sw_context->res_cache[vmw_res_surface].res);
 
-	vmw_kms_cursor_snoop(srf, sw_context->fp->tfile, &vmw_bo->base,
-			     header);
+	if (node != NULL && cmd->dma.transfer == SVGA3D_WRITE_HOST_VRAM) {
+		SVGA3dCopyBox *cb = (SVGA3dCopyBox *) &cmd[1];
+		SVGA3dCopyBox *cb_end = (SVGA3dCopyBox *) suffix;
+
+		for (; cb < cb_end; ++cb) {
+			SVGA3dBox box = {cb->x, cb->y, cb->z,
+					 cb->w, cb->h, cb->d};
+
+			vmw_surface_dirty_stage(&srf->res, &node->srf_dirty,
+						cmd->dma.host.face,
+						cmd->dma.host.mipmap, &box);
+		}
+	}
+
+	/*
+	 * The snooper image is shared with the KMS cursor code, so defer
+	 * the snoop until the device is locked.
+	 */
+	if (node != NULL && srf->snooper.image) {
+		vmw_dmabuf_unreference(&node->snoop_bo);
+		node->snoop_bo = vmw_dmabuf_reference(vmw_bo);
+		node->snoop_header = header;
+	}
 
 out_no_surface:
 	vmw_dmabuf_unreference(&vmw_bo);
@@ -1379,9 +1693,11 @@ static int vmw_cmd_tex_state(struct vmw_private *dev_priv,
 		if (likely(cur_state->name != SVGA3D_TS_BIND_TEXTURE))
 			continue;
 
-		ret = vmw_cmd_res_check(dev_priv, sw_context, vmw_res_surface,
-					user_surface_converter,
-					&cur_state->value, &res_node);
+		/* Bound textures are only read from. */
+		ret = vmw_cmd_res_lookup(dev_priv, sw_context,
+					 vmw_res_surface,
+					 user_surface_converter,
+					 &cur_state->value, &res_node);
 		if (unlikely(ret != 0))
 			return ret;
 
@@ -1688,7 +2004,7 @@ static int vmw_cmd_shader_define(struct vmw_private *dev_priv,
 	if (unlikely(ret != 0))
 		return ret;
 
-	return vmw_resource_relocation_add(&sw_context->res_relocations,
+	return vmw_resource_relocation_add(sw_context,
 					   NULL, &cmd->header.id -
 					   sw_context->buf_start);
 
@@ -1733,7 +2049,7 @@ static int vmw_cmd_shader_destroy(struct vmw_private *dev_priv,
 	if (unlikely(ret != 0))
 		return ret;
 
-	return vmw_resource_relocation_add(&sw_context->res_relocations,
+	return vmw_resource_relocation_add(sw_context,
 					   NULL, &cmd->header.id -
 					   sw_context->buf_start);
 
@@ -2137,19 +2453,89 @@ out_new:
 	return -EINVAL;
 }
 
+/**
+ * vmw_cmd_check_fast - Verify a command that needs no command specific
+ * handler.
+ *
+ * @sw_context: Pointer to the software context.
+ * @header: The command header.
+ * @size_remaining: Number of bytes left in the command buffer.
+ * @gb: Whether guest-backed objects are available.
+ * @size: On successful return, the size of the verified command.
+ *
+ * Most of a typical command stream consists of render state commands
+ * that are either accepted as is (vmw_cmd_ok) or only carry a context
+ * id in the first word of the body (vmw_cmd_cid_check). Such commands
+ * are verified inline, and the context id is patched through the
+ * context resource cache, without dispatching through the command
+ * table.
+ *
+ * Returns 0 if the command was verified, -EAGAIN if it needs to go
+ * through vmw_cmd_check(), or a negative error code on failure.
+ */
+static int vmw_cmd_check_fast(struct vmw_sw_context *sw_context,
+			      SVGA3dCmdHeader *header,
+			      uint32_t size_remaining,
+			      bool gb, uint32_t *size)
+{
+	const struct vmw_cmd_entry *entry;
+	struct vmw_res_cache_entry *rcache;
+	uint32_t cmd_id, body_size;
+	uint32_t *id_loc;
+
+	if (unlikely(size_remaining < sizeof(*header)))
+		return -EAGAIN;
+
+	cmd_id = le32_to_cpu(header->id) - SVGA_3D_CMD_BASE;
+	body_size = le32_to_cpu(header->size);
+	if (unlikely(cmd_id >= SVGA_3D_CMD_MAX - SVGA_3D_CMD_BASE ||
+		     body_size > size_remaining - sizeof(*header)))
+		return -EAGAIN;
+
+	entry = &vmw_cmd_entries[cmd_id];
+	if (unlikely((!entry->user_allow && !sw_context->kernel) ||
+		     (entry->gb_disable && gb) ||
+		     (entry->gb_enable && !gb)))
+		return -EAGAIN;
+
+	if (entry->func == &vmw_cmd_ok) {
+		*size = body_size + sizeof(*header);
+		return 0;
+	}
+
+	if (entry->func != &vmw_cmd_cid_check ||
+	    body_size < sizeof(*id_loc))
+		return -EAGAIN;
+
+	rcache = &sw_context->res_cache[vmw_res_context];
+	id_loc = (uint32_t *) &header[1];
+	if (!rcache->valid || *id_loc != rcache->handle)
+		return -EAGAIN;
+
+	rcache->node->first_usage = false;
+	*size = body_size + sizeof(*header);
+
+	return vmw_resource_relocation_add(sw_context, rcache->res,
+					   id_loc - sw_context->buf_start);
+}
+
 static int vmw_cmd_check_all(struct vmw_private *dev_priv,
 			     struct vmw_sw_context *sw_context,
 			     void *buf,
 			     uint32_t size)
 {
 	int32_t cur_size = size;
+	bool gb = dev_priv->capabilities & SVGA_CAP_GBOBJECTS;
 	int ret;
 
 	sw_context->buf_start = buf;
 
 	while (cur_size > 0) {
-		size = cur_size;
-		ret = vmw_cmd_check(dev_priv, sw_context, buf, &size);
+		ret = vmw_cmd_check_fast(sw_context, buf, cur_size, gb, &size);
+		if (ret == -EAGAIN) {
+			size = cur_size;
+			ret = vmw_cmd_check(dev_priv, sw_context, buf, &size);
+		}
 		if (unlikely(ret != 0))
 			return ret;
 		buf = (void *)((unsigned long) buf + size);
@@ -2199,32 +2585,62 @@ static void vmw_apply_relocations(struct vmw_sw_context *sw_context)
 }
 
 /**
- * vmw_resource_list_unrefererence - Free up a resource list and unreference
- * all resources referenced by it.
+ * vmw_resource_list_unrefererence - Free up the resource list of a
+ * software context and unreference all resources referenced by it.
  *
- * @list: The resource list.
+ * @sw_context: Pointer to the software context.
+ *
+ * The validation nodes are moved to the software context's free list
+ * for reuse by the next command submission.
  */
-static void vmw_resource_list_unreference(struct list_head *list)
+static void vmw_resource_list_unreference(struct vmw_sw_context *sw_context)
 {
-	struct vmw_resource_val_node *val, *val_next;
+	struct vmw_resource_val_node *val;
 
 	/*
 	 * Drop references to resources held during command submission.
 	 */
 
-	list_for_each_entry_safe(val, val_next, list, head) {
-		list_del_init(&val->head);
+	list_for_each_entry(val, &sw_context->resource_list, head) {
 		vmw_resource_unreference(&val->res);
-		if (unlikely(val->staged_bindings))
+		vmw_dmabuf_unreference(&val->new_backup);
+		vmw_dmabuf_unreference(&val->snoop_bo);
+		if (unlikely(val->staged_bindings)) {
 			kfree(val->staged_bindings);
-		kfree(val);
+			val->staged_bindings = NULL;
+		}
+	}
+	list_splice_init(&sw_context->resource_list, &sw_context->val_free);
+}
+
+/**
+ * vmw_execbuf_cursor_snoop - Snoop the DMA commands to cursor surfaces
+ * recorded by the command verifier.
+ *
+ * @sw_context: Pointer to the software context.
+ *
+ * Must be called with the device locked, and before the buffers on the
+ * validation list are reserved.
+ */
+static void vmw_execbuf_cursor_snoop(struct vmw_sw_context *sw_context)
+{
+	struct vmw_resource_val_node *val;
+
+	list_for_each_entry(val, &sw_context->resource_list, head) {
+		if (likely(val->snoop_bo == NULL))
+			continue;
+
+		vmw_kms_cursor_snoop(vmw_res_to_srf(val->res),
+				     sw_context->fp->tfile,
+				     &val->snoop_bo->base,
+				     val->snoop_header);
+		vmw_dmabuf_unreference(&val->snoop_bo);
 	}
 }
 
 static void vmw_clear_validations(struct vmw_sw_context *sw_context)
 {
 	struct vmw_validate_buffer *entry, *next;
-	struct vmw_resource_val_node *val;
 
 	/*
 	 * Drop references to DMA buffers held during command submission.
@@ -2233,15 +2649,11 @@ static void vmw_clear_validations(struct vmw_sw_context *sw_context)
 				 base.head) {
 		list_del(&entry->base.head);
 		ttm_bo_unref(&entry->base.bo);
-		(void) drm_ht_remove_item(&sw_context->res_ht, &entry->hash);
 		sw_context->cur_val_buf--;
 	}
 	BUG_ON(sw_context->cur_val_buf != 0);
 
-	list_for_each_entry(val, &sw_context->resource_list, head)
-		(void) drm_ht_remove_item(&sw_context->res_ht, &val->hash);
-
-	BUG_ON(sw_context->res_ht.fill != 0);
+	vmw_val_ht_reset(sw_context);
 }
 
 static int vmw_validate_single_buffer(struct vmw_private *dev_priv,
@@ -2446,6 +2858,71 @@ vmw_execbuf_copy_fence_user(struct vmw_private *dev_priv,
 
 
 
+/**
+ * vmw_execbuf_sw_context_get - Return the software context of a file,
+ * allocating it if needed.
+ *
+ * @vmw_fp: Pointer to the struct vmw_fpriv of the submitting file.
+ *
+ * Must be called with @vmw_fp->cmdbuf_mutex held. Returns NULL on
+ * allocation failure.
+ */
+static struct vmw_sw_context *
+vmw_execbuf_sw_context_get(struct vmw_fpriv *vmw_fp)
+{
+	struct vmw_sw_context *sw_context = vmw_fp->sw_context;
+
+	if (likely(sw_context != NULL))
+		return sw_context;
+
+	sw_context = vzalloc(sizeof(*sw_context));
+	if (unlikely(sw_context == NULL)) {
+		DRM_ERROR("Failed to allocate a software context.\n");
+		return NULL;
+	}
+
+	sw_context->val_ht = vzalloc(sizeof(*sw_context->val_ht) <<
+				     VMW_VAL_HT_ORDER);
+	if (unlikely(sw_context->val_ht == NULL)) {
+		DRM_ERROR("Failed to allocate a validation table.\n");
+		vfree(sw_context);
+		return NULL;
+	}
+	sw_context->val_ht_order = VMW_VAL_HT_ORDER;
+	sw_context->val_ht_gen = 1;
+	INIT_LIST_HEAD(&sw_context->val_free);
+	INIT_LIST_HEAD(&sw_context->reloc_free);
+	vmw_fp->sw_context = sw_context;
+
+	return sw_context;
+}
+
+/**
+ * vmw_execbuf_sw_context_free - Free the software context of a file.
+ *
+ * @vmw_fp: Pointer to the struct vmw_fpriv of the file being closed.
+ */
+void vmw_execbuf_sw_context_free(struct vmw_fpriv *vmw_fp)
+{
+	struct vmw_sw_context *sw_context = vmw_fp->sw_context;
+	struct vmw_resource_val_node *val, *val_next;
+	struct vmw_resource_relocation *rel, *rel_next;
+
+	if (sw_context == NULL)
+		return;
+
+	list_for_each_entry_safe(val, val_next, &sw_context->val_free, head)
+		kfree(val);
+	list_for_each_entry_safe(rel, rel_next, &sw_context->reloc_free, head)
+		kfree(rel);
+
+	vfree(sw_context->val_ht);
+	if (sw_context->cmd_bounce)
+		vfree(sw_context->cmd_bounce);
+	vfree(sw_context);
+	vmw_fp->sw_context = NULL;
+}
+
 int vmw_execbuf_process(struct drm_file *file_priv,
 			struct vmw_private *dev_priv,
 			void __user *user_commands,
@@ -2455,18 +2932,28 @@ int vmw_execbuf_process(struct drm_file *file_priv,
 			struct drm_vmw_fence_rep __user *user_fence_rep,
 			struct vmw_fence_obj **out_fence)
 {
-	struct vmw_sw_context *sw_context = &dev_priv->ctx;
+	struct vmw_fpriv *vmw_fp = vmw_fpriv(file_priv);
+	struct vmw_sw_context *sw_context;
 	struct vmw_fence_obj *fence = NULL;
 	struct vmw_resource *error_resource;
-	struct list_head resource_list;
 	uint32_t handle;
-	void *cmd;
 	int ret;
 
-	ret = mutex_lock_interruptible(&dev_priv->cmdbuf_mutex);
+	ret = mutex_lock_interruptible(&vmw_fp->cmdbuf_mutex);
 	if (unlikely(ret != 0))
 		return -ERESTARTSYS;
 
+	sw_context = vmw_execbuf_sw_context_get(vmw_fp);
+	if (unlikely(sw_context == NULL)) {
+		mutex_unlock(&vmw_fp->cmdbuf_mutex);
+		return -ENOMEM;
+	}
+
+	INIT_LIST_HEAD(&sw_context->resource_list);
+	INIT_LIST_HEAD(&sw_context->staged_cmd_res);
+	sw_context->device_locked = false;
+	sw_context->allocs_avoided = 0;
+
 	if (kernel_commands == NULL) {
 		sw_context->kernel = false;
 
@@ -2487,31 +2974,35 @@ int vmw_execbuf_process(struct drm_file *file_priv,
 	} else
 		sw_context->kernel = true;
 
-	sw_context->fp = vmw_fpriv(file_priv);
+	sw_context->fp = vmw_fp;
 	sw_context->cur_reloc = 0;
 	sw_context->cur_val_buf = 0;
 	sw_context->fence_flags = 0;
-	INIT_LIST_HEAD(&sw_context->resource_list);
-	sw_context->cur_query_bo = dev_priv->pinned_bo;
+	sw_context->cur_query_bo = NULL;
 	sw_context->last_query_ctx = NULL;
 	sw_context->needs_post_query_barrier = false;
 	memset(sw_context->res_cache, 0, sizeof(sw_context->res_cache));
 	INIT_LIST_HEAD(&sw_context->validate_nodes);
 	INIT_LIST_HEAD(&sw_context->res_relocations);
-	if (!sw_context->res_ht_initialized) {
-		ret = drm_ht_create(&sw_context->res_ht, VMW_RES_HT_ORDER);
-		if (unlikely(ret != 0))
-			goto out_unlock;
-		sw_context->res_ht_initialized = true;
-	}
-	INIT_LIST_HEAD(&sw_context->staged_cmd_res);
 
-	INIT_LIST_HEAD(&resource_list);
+	/*
+	 * Command verification only touches per-file state and
+	 * reference-counted objects, and runs concurrently with
+	 * other clients. Verifiers that need device state take the
+	 * device lock themselves, or defer their work until the device
+	 * is locked below.
+	 */
 	ret = vmw_cmd_check_all(dev_priv, sw_context, kernel_commands,
 				command_size);
 	if (unlikely(ret != 0))
 		goto out_err;
 
+	ret = vmw_execbuf_lock_device(dev_priv, sw_context);
+	if (unlikely(ret != 0))
+		goto out_err;
+
+	vmw_execbuf_cursor_snoop(sw_context);
+
 	ret = vmw_resources_reserve(sw_context);
 	if (unlikely(ret != 0))
 		goto out_err;
@@ -2545,24 +3036,24 @@ int vmw_execbuf_process(struct drm_file *file_priv,
 	if (dev_priv->has_mob) {
 		ret = vmw_rebind_contexts(sw_context);
 		if (unlikely(ret != 0))
-			goto out_err;
+			goto out_unlock_binding;
 	}
 
-	cmd = vmw_fifo_reserve(dev_priv, command_size);
-	if (unlikely(cmd == NULL)) {
+	/*
+	 * Patch the verified batch where it is, and copy it to the
+	 * fifo only once.
+	 */
+	vmw_apply_relocations(sw_context);
+	vmw_resource_relocations_apply(kernel_commands,
+				       &sw_context->res_relocations);
+	vmw_resource_relocations_free(sw_context);
+
+	ret = vmw_fifo_emit(dev_priv, kernel_commands, command_size);
+	if (unlikely(ret != 0)) {
 		DRM_ERROR("Failed reserving fifo space for commands.\n");
-		ret = -ENOMEM;
 		goto out_unlock_binding;
 	}
 
-	vmw_apply_relocations(sw_context);
-	memcpy(cmd, kernel_commands, command_size);
-
-	vmw_resource_relocations_apply(cmd, &sw_context->res_relocations);
-	vmw_resource_relocations_free(&sw_context->res_relocations);
-
-	vmw_fifo_commit(dev_priv, command_size);
-
 	vmw_query_bo_switch_commit(dev_priv, sw_context);
 	ret = vmw_execbuf_fence_commands(file_priv, dev_priv,
 					 &fence,
@@ -2576,7 +3067,8 @@ int vmw_execbuf_process(struct drm_file *file_priv,
 	if (ret != 0)
 		DRM_ERROR("Fence submission error. Syncing.\n");
 
-	vmw_resource_list_unreserve(&sw_context->resource_list, false);
+	vmw_resource_list_unreserve(dev_priv, &sw_context->resource_list,
+				    false);
 	mutex_unlock(&dev_priv->binding_mutex);
 
 	ttm_eu_fence_buffer_objects(&sw_context->validate_nodes,
@@ -2586,8 +3078,10 @@ int vmw_execbuf_process(struct drm_file *file_priv,
 		     !dev_priv->query_cid_valid))
 		__vmw_execbuf_release_pinned_bo(dev_priv, fence);
 
+	vmw_execbuf_unlock_device(dev_priv, sw_context);
+
 	vmw_clear_validations(sw_context);
-	vmw_execbuf_copy_fence_user(dev_priv, vmw_fpriv(file_priv), ret,
+	vmw_execbuf_copy_fence_user(dev_priv, vmw_fp, ret,
 				    user_fence_rep, fence, handle);
 
 	/* Don't unreference when handing fence out */
@@ -2598,41 +3092,53 @@ int vmw_execbuf_process(struct drm_file *file_priv,
 		vmw_fence_obj_unreference(&fence);
 	}
 
-	list_splice_init(&sw_context->resource_list, &resource_list);
 	vmw_cmdbuf_res_commit(&sw_context->staged_cmd_res);
-	mutex_unlock(&dev_priv->cmdbuf_mutex);
 
 	/*
-	 * Unreference resources outside of the cmdbuf_mutex to
+	 * Unreference resources outside of the device cmdbuf_mutex to
 	 * avoid deadlocks in resource destruction paths.
 	 */
-	vmw_resource_list_unreference(&resource_list);
+	vmw_resource_list_unreference(sw_context);
+	mutex_unlock(&vmw_fp->cmdbuf_mutex);
 
 	return 0;
 
 out_unlock_binding:
 	mutex_unlock(&dev_priv->binding_mutex);
 out_err:
-	vmw_resource_relocations_free(&sw_context->res_relocations);
+	vmw_resource_relocations_free(sw_context);
 	vmw_free_relocations(sw_context);
-	ttm_eu_backoff_reservation(&sw_context->validate_nodes);
-	vmw_resource_list_unreserve(&sw_context->resource_list, true);
+
+	/*
+	 * Resources and buffers are only reserved, and create and bind
+	 * commands only batched, with the device locked. If verification
+	 * failed before that, the reservations may belong to another client
+	 * and there is nothing of ours to flush.
+	 */
+	if (sw_context->device_locked) {
+		ttm_eu_backoff_reservation(&sw_context->validate_nodes);
+		vmw_resource_list_unreserve(dev_priv,
+					    &sw_context->resource_list, true);
+		vmw_fifo_flush(dev_priv);
+	}
 	vmw_clear_validations(sw_context);
-	if (unlikely(dev_priv->pinned_bo != NULL &&
+	if (unlikely(sw_context->device_locked &&
+		     dev_priv->pinned_bo != NULL &&
 		     !dev_priv->query_cid_valid))
 		__vmw_execbuf_release_pinned_bo(dev_priv, NULL);
 out_unlock:
-	list_splice_init(&sw_context->resource_list, &resource_list);
+	vmw_execbuf_unlock_device(dev_priv, sw_context);
 	error_resource = sw_context->error_resource;
 	sw_context->error_resource = NULL;
 	vmw_cmdbuf_res_revert(&sw_context->staged_cmd_res);
-	mutex_unlock(&dev_priv->cmdbuf_mutex);
 
 	/*
-	 * Unreference resources outside of the cmdbuf_mutex to
+	 * Unreference resources outside of the device cmdbuf_mutex to
 	 * avoid deadlocks in resource destruction paths.
 	 */
-	vmw_resource_list_unreference(&resource_list);
+	vmw_resource_list_unreference(sw_context);
+	mutex_unlock(&vmw_fp->cmdbuf_mutex);
+
 	if (unlikely(error_resource != NULL))
 		vmw_resource_unreference(&error_resource);
 
@@ -28,6 +28,7 @@
 
 #include "drmP.h"
 #include "vmwgfx_drv.h"
+#include "vmwgfx_damage.h"
 
 #include "ttm/ttm_placement.h"
 
@@ -59,13 +60,18 @@ struct vmw_fb_par {
 	unsigned bo_size;
 	bool bo_iowrite;
 
+	/*
+	 * Zero-copy mode. fbdev renders into gmr_bo, and vmw_bo only
+	 * reserves the start of VRAM that backs screen #0.
+	 */
+	bool zero_copy;
+	struct vmw_dma_buffer *gmr_bo;
+	struct ttm_bo_kmap_obj gmr_map;
+
 	struct {
 		spinlock_t lock;
 		bool active;
-		unsigned x1;
-		unsigned y1;
-		unsigned x2;
-		unsigned y2;
+		struct vmw_damage_set set;
 	} dirty;
 };
 
@@ -207,16 +213,79 @@ static int vmw_fb_blank(int blank, struct fb_info *info)
  * Dirty code
  */
 
+/**
+ * vmw_fb_dirty_blit - Blit dirty rects from the fbdev buffer to the screen.
+ *
+ * @par: The fbdev private structure.
+ * @rects: Rects to blit, as origin in x1, y1 and size in x2, y2.
+ * @num_rects: Number of rects.
+ *
+ * Used in zero-copy mode, where the fbdev buffer is pinned in a GMR.
+ * The buffer is defined as the GMRFB and the rects are blitted from it to
+ * screen #0, which the device defines from the legacy mode registers.
+ * Screen #0 is backed by the start of VRAM, so par->vmw_bo must be pinned
+ * there, which holds whenever the dirty state is active.
+ */
+static void vmw_fb_dirty_blit(struct vmw_fb_par *par,
+			      const struct drm_clip_rect *rects,
+			      unsigned num_rects)
+{
+	struct vmw_private *vmw_priv = par->vmw_priv;
+	struct fb_info *info = vmw_priv->fb_info;
+	size_t fifo_size;
+	unsigned i;
+
+	struct {
+		uint32_t header;
+		SVGAFifoCmdDefineGMRFB body;
+	} *define;
+
+	struct {
+		uint32_t header;
+		SVGAFifoCmdBlitGMRFBToScreen body;
+	} *blits;
+
+	fifo_size = sizeof(*define) + sizeof(*blits) * num_rects;
+	define = vmw_fifo_reserve(vmw_priv, fifo_size);
+	if (unlikely(define == NULL)) {
+		DRM_ERROR("Fifo reserve failed.\n");
+		return;
+	}
+
+	memset(define, 0, fifo_size);
+	define->header = SVGA_CMD_DEFINE_GMRFB;
+	define->body.format.bitsPerPixel = par->bpp;
+	define->body.format.colorDepth = par->depth;
+	define->body.bytesPerLine = info->fix.line_length;
+	vmw_bo_get_guest_ptr(&par->gmr_bo->base, &define->body.ptr);
+
+	blits = (void *) &define[1];
+	for (i = 0; i < num_rects; i++) {
+		blits[i].header = SVGA_CMD_BLIT_GMRFB_TO_SCREEN;
+		blits[i].body.destScreenId = 0;
+		blits[i].body.srcOrigin.x = rects[i].x1;
+		blits[i].body.srcOrigin.y = rects[i].y1;
+		blits[i].body.destRect.left = rects[i].x1;
+		blits[i].body.destRect.top = rects[i].y1;
+		blits[i].body.destRect.right = rects[i].x1 + rects[i].x2;
+		blits[i].body.destRect.bottom = rects[i].y1 + rects[i].y2;
+	}
+
+	vmw_fifo_commit(vmw_priv, fifo_size);
+}
+
 static void vmw_fb_dirty_flush(struct vmw_fb_par *par)
 {
 	struct vmw_private *vmw_priv = par->vmw_priv;
 	struct fb_info *info = vmw_priv->fb_info;
-	int stride = (info->fix.line_length / 4);
-	int *src = (int *)info->screen_base;
-	__le32 __iomem *vram_mem = par->bo_ptr;
+	struct drm_clip_rect rects[VMW_DAMAGE_SET_RECTS];
+	unsigned pitch = info->fix.line_length;
+	unsigned cpp = par->bpp / 8;
+	u8 *src = (u8 *)info->screen_base;
+	u8 __iomem *vram_mem = par->bo_ptr;
 	unsigned long flags;
-	unsigned x, y, w, h;
-	int i, k;
+	unsigned x, y, w, h, row;
+	unsigned i, num_rects, num_cmds;
 	struct {
 		uint32_t header;
 		SVGAFifoCmdUpdate body;
@@ -230,35 +299,64 @@ static void vmw_fb_dirty_flush(struct vmw_fb_par *par)
 		spin_unlock_irqrestore(&par->dirty.lock, flags);
 		return;
 	}
-	x = par->dirty.x1;
-	y = par->dirty.y1;
-	w = min(par->dirty.x2, info->var.xres) - x;
-	h = min(par->dirty.y2, info->var.yres) - y;
-	par->dirty.x1 = par->dirty.x2 = 0;
-	par->dirty.y1 = par->dirty.y2 = 0;
+	num_rects = par->dirty.set.num_rects;
+	memcpy(rects, par->dirty.set.rects, num_rects * sizeof(rects[0]));
+	par->dirty.set.num_rects = 0;
 	spin_unlock_irqrestore(&par->dirty.lock, flags);
 
-	for (i = y * stride; i < info->fix.smem_len / 4; i += stride) {
-		for (k = i+x; k < i+x+w && k < info->fix.smem_len / 4; k++)
-			iowrite32(src[k], vram_mem + k);
+	/*
+	 * Clip the rects to the visible area, dropping the ones that end up
+	 * empty. In shadow mode, copy only the dirty rows of each rect, one
+	 * burst per row.
+	 */
+	num_cmds = 0;
+	for (i = 0; i < num_rects; i++) {
+		x = rects[i].x1;
+		y = rects[i].y1;
+		w = min_t(unsigned, rects[i].x2, info->var.xres);
+		h = min_t(unsigned, rects[i].y2, info->var.yres);
+		h = min(h, info->fix.smem_len / pitch);
+		if (w <= x || h <= y)
+			continue;
+		w -= x;
+		h -= y;
+
+		if (!par->zero_copy)
+			for (row = y; row < y + h; row++)
+				memcpy_toio(vram_mem + row * pitch + x * cpp,
+					    src + row * pitch + x * cpp,
+					    w * cpp);
+
+		rects[num_cmds].x1 = x;
+		rects[num_cmds].y1 = y;
+		rects[num_cmds].x2 = w;
+		rects[num_cmds].y2 = h;
+		num_cmds++;
 	}
 
-#if 0
-	DRM_INFO("%s, (%u, %u) (%ux%u)\n", __func__, x, y, w, h);
-#endif
+	if (num_cmds == 0)
+		return;
 
-	cmd = vmw_fifo_reserve(vmw_priv, sizeof(*cmd));
+	if (par->zero_copy) {
+		vmw_fb_dirty_blit(par, rects, num_cmds);
+		return;
+	}
+
+	cmd = vmw_fifo_reserve(vmw_priv, sizeof(*cmd) * num_cmds);
 	if (unlikely(cmd == NULL)) {
 		DRM_ERROR("Fifo reserve failed.\n");
 		return;
 	}
 
-	cmd->header = cpu_to_le32(SVGA_CMD_UPDATE);
-	cmd->body.x = cpu_to_le32(x);
-	cmd->body.y = cpu_to_le32(y);
-	cmd->body.width = cpu_to_le32(w);
-	cmd->body.height = cpu_to_le32(h);
-	vmw_fifo_commit(vmw_priv, sizeof(*cmd));
+	/* rects now hold origin and size */
+	for (i = 0; i < num_cmds; i++) {
+		cmd[i].header = cpu_to_le32(SVGA_CMD_UPDATE);
+		cmd[i].body.x = cpu_to_le32(rects[i].x1);
+		cmd[i].body.y = cpu_to_le32(rects[i].y1);
+		cmd[i].body.width = cpu_to_le32(rects[i].x2);
+		cmd[i].body.height = cpu_to_le32(rects[i].y2);
+	}
+	vmw_fifo_commit(vmw_priv, sizeof(*cmd) * num_cmds);
 }
 
 static void vmw_fb_dirty_mark(struct vmw_fb_par *par,
@@ -267,36 +365,21 @@ static void vmw_fb_dirty_mark(struct vmw_fb_par *par,
 {
 	struct fb_info *info = par->vmw_priv->fb_info;
 	unsigned long flags;
-	unsigned x2 = x1 + width;
-	unsigned y2 = y1 + height;
 
 #if (defined(VMWGFX_STANDALONE) && defined(VMWGFX_FB_DEFERRED))
 	(void) info;
 #endif
 	spin_lock_irqsave(&par->dirty.lock, flags);
-	if (par->dirty.x1 == par->dirty.x2) {
-		par->dirty.x1 = x1;
-		par->dirty.y1 = y1;
-		par->dirty.x2 = x2;
-		par->dirty.y2 = y2;
-		/* if we are active start the dirty work
-		 * we share the work with the defio system */
-		if (par->dirty.active)
+	/* if we are active start the dirty work
+	 * we share the work with the defio system */
+	if (vmw_damage_set_add(&par->dirty.set, x1, y1, x1 + width,
+			       y1 + height) &&
+	    par->dirty.active)
 #if (defined(VMWGFX_STANDALONE) && defined(VMWGFX_FB_DEFERRED))
-			schedule_delayed_work(&par->def_par.deferred_work, VMW_DIRTY_DELAY);
+		schedule_delayed_work(&par->def_par.deferred_work, VMW_DIRTY_DELAY);
 #else
-			schedule_delayed_work(&info->deferred_work, VMW_DIRTY_DELAY);
+		schedule_delayed_work(&info->deferred_work, VMW_DIRTY_DELAY);
 #endif
-	} else {
-		if (x1 < par->dirty.x1)
-			par->dirty.x1 = x1;
-		if (y1 < par->dirty.y1)
-			par->dirty.y1 = y1;
-		if (x2 > par->dirty.x2)
-			par->dirty.x2 = x2;
-		if (y2 > par->dirty.y2)
-			par->dirty.y2 = y2;
-	}
 	spin_unlock_irqrestore(&par->dirty.lock, flags);
 }
 
@@ -314,31 +397,42 @@ static void vmw_deferred_io(struct fb_info *info,
 {
 	struct vmw_fb_par *par = info->par;
 #endif
-	unsigned long start, end, min, max;
+	unsigned long start, end;
 	unsigned long flags;
 	struct page *page;
-	int y1, y2;
+	bool in_run = false;
 
-	min = ULONG_MAX;
-	max = 0;
+	/*
+	 * The page list is sorted by index. Turn each run of contiguous
+	 * dirty pages into its own damage rect, so that clean gaps between
+	 * runs are not flushed.
+	 */
+	start = end = 0;
+	spin_lock_irqsave(&par->dirty.lock, flags);
 	list_for_each_entry(page, pagelist, lru) {
-		start = page->index << PAGE_SHIFT;
-		end = start + PAGE_SIZE - 1;
-		min = min(min, start);
-		max = max(max, end);
+		unsigned long offset = page->index << PAGE_SHIFT;
+
+		if (in_run && offset == end) {
+			end += PAGE_SIZE;
+			continue;
+		}
+
+		if (in_run)
+			vmw_damage_set_add_range(&par->dirty.set, start, end,
+						 info->fix.line_length,
+						 par->bpp / 8, info->var.xres,
+						 info->fix.smem_len);
+
+		start = offset;
+		end = offset + PAGE_SIZE;
+		in_run = true;
 	}
 
-	if (min < max) {
-		y1 = min / info->fix.line_length;
-		y2 = (max / info->fix.line_length) + 1;
-
-		spin_lock_irqsave(&par->dirty.lock, flags);
-		par->dirty.x1 = 0;
-		par->dirty.y1 = y1;
-		par->dirty.x2 = info->var.xres;
-		par->dirty.y2 = y2;
-		spin_unlock_irqrestore(&par->dirty.lock, flags);
-	}
+	if (in_run)
+		vmw_damage_set_add_range(&par->dirty.set, start, end,
+					 info->fix.line_length, par->bpp / 8,
+					 info->var.xres, info->fix.smem_len);
+	spin_unlock_irqrestore(&par->dirty.lock, flags);
 
 	vmw_fb_dirty_flush(par);
 };
@@ -397,14 +491,12 @@ static struct fb_ops vmw_fb_ops = {
 };
 
 static int vmw_fb_create_bo(struct vmw_private *vmw_priv,
-			    size_t size, struct vmw_dma_buffer **out)
+			    size_t size, struct ttm_placement *placement,
+			    struct vmw_dma_buffer **out)
 {
 	struct vmw_dma_buffer *vmw_bo;
-	struct ttm_placement ne_placement = vmw_vram_ne_placement;
 	int ret;
 
-	ne_placement.lpfn = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
-
 	(void) ttm_write_lock(&vmw_priv->reservation_sem, false);
 
 	vmw_bo = kmalloc(sizeof(*vmw_bo), GFP_KERNEL);
@@ -414,7 +506,7 @@ static int vmw_fb_create_bo(struct vmw_private *vmw_priv,
 	}
 
 	ret = vmw_dmabuf_init(vmw_priv, vmw_bo, size,
-			      &ne_placement,
+			      placement,
 			      false,
 			      &vmw_dmabuf_bo_free);
 	if (unlikely(ret != 0))
@@ -431,14 +523,71 @@ err_unlock:
 	return ret;
 }
 
+/**
+ * vmw_fb_zero_copy_init - Set up the fbdev buffer for zero-copy mode.
+ *
+ * @vmw_priv: Pointer to the device private structure.
+ * @par: The fbdev private structure.
+ * @size: Size of the framebuffer.
+ *
+ * Creates the fbdev render buffer pinned in a GMR and maps it, so that
+ * fbdev can render into it directly. Returns a pointer to the cpu mapping
+ * on success and NULL on failure.
+ */
+static void *vmw_fb_zero_copy_init(struct vmw_private *vmw_priv,
+				   struct vmw_fb_par *par, size_t size)
+{
+	void *ptr;
+	bool is_iomem;
+	int ret;
+
+	ret = vmw_fb_create_bo(vmw_priv, size, &vmw_gmr_ne_placement,
+			       &par->gmr_bo);
+	if (unlikely(ret != 0))
+		return NULL;
+
+	ret = ttm_bo_kmap(&par->gmr_bo->base,
+			  0,
+			  par->gmr_bo->base.num_pages,
+			  &par->gmr_map);
+	if (unlikely(ret != 0))
+		goto err_unref;
+
+	ptr = ttm_kmap_obj_virtual(&par->gmr_map, &is_iomem);
+
+	/* Deferred io needs vmalloc'ed system memory */
+	if (is_iomem || !is_vmalloc_addr(ptr))
+		goto err_unmap;
+
+	return ptr;
+
+err_unmap:
+	ttm_bo_kunmap(&par->gmr_map);
+err_unref:
+	ttm_bo_unref((struct ttm_buffer_object **)&par->gmr_bo);
+	return NULL;
+}
+
+static void vmw_fb_zero_copy_takedown(struct vmw_fb_par *par)
+{
+	if (!par->zero_copy)
+		return;
+
+	ttm_bo_kunmap(&par->gmr_map);
+	ttm_bo_unref((struct ttm_buffer_object **)&par->gmr_bo);
+	par->zero_copy = false;
+}
+
 int vmw_fb_init(struct vmw_private *vmw_priv)
 {
 	struct device *device = &vmw_priv->dev->pdev->dev;
 	struct vmw_fb_par *par;
 	struct fb_info *info;
+	struct ttm_placement ne_placement = vmw_vram_ne_placement;
 	unsigned initial_width, initial_height;
 	unsigned fb_width, fb_height;
 	unsigned fb_bpp, fb_depth, fb_offset, fb_pitch, fb_size;
+	void *gmr_ptr = NULL;
 	int ret;
 
 	fb_bpp = 32;
@@ -472,26 +621,45 @@ int vmw_fb_init(struct vmw_private *vmw_priv)
 	par->max_height = fb_height;
 
 	/*
-	 * Create buffers and alloc memory
+	 * Create buffers and alloc memory. The VRAM buffer is pinned at the
+	 * start of VRAM, which backs the legacy framebuffer. In zero-copy
+	 * mode fbdev renders directly into a GMR buffer that is blitted to
+	 * the screen, and the VRAM buffer only keeps other buffers out of
+	 * that range. Otherwise, or if setting that up fails, fbdev renders
+	 * into a shadow that is copied to the VRAM buffer.
 	 */
-	par->vmalloc = vmalloc(fb_size);
-	if (unlikely(par->vmalloc == NULL)) {
-		ret = -ENOMEM;
-		goto err_free;
-	}
-
-	ret = vmw_fb_create_bo(vmw_priv, fb_size, &par->vmw_bo);
+	ne_placement.lpfn = (fb_size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	ret = vmw_fb_create_bo(vmw_priv, fb_size, &ne_placement,
+			       &par->vmw_bo);
 	if (unlikely(ret != 0))
 		goto err_free;
 
-	ret = ttm_bo_kmap(&par->vmw_bo->base,
-			  0,
-			  par->vmw_bo->base.num_pages,
-			  &par->map);
-	if (unlikely(ret != 0))
-		goto err_unref;
-	par->bo_ptr = ttm_kmap_obj_virtual(&par->map, &par->bo_iowrite);
+	par->zero_copy = false;
+	if (vmw_priv->fb_zero_copy && vmw_priv->sou_priv &&
+	    vmw_priv->has_gmr) {
+		gmr_ptr = vmw_fb_zero_copy_init(vmw_priv, par, fb_size);
+		par->zero_copy = (gmr_ptr != NULL);
+	}
+
+	if (!par->zero_copy) {
+		par->vmalloc = vmalloc(fb_size);
+		if (unlikely(par->vmalloc == NULL)) {
+			ret = -ENOMEM;
+			goto err_unref;
+		}
+
+		ret = ttm_bo_kmap(&par->vmw_bo->base,
+				  0,
+				  par->vmw_bo->base.num_pages,
+				  &par->map);
+		if (unlikely(ret != 0))
+			goto err_unref;
+		par->bo_ptr = ttm_kmap_obj_virtual(&par->map,
+						   &par->bo_iowrite);
+	}
 	par->bo_size = fb_size;
+	DRM_INFO("Using %s fbdev.\n",
+		 par->zero_copy ? "zero-copy" : "shadow");
 
 	/*
 	 * Fixed and var
@@ -513,7 +681,7 @@ int vmw_fb_init(struct vmw_private *vmw_priv)
 	info->fix.mmio_len = 0;
 
 	info->pseudo_palette = par->pseudo_palette;
-	info->screen_base = par->vmalloc;
+	info->screen_base = par->zero_copy ? gmr_ptr : par->vmalloc;
 	info->screen_size = fb_size;
 
 	info->flags = FBINFO_DEFAULT;
@@ -573,8 +741,7 @@ int vmw_fb_init(struct vmw_private *vmw_priv)
 	/*
 	 * Dirty & Deferred IO
 	 */
-	par->dirty.x1 = par->dirty.x2 = 0;
-	par->dirty.y1 = par->dirty.y2 = 0;
+	par->dirty.set.num_rects = 0;
 	par->dirty.active = true;
 	spin_lock_init(&par->dirty.lock);
 #if (defined(VMWGFX_STANDALONE) && defined(VMWGFX_FB_DEFERRED))
@@ -599,6 +766,7 @@ err_aper:
 #endif
 	ttm_bo_kunmap(&par->map);
 err_unref:
+	vmw_fb_zero_copy_takedown(par);
 	ttm_bo_unref((struct ttm_buffer_object **)&par->vmw_bo);
 err_free:
 	vfree(par->vmalloc);
@@ -628,6 +796,7 @@ int vmw_fb_close(struct vmw_private *vmw_priv)
 
 	ttm_bo_kunmap(&par->map);
 	ttm_bo_unref(&bo);
+	vmw_fb_zero_copy_takedown(par);
 
 	vfree(par->vmalloc);
 	framebuffer_release(info);
@@ -653,8 +822,14 @@ int vmw_fb_off(struct vmw_private *vmw_priv)
 
 	flush_scheduled_work();
 
-	par->bo_ptr = NULL;
-	ttm_bo_kunmap(&par->map);
+	/*
+	 * In zero-copy mode the GMR buffer is what fbdev renders into, so it
+	 * stays pinned and mapped. Only the VRAM range is given back.
+	 */
+	if (!par->zero_copy) {
+		par->bo_ptr = NULL;
+		ttm_bo_kunmap(&par->map);
+	}
 
 	vmw_dmabuf_unpin(vmw_priv, par->vmw_bo, false);
 
@@ -676,7 +851,7 @@ int vmw_fb_on(struct vmw_private *vmw_priv)
 	par = info->par;
 
 	/* we are already active */
-	if (par->bo_ptr != NULL)
+	if (par->zero_copy ? par->dirty.active : par->bo_ptr != NULL)
 		return 0;
 
 	/* Make sure that all overlays are stoped when we take over */
@@ -688,6 +863,10 @@ int vmw_fb_on(struct vmw_private *vmw_priv)
 		goto err_no_buffer;
 	}
 
+	/* the zero-copy buffer stays pinned and mapped while we are off */
+	if (par->zero_copy)
+		goto out_activate;
+
 	ret = ttm_bo_kmap(&par->vmw_bo->base,
 			  0,
 			  par->vmw_bo->base.num_pages,
@@ -695,6 +874,7 @@ int vmw_fb_on(struct vmw_private *vmw_priv)
 	BUG_ON(ret != 0);
 	par->bo_ptr = ttm_kmap_obj_virtual(&par->map, &dummy);
 
+out_activate:
 	spin_lock_irqsave(&par->dirty.lock, flags);
 	par->dirty.active = true;
 	spin_unlock_irqrestore(&par->dirty.lock, flags);
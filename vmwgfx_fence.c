@@ -35,6 +35,7 @@ struct vmw_fence_manager {
 	struct vmw_private *dev_priv;
 	spinlock_t lock;
 	struct list_head fence_list;
+	struct list_head action_fence_list;
 	struct work_struct work;
 	u32 user_fence_size;
 	u32 fence_size;
@@ -111,6 +112,7 @@ static void vmw_fence_obj_destroy_locked(struct kref *kref)
 	unsigned int num_fences;
 
 	list_del_init(&fence->head);
+	list_del_init(&fence->action_head);
 	num_fences = --fman->num_fence_objects;
 	spin_unlock_irq(&fman->lock);
 	if (fence->destroy)
@@ -178,6 +180,7 @@ struct vmw_fence_manager *vmw_fence_manager_init(struct vmw_private *dev_priv)
 	fman->dev_priv = dev_priv;
 	spin_lock_init(&fman->lock);
 	INIT_LIST_HEAD(&fman->fence_list);
+	INIT_LIST_HEAD(&fman->action_fence_list);
 	INIT_LIST_HEAD(&fman->cleanup_list);
 	INIT_WORK(&fman->work, &vmw_fence_work_func);
 	fman->fifo_down = true;
@@ -218,6 +221,7 @@ static int vmw_fence_obj_init(struct vmw_fence_manager *fman,
 
 	fence->seqno = seqno;
 	INIT_LIST_HEAD(&fence->seq_passed_actions);
+	INIT_LIST_HEAD(&fence->action_head);
 	fence->fman = fman;
 	fence->signaled = 0;
 	fence->signal_mask = mask;
@@ -291,6 +295,38 @@ void vmw_fences_perform_actions(struct vmw_fence_manager *fman,
 	}
 }
 
+/**
+ * vmw_fence_action_fence_add_locked - Put a fence on the seqno-ordered
+ * list of fences with actions attached.
+ *
+ * @fman: Pointer to a fence manager.
+ * @fence: Pointer to an unsignaled fence object that just got its first
+ * action attached.
+ *
+ * This function should be called with the fence manager lock held.
+ * Actions are typically attached to recently submitted fences, so the
+ * list is searched backwards from the highest seqno and the insertion is
+ * normally O(1).
+ */
+static void vmw_fence_action_fence_add_locked(struct vmw_fence_manager *fman,
+					      struct vmw_fence_obj *fence)
+{
+	struct vmw_fence_obj *pos;
+
+	if (!list_empty(&fence->action_head))
+		return;
+
+	list_for_each_entry_reverse(pos, &fman->action_fence_list,
+				    action_head) {
+		if (fence->seqno - pos->seqno < VMW_FENCE_WRAP) {
+			list_add(&fence->action_head, &pos->action_head);
+			return;
+		}
+	}
+
+	list_add(&fence->action_head, &fman->action_fence_list);
+}
+
 /**
  * vmw_fence_goal_new_locked - Figure out a new device fence goal
  * seqno if needed.
@@ -302,8 +338,9 @@ void vmw_fences_perform_actions(struct vmw_fence_manager *fman,
  * It is typically called when we have a new passed_seqno, and
  * we might need to update the fence goal. It checks to see whether
  * the current fence goal has already passed, and, in that case,
- * scans through all unsignaled fences to get the next fence object with an
- * action attached, and sets the seqno of that fence as a new fence goal.
+ * picks the first fence object on the seqno-ordered list of unsignaled
+ * fences with actions attached, and sets the seqno of that fence as a new
+ * fence goal.
  *
  * returns true if the device goal seqno was updated. False otherwise.
  */
@@ -323,13 +360,11 @@ static bool vmw_fence_goal_new_locked(struct vmw_fence_manager *fman,
 		return false;
 
 	fman->seqno_valid = false;
-	list_for_each_entry(fence, &fman->fence_list, head) {
-		if (!list_empty(&fence->seq_passed_actions)) {
-			fman->seqno_valid = true;
-			iowrite32(fence->seqno,
-				  fifo_mem + SVGA_FIFO_FENCE_GOAL);
-			break;
-		}
+	if (!list_empty(&fman->action_fence_list)) {
+		fence = list_first_entry(&fman->action_fence_list,
+					 struct vmw_fence_obj, action_head);
+		fman->seqno_valid = true;
+		iowrite32(fence->seqno, fifo_mem + SVGA_FIFO_FENCE_GOAL);
 	}
 
 	return true;
@@ -386,6 +421,7 @@ rerun:
 	list_for_each_entry_safe(fence, next_fence, &fman->fence_list, head) {
 		if (seqno - fence->seqno < VMW_FENCE_WRAP) {
 			list_del_init(&fence->head);
+			list_del_init(&fence->action_head);
 			fence->signaled |= DRM_VMW_FENCE_FLAG_EXEC;
 			INIT_LIST_HEAD(&action_list);
 			list_splice_init(&fence->seq_passed_actions,
@@ -452,7 +488,10 @@ int vmw_fence_obj_wait(struct vmw_fence_obj *fence,
 	if (likely(vmw_fence_obj_signaled(fence, flags)))
 		return 0;
 
+	(void) vmw_fifo_fence_flush(dev_priv);
 	vmw_fifo_ping_host(dev_priv, SVGA_SYNC_GENERIC);
+	if (dev_priv->cman)
+		vmw_cmdbuf_kick(dev_priv->cman);
 	vmw_seqno_waiter_add(dev_priv);
 
 	if (interruptible)
@@ -480,6 +519,7 @@ void vmw_fence_obj_flush(struct vmw_fence_obj *fence)
 {
 	struct vmw_private *dev_priv = fence->fman->dev_priv;
 
+	(void) vmw_fifo_fence_flush(dev_priv);
 	vmw_fifo_ping_host(dev_priv, SVGA_SYNC_GENERIC);
 }
 
@@ -636,6 +676,7 @@ void vmw_fence_fifo_down(struct vmw_fence_manager *fman)
 
 		if (unlikely(ret != 0)) {
 			list_del_init(&fence->head);
+			list_del_init(&fence->action_head);
 			fence->signaled |= DRM_VMW_FENCE_FLAG_EXEC;
 			INIT_LIST_HEAD(&action_list);
 			list_splice_init(&fence->seq_passed_actions,
@@ -887,6 +928,9 @@ void vmw_fence_obj_add_action(struct vmw_fence_obj *fence,
 	unsigned long irq_flags;
 	bool run_update = false;
 
+	/* Actions should run without the coalescing delay. */
+	(void) vmw_fifo_fence_flush(fman->dev_priv);
+
 	mutex_lock(&fman->goal_irq_mutex);
 	spin_lock_irqsave(&fman->lock, irq_flags);
 
@@ -899,6 +943,7 @@ void vmw_fence_obj_add_action(struct vmw_fence_obj *fence,
 		vmw_fences_perform_actions(fman, &action_list);
 	} else {
 		list_add_tail(&action->head, &fence->seq_passed_actions);
+		vmw_fence_action_fence_add_locked(fman, fence);
 
 		/*
 		 * This function may set fman::seqno_valid, so it must
@@ -58,6 +58,7 @@ struct vmw_fence_obj {
 	uint32_t signaled;
 	uint32_t signal_mask;
 	struct list_head seq_passed_actions;
+	struct list_head action_head;
 	void (*destroy)(struct vmw_fence_obj *fence);
 	wait_queue_head_t queue;
 };
@@ -29,6 +29,45 @@
 #include "drmP.h"
 #include "ttm/ttm_placement.h"
 
+/*
+ * Upper limit of command bytes queued for asynchronous submission.
+ * Beyond this, submitters block for fifo space as before.
+ */
+#define VMW_FIFO_SUBMIT_MAX_BYTES (4 * 1024 * 1024)
+
+/*
+ * Number of consecutive failures to drain the submit queue, each after
+ * waiting for fifo progress, before the device is considered hung and
+ * the queued batches are dropped. The worker backs off between tries.
+ */
+#define VMW_FIFO_SUBMIT_MAX_FAILURES 4
+
+/*
+ * Maximum time a coalesced fence is held back before it is emitted,
+ * unless somebody waits for it earlier.
+ */
+#define VMW_FENCE_COALESCE_DELAY 1
+
+/**
+ * struct vmw_fifo_batch - A command batch queued for submission.
+ *
+ * @head: List head for the fifo submit queue.
+ * @size: Size of the batch in bytes.
+ * @cmd: The commands.
+ */
+struct vmw_fifo_batch {
+	struct list_head head;
+	uint32_t size;
+	uint32_t cmd[0];
+};
+
+static int vmw_fifo_submit_drain(struct vmw_private *dev_priv);
+static void vmw_fifo_submit_drop(struct vmw_private *dev_priv);
+static void vmw_fifo_submit_work(struct work_struct *work);
+static void vmw_fifo_fence_work(struct work_struct *work);
+static void vmw_fifo_doorbell_work(struct work_struct *work);
+static enum hrtimer_restart vmw_fifo_doorbell_timer(struct hrtimer *timer);
+
 bool vmw_fifo_have_3d(struct vmw_private *dev_priv)
 {
 	__le32 __iomem *fifo_mem = dev_priv->mmio_virt;
@@ -112,11 +151,28 @@ int vmw_fifo_init(struct vmw_private *dev_priv, struct vmw_fifo_state *fifo)
 		return -ENOMEM;
 
 	fifo->dynamic_buffer = NULL;
+	fifo->src_buffer = NULL;
 	fifo->reserved_size = 0;
 	fifo->using_bounce_buffer = false;
 
 	mutex_init(&fifo->fifo_mutex);
 	init_rwsem(&fifo->rwsem);
+	INIT_LIST_HEAD(&fifo->submit_queue);
+	fifo->submit_bytes = 0;
+	spin_lock_init(&fifo->submit_lock);
+	mutex_init(&fifo->submit_mutex);
+	INIT_DELAYED_WORK(&fifo->submit_work, vmw_fifo_submit_work);
+	fifo->submit_failures = 0;
+	fifo->staged = NULL;
+	fifo->fence_pending = false;
+	mutex_init(&fifo->fence_mutex);
+	INIT_DELAYED_WORK(&fifo->fence_work, vmw_fifo_fence_work);
+	INIT_WORK(&fifo->doorbell_work, vmw_fifo_doorbell_work);
+	hrtimer_init(&fifo->doorbell_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	fifo->doorbell_timer.function = vmw_fifo_doorbell_timer;
+	fifo->last_doorbell = ktime_get();
+	atomic_set(&fifo->doorbells_sent, 0);
+	atomic_set(&fifo->doorbells_saved, 0);
 
 	/*
 	 * Allow mapping the first page read-only to user-space.
@@ -168,22 +224,113 @@ int vmw_fifo_init(struct vmw_private *dev_priv, struct vmw_fifo_state *fifo)
 
 void vmw_fifo_ping_host(struct vmw_private *dev_priv, uint32_t reason)
 {
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
 	__le32 __iomem *fifo_mem = dev_priv->mmio_virt;
 
+	/*
+	 * The host looks for new commands before clearing
+	 * SVGA_FIFO_BUSY, so there's no need for a doorbell, or for
+	 * the hw_mutex, while it's set.
+	 */
+	if (ioread32(fifo_mem + SVGA_FIFO_BUSY) != 0) {
+		atomic_inc(&fifo_state->doorbells_saved);
+		return;
+	}
+
 	mutex_lock(&dev_priv->hw_mutex);
 
-	if (unlikely(ioread32(fifo_mem + SVGA_FIFO_BUSY) == 0)) {
+	if (likely(ioread32(fifo_mem + SVGA_FIFO_BUSY) == 0)) {
 		iowrite32(1, fifo_mem + SVGA_FIFO_BUSY);
 		vmw_write(dev_priv, SVGA_REG_SYNC, reason);
-	}
+		fifo_state->last_doorbell = ktime_get();
+		atomic_inc(&fifo_state->doorbells_sent);
+	} else
+		atomic_inc(&fifo_state->doorbells_saved);
 
 	mutex_unlock(&dev_priv->hw_mutex);
 }
 
+/**
+ * vmw_fifo_doorbell_work - Worker sending a deferred doorbell.
+ *
+ * @work: The doorbell_work member of a struct vmw_fifo_state.
+ */
+static void vmw_fifo_doorbell_work(struct work_struct *work)
+{
+	struct vmw_fifo_state *fifo_state =
+		container_of(work, struct vmw_fifo_state, doorbell_work);
+	struct vmw_private *dev_priv =
+		container_of(fifo_state, struct vmw_private, fifo);
+
+	vmw_fifo_ping_host(dev_priv, SVGA_SYNC_GENERIC);
+}
+
+/**
+ * vmw_fifo_doorbell_timer - Timer callback for a deferred doorbell.
+ *
+ * @timer: The doorbell_timer member of a struct vmw_fifo_state.
+ *
+ * Runs in interrupt context, so the doorbell itself is rung by a worker.
+ */
+static enum hrtimer_restart vmw_fifo_doorbell_timer(struct hrtimer *timer)
+{
+	struct vmw_fifo_state *fifo_state =
+		container_of(timer, struct vmw_fifo_state, doorbell_timer);
+
+	schedule_work(&fifo_state->doorbell_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * vmw_fifo_doorbell - Notify the host about committed commands.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ *
+ * If the host went idle less than dev_priv::doorbell_delay_us after the
+ * previous doorbell, commands are arriving faster than the host consumes
+ * them, and the doorbell is deferred by a high resolution timer so that
+ * it covers the following commits as well, without holding back an idle
+ * host for more than the configured delay. Waiters always ping the host
+ * directly. The unlocked read of the last doorbell time is only a
+ * heuristic.
+ */
+static void vmw_fifo_doorbell(struct vmw_private *dev_priv)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	__le32 __iomem *fifo_mem = dev_priv->mmio_virt;
+	unsigned int delay_us = dev_priv->doorbell_delay_us;
+
+	if (delay_us != 0 &&
+	    ioread32(fifo_mem + SVGA_FIFO_BUSY) == 0 &&
+	    ktime_us_delta(ktime_get(), fifo_state->last_doorbell) <
+	    (s64) delay_us) {
+		if (!hrtimer_active(&fifo_state->doorbell_timer))
+			hrtimer_start(&fifo_state->doorbell_timer,
+				      ns_to_ktime((u64) delay_us *
+						  NSEC_PER_USEC),
+				      HRTIMER_MODE_REL);
+		atomic_inc(&fifo_state->doorbells_saved);
+		return;
+	}
+
+	vmw_fifo_ping_host(dev_priv, SVGA_SYNC_GENERIC);
+}
+
 void vmw_fifo_release(struct vmw_private *dev_priv, struct vmw_fifo_state *fifo)
 {
 	__le32 __iomem *fifo_mem = dev_priv->mmio_virt;
 
+	cancel_delayed_work_sync(&fifo->fence_work);
+	(void) vmw_fifo_fence_flush(dev_priv);
+	cancel_delayed_work_sync(&fifo->submit_work);
+	if (vmw_fifo_submit_drain(dev_priv) != 0) {
+		DRM_ERROR("Dropping queued command batches.\n");
+		vmw_fifo_submit_drop(dev_priv);
+	}
+	hrtimer_cancel(&fifo->doorbell_timer);
+	cancel_work_sync(&fifo->doorbell_work);
+
 	mutex_lock(&dev_priv->hw_mutex);
 
 	vmw_write(dev_priv, SVGA_REG_SYNC, SVGA_SYNC_GENERIC);
@@ -312,6 +459,9 @@ static int vmw_fifo_wait(struct vmw_private *dev_priv,
 /**
  * Reserve @bytes number of bytes in the fifo.
  *
+ * If @src is non-NULL and the reservation can't be done in place, @src
+ * is returned and used as the bounce buffer by vmw_local_fifo_commit().
+ *
  * This function will return NULL (error) on two conditions:
  *  If it timeouts waiting for fifo space, or if @bytes is larger than the
  *   available fifo space.
@@ -319,7 +469,9 @@ static int vmw_fifo_wait(struct vmw_private *dev_priv,
  * Returns:
  *   Pointer to the fifo, or null on error (possible hardware hang).
  */
-void *vmw_fifo_reserve(struct vmw_private *dev_priv, uint32_t bytes)
+static void *vmw_local_fifo_reserve(struct vmw_private *dev_priv,
+				    uint32_t bytes,
+				    const void *src)
 {
 	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
 	__le32 __iomem *fifo_mem = dev_priv->mmio_virt;
@@ -387,7 +539,10 @@ void *vmw_fifo_reserve(struct vmw_private *dev_priv, uint32_t bytes)
 
 		if (need_bounce) {
 			fifo_state->using_bounce_buffer = true;
-			if (bytes < fifo_state->static_buffer_size)
+			if (src != NULL) {
+				fifo_state->src_buffer = src;
+				return (void *) src;
+			} else if (bytes < fifo_state->static_buffer_size)
 				return fifo_state->static_buffer;
 			else {
 				fifo_state->dynamic_buffer = vmalloc(bytes);
@@ -401,6 +556,110 @@ out_err:
 	return NULL;
 }
 
+/**
+ * vmw_fifo_reserve_queued - Reserve space for commands in a batch that is
+ * queued behind the fifo submit queue on commit.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @bytes: Number of bytes to reserve.
+ *
+ * Returns NULL if no batches are queued, or if the batch can't be queued,
+ * in which case the caller reserves fifo space directly.
+ */
+static void *vmw_fifo_reserve_queued(struct vmw_private *dev_priv,
+				     uint32_t bytes)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	struct vmw_fifo_batch *batch;
+	bool queue;
+
+	spin_lock(&fifo_state->submit_lock);
+	queue = !list_empty(&fifo_state->submit_queue) &&
+		fifo_state->submit_bytes + bytes <= VMW_FIFO_SUBMIT_MAX_BYTES;
+	spin_unlock(&fifo_state->submit_lock);
+
+	if (likely(!queue))
+		return NULL;
+
+	batch = vmalloc(sizeof(*batch) + bytes);
+	if (unlikely(batch == NULL))
+		return NULL;
+
+	mutex_lock(&fifo_state->fifo_mutex);
+	BUG_ON(fifo_state->reserved_size != 0);
+	fifo_state->reserved_size = bytes;
+	fifo_state->staged = batch;
+
+	return batch->cmd;
+}
+
+/**
+ * vmw_fifo_reserve_sync - Reserve @bytes number of bytes for commands
+ * ahead of any later submission.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @bytes: Number of bytes to reserve.
+ *
+ * For commands that must reach the fifo in order with commands written
+ * outside of the submit queue. Queued batches are written to the fifo
+ * first, blocking for fifo space as needed.
+ *
+ * Returns NULL on failure.
+ */
+static void *vmw_fifo_reserve_sync(struct vmw_private *dev_priv,
+				   uint32_t bytes)
+{
+	if (dev_priv->cman)
+		return vmw_cmdbuf_reserve(dev_priv->cman, bytes);
+
+	if (unlikely(vmw_fifo_submit_drain(dev_priv) != 0))
+		return NULL;
+
+	return vmw_local_fifo_reserve(dev_priv, bytes, NULL);
+}
+
+/**
+ * vmw_fifo_reserve - Reserve @bytes number of bytes for commands.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @bytes: Number of bytes to reserve.
+ *
+ * The reservation is made in a command buffer if the device supports
+ * them, and in the fifo otherwise. If command batches are queued for
+ * the fifo, the commands are instead queued behind them on commit, so
+ * the caller doesn't block on the queue. It must be closed with
+ * vmw_fifo_commit() or vmw_fifo_commit_noflush().
+ *
+ * Returns NULL on failure.
+ */
+void *vmw_fifo_reserve(struct vmw_private *dev_priv, uint32_t bytes)
+{
+	void *cmd;
+
+	if (!dev_priv->cman) {
+		cmd = vmw_fifo_reserve_queued(dev_priv, bytes);
+		if (cmd != NULL)
+			return cmd;
+	}
+
+	return vmw_fifo_reserve_sync(dev_priv, bytes);
+}
+
+/**
+ * vmw_fifo_bounce_buffer - Return the buffer holding the commands of a
+ * bounced reservation.
+ *
+ * @fifo_state: Pointer to the fifo state.
+ */
+static const uint32_t *vmw_fifo_bounce_buffer(struct vmw_fifo_state *fifo_state)
+{
+	if (fifo_state->src_buffer != NULL)
+		return fifo_state->src_buffer;
+
+	return (fifo_state->dynamic_buffer != NULL) ?
+		fifo_state->dynamic_buffer : fifo_state->static_buffer;
+}
+
 static void vmw_fifo_res_copy(struct vmw_fifo_state *fifo_state,
 			      __le32 __iomem *fifo_mem,
 			      uint32_t next_cmd,
@@ -408,8 +667,7 @@ static void vmw_fifo_res_copy(struct vmw_fifo_state *fifo_state,
 {
 	uint32_t chunk_size = max - next_cmd;
 	uint32_t rest;
-	uint32_t *buffer = (fifo_state->dynamic_buffer != NULL) ?
-	    fifo_state->dynamic_buffer : fifo_state->static_buffer;
+	const uint32_t *buffer = vmw_fifo_bounce_buffer(fifo_state);
 
 	if (bytes < chunk_size)
 		chunk_size = bytes;
@@ -428,8 +686,7 @@ static void vmw_fifo_slow_copy(struct vmw_fifo_state *fifo_state,
 			       uint32_t next_cmd,
 			       uint32_t max, uint32_t min, uint32_t bytes)
 {
-	uint32_t *buffer = (fifo_state->dynamic_buffer != NULL) ?
-	    fifo_state->dynamic_buffer : fifo_state->static_buffer;
+	const uint32_t *buffer = vmw_fifo_bounce_buffer(fifo_state);
 
 	while (bytes > 0) {
 		iowrite32(*buffer++, fifo_mem + (next_cmd >> 2));
@@ -443,13 +700,42 @@ static void vmw_fifo_slow_copy(struct vmw_fifo_state *fifo_state,
 	}
 }
 
-void vmw_fifo_commit(struct vmw_private *dev_priv, uint32_t bytes)
+/**
+ * vmw_fifo_commit_staged - Queue a reservation staged by
+ * vmw_fifo_reserve_queued().
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @bytes: Number of bytes to commit.
+ *
+ * Must be called with the fifo mutex held.
+ */
+static void vmw_fifo_commit_staged(struct vmw_private *dev_priv,
+				   uint32_t bytes)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	struct vmw_fifo_batch *batch = fifo_state->staged;
+
+	fifo_state->staged = NULL;
+	if (bytes == 0) {
+		vfree(batch);
+		return;
+	}
+
+	batch->size = bytes;
+	spin_lock(&fifo_state->submit_lock);
+	list_add_tail(&batch->head, &fifo_state->submit_queue);
+	fifo_state->submit_bytes += bytes;
+	spin_unlock(&fifo_state->submit_lock);
+
+	schedule_delayed_work(&fifo_state->submit_work, 0);
+}
+
+static void vmw_local_fifo_commit(struct vmw_private *dev_priv,
+				  uint32_t bytes, bool ping)
 {
 	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
 	__le32 __iomem *fifo_mem = dev_priv->mmio_virt;
-	uint32_t next_cmd = ioread32(fifo_mem + SVGA_FIFO_NEXT_CMD);
-	uint32_t max = ioread32(fifo_mem + SVGA_FIFO_MAX);
-	uint32_t min = ioread32(fifo_mem + SVGA_FIFO_MIN);
+	uint32_t next_cmd, max, min;
 	bool reserveable = fifo_state->capabilities & SVGA_FIFO_CAP_RESERVE;
 
 	BUG_ON((bytes & 3) != 0);
@@ -457,6 +743,16 @@ void vmw_fifo_commit(struct vmw_private *dev_priv, uint32_t bytes)
 
 	fifo_state->reserved_size = 0;
 
+	if (fifo_state->staged != NULL) {
+		vmw_fifo_commit_staged(dev_priv, bytes);
+		mutex_unlock(&fifo_state->fifo_mutex);
+		return;
+	}
+
+	next_cmd = ioread32(fifo_mem + SVGA_FIFO_NEXT_CMD);
+	max = ioread32(fifo_mem + SVGA_FIFO_MAX);
+	min = ioread32(fifo_mem + SVGA_FIFO_MIN);
+
 	if (fifo_state->using_bounce_buffer) {
 		if (reserveable)
 			vmw_fifo_res_copy(fifo_state, fifo_mem,
@@ -470,6 +766,7 @@ void vmw_fifo_commit(struct vmw_private *dev_priv, uint32_t bytes)
 			fifo_state->dynamic_buffer = NULL;
 		}
 
+		fifo_state->src_buffer = NULL;
 	}
 
 	down_write(&fifo_state->rwsem);
@@ -485,32 +782,446 @@ void vmw_fifo_commit(struct vmw_private *dev_priv, uint32_t bytes)
 		iowrite32(0, fifo_mem + SVGA_FIFO_RESERVED);
 	mb();
 	up_write(&fifo_state->rwsem);
-	vmw_fifo_ping_host(dev_priv, SVGA_SYNC_GENERIC);
+	if (ping)
+		vmw_fifo_doorbell(dev_priv);
 	mutex_unlock(&fifo_state->fifo_mutex);
 }
 
-int vmw_fifo_send_fence(struct vmw_private *dev_priv, uint32_t *seqno)
+/**
+ * vmw_fifo_submit_busy - Whether a batch can't be written to the fifo
+ * right away.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @bytes: Size of the batch.
+ *
+ * That is the case if batches are already queued, which must be
+ * submitted first, or if the fifo lacks space for @bytes.
+ */
+static bool vmw_fifo_submit_busy(struct vmw_private *dev_priv,
+				 uint32_t bytes)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	bool busy;
+
+	spin_lock(&fifo_state->submit_lock);
+	busy = !list_empty(&fifo_state->submit_queue);
+	spin_unlock(&fifo_state->submit_lock);
+
+	return busy || vmw_fifo_is_full(dev_priv, bytes);
+}
+
+/**
+ * vmw_fifo_submit_queue - Queue a copy of a command batch for
+ * asynchronous submission.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @buf: The commands.
+ * @bytes: Size of the batch in bytes.
+ *
+ * Returns -EBUSY if the queue is full and -ENOMEM on allocation failure.
+ * In both cases the caller should submit synchronously instead.
+ */
+static int vmw_fifo_submit_queue(struct vmw_private *dev_priv,
+				 const void *buf, uint32_t bytes)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	struct vmw_fifo_batch *batch;
+
+	batch = vmalloc(sizeof(*batch) + bytes);
+	if (unlikely(batch == NULL))
+		return -ENOMEM;
+
+	batch->size = bytes;
+	memcpy(batch->cmd, buf, bytes);
+
+	spin_lock(&fifo_state->submit_lock);
+	if (unlikely(fifo_state->submit_bytes + bytes >
+		     VMW_FIFO_SUBMIT_MAX_BYTES)) {
+		spin_unlock(&fifo_state->submit_lock);
+		vfree(batch);
+		return -EBUSY;
+	}
+	list_add_tail(&batch->head, &fifo_state->submit_queue);
+	fifo_state->submit_bytes += bytes;
+	spin_unlock(&fifo_state->submit_lock);
+
+	schedule_delayed_work(&fifo_state->submit_work, 0);
+
+	return 0;
+}
+
+/**
+ * vmw_fifo_submit_pending - Whether command batches are queued for the
+ * fifo.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ *
+ * The device can't be idle while batches are queued, even if the fifo
+ * is empty.
+ */
+bool vmw_fifo_submit_pending(struct vmw_private *dev_priv)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	bool pending;
+
+	spin_lock(&fifo_state->submit_lock);
+	pending = !list_empty(&fifo_state->submit_queue);
+	spin_unlock(&fifo_state->submit_lock);
+
+	return pending;
+}
+
+/**
+ * vmw_fifo_submit_drain - Write all queued command batches to the fifo.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ *
+ * Blocks for fifo space as needed. A batch stays on the queue until it
+ * has been written, so an empty queue means all batches are in the fifo.
+ *
+ * Returns -ENOMEM if fifo space couldn't be reserved (possible hardware
+ * hang), leaving the remaining batches queued.
+ */
+static int vmw_fifo_submit_drain(struct vmw_private *dev_priv)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	struct vmw_fifo_batch *batch;
+	void *cmd;
+	int ret = 0;
+
+	spin_lock(&fifo_state->submit_lock);
+	if (likely(list_empty(&fifo_state->submit_queue))) {
+		spin_unlock(&fifo_state->submit_lock);
+		return 0;
+	}
+	spin_unlock(&fifo_state->submit_lock);
+
+	mutex_lock(&fifo_state->submit_mutex);
+	for (;;) {
+		spin_lock(&fifo_state->submit_lock);
+		if (list_empty(&fifo_state->submit_queue)) {
+			spin_unlock(&fifo_state->submit_lock);
+			break;
+		}
+		batch = list_first_entry(&fifo_state->submit_queue,
+					 struct vmw_fifo_batch, head);
+		spin_unlock(&fifo_state->submit_lock);
+
+		cmd = vmw_local_fifo_reserve(dev_priv, batch->size,
+					     batch->cmd);
+		if (unlikely(cmd == NULL)) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (cmd != batch->cmd)
+			memcpy(cmd, batch->cmd, batch->size);
+		vmw_local_fifo_commit(dev_priv, batch->size, true);
+
+		spin_lock(&fifo_state->submit_lock);
+		list_del(&batch->head);
+		fifo_state->submit_bytes -= batch->size;
+		spin_unlock(&fifo_state->submit_lock);
+		vfree(batch);
+	}
+	mutex_unlock(&fifo_state->submit_mutex);
+
+	return ret;
+}
+
+/**
+ * vmw_fifo_submit_drop - Drop all queued command batches.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ */
+static void vmw_fifo_submit_drop(struct vmw_private *dev_priv)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	struct vmw_fifo_batch *batch, *next;
+	LIST_HEAD(dropped);
+
+	mutex_lock(&fifo_state->submit_mutex);
+	spin_lock(&fifo_state->submit_lock);
+	list_splice_init(&fifo_state->submit_queue, &dropped);
+	fifo_state->submit_bytes = 0;
+	spin_unlock(&fifo_state->submit_lock);
+	mutex_unlock(&fifo_state->submit_mutex);
+
+	list_for_each_entry_safe(batch, next, &dropped, head) {
+		list_del(&batch->head);
+		vfree(batch);
+	}
+}
+
+/**
+ * vmw_fifo_submit_work - Worker draining the fifo submit queue.
+ *
+ * @work: The submit_work member of a struct vmw_fifo_state.
+ *
+ * Fifo space waits are driven by SVGA_IRQFLAG_FIFO_PROGRESS interrupts
+ * in vmw_fifo_wait(). If that times out, the worker retries after an
+ * exponentially growing delay. After VMW_FIFO_SUBMIT_MAX_FAILURES
+ * consecutive failures the device is considered hung and the queued
+ * batches are dropped.
+ */
+static void vmw_fifo_submit_work(struct work_struct *work)
+{
+	struct vmw_fifo_state *fifo_state =
+		container_of(work, struct vmw_fifo_state, submit_work.work);
+	struct vmw_private *dev_priv =
+		container_of(fifo_state, struct vmw_private, fifo);
+
+	if (likely(vmw_fifo_submit_drain(dev_priv) == 0)) {
+		fifo_state->submit_failures = 0;
+		return;
+	}
+
+	if (++fifo_state->submit_failures >= VMW_FIFO_SUBMIT_MAX_FAILURES) {
+		DRM_ERROR("SVGA device lockup. "
+			  "Dropping queued command batches.\n");
+		fifo_state->submit_failures = 0;
+		vmw_fifo_submit_drop(dev_priv);
+		return;
+	}
+
+	if (fifo_state->submit_failures == 1)
+		DRM_ERROR("Failed submitting queued commands. Retrying.\n");
+
+	schedule_delayed_work(&fifo_state->submit_work,
+			      HZ << (fifo_state->submit_failures - 1));
+}
+
+/**
+ * vmw_fifo_commit - Commit commands and submit them to the device.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @bytes: Number of bytes to commit.
+ */
+void vmw_fifo_commit(struct vmw_private *dev_priv, uint32_t bytes)
+{
+	if (dev_priv->cman)
+		vmw_cmdbuf_commit(dev_priv->cman, bytes, true);
+	else
+		vmw_local_fifo_commit(dev_priv, bytes, true);
+}
+
+/**
+ * vmw_fifo_commit_noflush - Commit commands without submitting them.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @bytes: Number of bytes to commit.
+ *
+ * With command buffers, the commands are batched with subsequent ones
+ * until the next vmw_fifo_commit() or vmw_fifo_flush(). Callers must make
+ * sure one of those follows, typically the commit of a fence command.
+ * With the fifo, the commands are written but the host isn't notified
+ * until then.
+ */
+void vmw_fifo_commit_noflush(struct vmw_private *dev_priv, uint32_t bytes)
+{
+	if (dev_priv->cman)
+		vmw_cmdbuf_commit(dev_priv->cman, bytes, false);
+	else
+		vmw_local_fifo_commit(dev_priv, bytes, false);
+}
+
+/**
+ * vmw_fifo_flush - Submit batched commands to the device.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ */
+void vmw_fifo_flush(struct vmw_private *dev_priv)
+{
+	if (dev_priv->cman)
+		vmw_cmdbuf_flush(dev_priv->cman);
+	else {
+		(void) vmw_fifo_submit_drain(dev_priv);
+		vmw_fifo_ping_host(dev_priv, SVGA_SYNC_GENERIC);
+	}
+}
+
+/**
+ * vmw_fifo_emit - Copy a command batch to the fifo and commit it.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @buf: The commands to submit.
+ * @bytes: Size of the command batch in bytes.
+ *
+ * Equivalent to vmw_fifo_reserve(), a memcpy() and vmw_fifo_commit(),
+ * but copies @buf straight into the fifo also when the reservation
+ * can't be satisfied in place, instead of staging it in the fifo bounce
+ * buffer first. Thus the batch is copied exactly once.
+ * @buf must stay untouched until the function returns.
+ * With command buffers, the batch is copied into the current command
+ * buffer and not flushed, since it's always followed by a fence.
+ *
+ * If the fifo lacks space, or earlier batches are still queued, a copy
+ * of @buf is queued instead and written to the fifo by a worker, so the
+ * caller doesn't block on a full fifo. Ordering is kept, since other
+ * fifo reservations either drain the queue first or are queued behind
+ * it.
+ *
+ * Returns -ENOMEM on failure to reserve fifo space.
+ */
+int vmw_fifo_emit(struct vmw_private *dev_priv, const void *buf,
+		  uint32_t bytes)
+{
+	void *cmd;
+
+	if (dev_priv->cman) {
+		cmd = vmw_cmdbuf_reserve(dev_priv->cman, bytes);
+		if (unlikely(cmd == NULL))
+			return -ENOMEM;
+
+		memcpy(cmd, buf, bytes);
+		vmw_cmdbuf_commit(dev_priv->cman, bytes, false);
+		return 0;
+	}
+
+	if (vmw_fifo_submit_busy(dev_priv, bytes) &&
+	    vmw_fifo_submit_queue(dev_priv, buf, bytes) == 0)
+		return 0;
+
+	if (unlikely(vmw_fifo_submit_drain(dev_priv) != 0))
+		return -ENOMEM;
+
+	cmd = vmw_local_fifo_reserve(dev_priv, bytes, buf);
+	if (unlikely(cmd == NULL))
+		return -ENOMEM;
+
+	if (cmd != buf)
+		memcpy(cmd, buf, bytes);
+
+	vmw_local_fifo_commit(dev_priv, bytes, true);
+
+	return 0;
+}
+
+static uint32_t vmw_fifo_next_seqno(struct vmw_private *dev_priv)
+{
+	uint32_t seqno;
+
+	do {
+		seqno = atomic_add_return(1, &dev_priv->marker_seq);
+	} while (seqno == 0);
+
+	return seqno;
+}
+
+/**
+ * vmw_fifo_submit_queue_fence - Queue a fence command for asynchronous
+ * submission.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @seqno: Returns the fence seqno, or holds it if @have_seqno is set.
+ * @have_seqno: The seqno was allocated by the caller.
+ *
+ * The seqno is allocated under the submit lock, so fences leave the
+ * queue in seqno order.
+ */
+static int vmw_fifo_submit_queue_fence(struct vmw_private *dev_priv,
+				       uint32_t *seqno, bool have_seqno)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	struct svga_fifo_cmd_fence *cmd_fence;
+	struct vmw_fifo_batch *batch;
+	uint32_t bytes = sizeof(__le32) + sizeof(*cmd_fence);
+
+	batch = vmalloc(sizeof(*batch) + bytes);
+	if (unlikely(batch == NULL))
+		return -ENOMEM;
+
+	batch->size = bytes;
+	batch->cmd[0] = cpu_to_le32(SVGA_CMD_FENCE);
+	cmd_fence = (struct svga_fifo_cmd_fence *) &batch->cmd[1];
+
+	spin_lock(&fifo_state->submit_lock);
+	if (unlikely(fifo_state->submit_bytes + bytes >
+		     VMW_FIFO_SUBMIT_MAX_BYTES)) {
+		spin_unlock(&fifo_state->submit_lock);
+		vfree(batch);
+		return -EBUSY;
+	}
+	if (!have_seqno)
+		*seqno = vmw_fifo_next_seqno(dev_priv);
+	cmd_fence->fence = cpu_to_le32(*seqno);
+	list_add_tail(&batch->head, &fifo_state->submit_queue);
+	fifo_state->submit_bytes += bytes;
+	spin_unlock(&fifo_state->submit_lock);
+
+	schedule_delayed_work(&fifo_state->submit_work, 0);
+
+	return 0;
+}
+
+/**
+ * vmw_fifo_fence_emit - Emit a fence command.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @seqno: Returns the fence seqno, or holds it if @have_seqno is set.
+ * @have_seqno: The seqno was allocated by the caller. Such callers must
+ * hold the fifo fence_mutex, so that no other fence can be emitted ahead
+ * of this one.
+ */
+static int vmw_fifo_fence_emit(struct vmw_private *dev_priv, uint32_t *seqno,
+			       bool have_seqno)
 {
 	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
 	struct svga_fifo_cmd_fence *cmd_fence;
 	void *fm;
 	int ret = 0;
 	uint32_t bytes = sizeof(__le32) + sizeof(*cmd_fence);
+	bool has_fence = fifo_state->capabilities & SVGA_FIFO_CAP_FENCE;
 
-	fm = vmw_fifo_reserve(dev_priv, bytes);
-	if (unlikely(fm == NULL)) {
-		*seqno = atomic_read(&dev_priv->marker_seq);
-		ret = -ENOMEM;
-		(void)vmw_fallback_wait(dev_priv, false, true, *seqno,
-					false, 3*HZ);
-		goto out_err;
-	}
+	/*
+	 * Follow queued command batches onto the submit queue rather
+	 * than blocking for fifo space.
+	 */
+	if (!dev_priv->cman && has_fence &&
+	    vmw_fifo_submit_busy(dev_priv, bytes) &&
+	    vmw_fifo_submit_queue_fence(dev_priv, seqno, have_seqno) == 0)
+		goto out_fenced;
 
-	do {
-		*seqno = atomic_add_return(1, &dev_priv->marker_seq);
-	} while (*seqno == 0);
+	for (;;) {
+		fm = vmw_fifo_reserve_sync(dev_priv, bytes);
+		if (unlikely(fm == NULL)) {
+			if (!have_seqno)
+				*seqno = atomic_read(&dev_priv->marker_seq);
+			ret = -ENOMEM;
+			if (dev_priv->cman)
+				(void) vmw_cmdbuf_idle(dev_priv->cman, false,
+						       3*HZ);
+			else
+				(void)vmw_fallback_wait(dev_priv, false, true,
+							*seqno, false, 3*HZ);
+			goto out_err;
+		}
 
-	if (!(fifo_state->capabilities & SVGA_FIFO_CAP_FENCE)) {
+		if (have_seqno)
+			break;
+
+		if (dev_priv->cman) {
+			*seqno = vmw_fifo_next_seqno(dev_priv);
+			break;
+		}
+
+		/*
+		 * Fence seqnos must reach the fifo in order. Only allocate
+		 * one here if no fence can be queued ahead of us.
+		 */
+		spin_lock(&fifo_state->submit_lock);
+		if (likely(list_empty(&fifo_state->submit_queue))) {
+			*seqno = vmw_fifo_next_seqno(dev_priv);
+			spin_unlock(&fifo_state->submit_lock);
+			break;
+		}
+		spin_unlock(&fifo_state->submit_lock);
+
+		/* Commands were queued since the reservation. Retry. */
+		vmw_fifo_commit(dev_priv, 0);
+	}
+
+	if (!has_fence) {
 
 		/*
 		 * Don't request hardware to send a fence. The
@@ -527,6 +1238,7 @@ int vmw_fifo_send_fence(struct vmw_private *dev_priv, uint32_t *seqno)
 
 	iowrite32(*seqno, &cmd_fence->fence);
 	vmw_fifo_commit(dev_priv, bytes);
+out_fenced:
 	(void) vmw_marker_push(&fifo_state->marker_queue, *seqno);
 	vmw_update_seqno(dev_priv, fifo_state);
 
@@ -534,6 +1246,115 @@ out_err:
 	return ret;
 }
 
+/**
+ * vmw_fifo_fence_flush - Emit a pending coalesced fence.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ *
+ * Needs to be called before waiting for a seqno handed out by
+ * vmw_fifo_send_fence() in fence coalescing mode. Must not be called
+ * with the fifo fence_mutex held.
+ */
+int vmw_fifo_fence_flush(struct vmw_private *dev_priv)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+	uint32_t seqno;
+	bool pending;
+	int ret = 0;
+
+	if (likely(!fifo_state->fence_pending))
+		return 0;
+
+	mutex_lock(&fifo_state->fence_mutex);
+	spin_lock(&fifo_state->submit_lock);
+	pending = fifo_state->fence_pending;
+	seqno = fifo_state->pending_seqno;
+	fifo_state->fence_pending = false;
+	spin_unlock(&fifo_state->submit_lock);
+
+	if (pending)
+		ret = vmw_fifo_fence_emit(dev_priv, &seqno, true);
+	mutex_unlock(&fifo_state->fence_mutex);
+
+	return ret;
+}
+
+/**
+ * vmw_fifo_fence_work - Worker emitting a pending coalesced fence.
+ *
+ * @work: The fence_work member of a struct vmw_fifo_state.
+ */
+static void vmw_fifo_fence_work(struct work_struct *work)
+{
+	struct vmw_fifo_state *fifo_state =
+		container_of(work, struct vmw_fifo_state, fence_work.work);
+	struct vmw_private *dev_priv =
+		container_of(fifo_state, struct vmw_private, fifo);
+
+	(void) vmw_fifo_fence_flush(dev_priv);
+}
+
+/**
+ * vmw_fifo_fence_coalesce - Hand out a fence seqno without emitting it.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @seqno: Returns the fence seqno.
+ *
+ * Back-to-back submissions share the seqno of a pending fence. Commands
+ * committed before the call always precede the fence command, since the
+ * pending flag is cleared before the fence is emitted. The fence is
+ * emitted after VMW_FENCE_COALESCE_DELAY, or earlier by
+ * vmw_fifo_fence_flush() if somebody needs to wait for it.
+ * Only the fence command is held back. Commands committed without
+ * flushing, like execbuf batches, are submitted to the device right away.
+ */
+static int vmw_fifo_fence_coalesce(struct vmw_private *dev_priv,
+				   uint32_t *seqno)
+{
+	struct vmw_fifo_state *fifo_state = &dev_priv->fifo;
+
+	if (dev_priv->cman)
+		vmw_cmdbuf_flush(dev_priv->cman);
+	else
+		vmw_fifo_doorbell(dev_priv);
+
+	spin_lock(&fifo_state->submit_lock);
+	if (fifo_state->fence_pending) {
+		*seqno = fifo_state->pending_seqno;
+		spin_unlock(&fifo_state->submit_lock);
+		return 0;
+	}
+	spin_unlock(&fifo_state->submit_lock);
+
+	/*
+	 * Wait for a fence being emitted, so that seqnos reach the device
+	 * in order.
+	 */
+	mutex_lock(&fifo_state->fence_mutex);
+	spin_lock(&fifo_state->submit_lock);
+	if (!fifo_state->fence_pending) {
+		fifo_state->pending_seqno = vmw_fifo_next_seqno(dev_priv);
+		fifo_state->fence_pending = true;
+	}
+	*seqno = fifo_state->pending_seqno;
+	spin_unlock(&fifo_state->submit_lock);
+	mutex_unlock(&fifo_state->fence_mutex);
+
+	schedule_delayed_work(&fifo_state->fence_work,
+			      VMW_FENCE_COALESCE_DELAY);
+
+	return 0;
+}
+
+int vmw_fifo_send_fence(struct vmw_private *dev_priv, uint32_t *seqno)
+{
+	if (dev_priv->fence_coalesce &&
+	    (dev_priv->fifo.capabilities & SVGA_FIFO_CAP_FENCE))
+		return vmw_fifo_fence_coalesce(dev_priv, seqno);
+
+	return vmw_fifo_fence_emit(dev_priv, seqno, false);
+}
+
 /**
  * vmw_fifo_emit_dummy_legacy_query - emits a dummy query to the fifo using
  * legacy query commands.
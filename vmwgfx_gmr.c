@@ -29,29 +29,27 @@
 #include <drmP.h>
 #include <ttm/ttm_bo_driver.h>
 
-#define VMW_PPN_SIZE (sizeof(unsigned long))
-/* A future safe maximum remap size. */
-#define VMW_PPN_PER_REMAP ((31 * 1024) / VMW_PPN_SIZE)
+/* A future safe maximum remap command payload size. */
+#define VMW_REMAP_MAX_BYTES (31 * 1024)
 #define DMA_ADDR_INVALID ((dma_addr_t) 0)
 #define DMA_PAGE_INVALID 0UL
 
-static int vmw_gmr2_bind(struct vmw_private *dev_priv,
-			 struct vmw_piter *iter,
-			 unsigned long num_pages,
-			 int gmr_id)
+/*
+ * vmw_gmr2_define - Emit a DEFINE_GMR2 command.
+ *
+ * @dev_priv:  Pointer to a device private.
+ * @gmr_id:    Id of the GMR to define.
+ * @num_pages: Size of the GMR in pages. Zero undefines the GMR.
+ */
+static int vmw_gmr2_define(struct vmw_private *dev_priv,
+			   int gmr_id,
+			   unsigned long num_pages)
 {
 	SVGAFifoCmdDefineGMR2 define_cmd;
-	SVGAFifoCmdRemapGMR2 remap_cmd;
+	uint32_t define_size = sizeof(define_cmd) + 4;
 	uint32_t *cmd;
-	uint32_t *cmd_orig;
-	uint32_t define_size = sizeof(define_cmd) + sizeof(*cmd);
-	uint32_t remap_num = num_pages / VMW_PPN_PER_REMAP + ((num_pages % VMW_PPN_PER_REMAP) > 0);
-	uint32_t remap_size = VMW_PPN_SIZE * num_pages + (sizeof(remap_cmd) + sizeof(*cmd)) * remap_num;
-	uint32_t remap_pos = 0;
-	uint32_t cmd_size = define_size + remap_size;
-	uint32_t i;
-
-	cmd_orig = cmd = vmw_fifo_reserve(dev_priv, cmd_size);
+
+	cmd = vmw_fifo_reserve(dev_priv, define_size);
 	if (unlikely(cmd == NULL))
 		return -ENOMEM;
 
@@ -60,71 +58,121 @@ static int vmw_gmr2_bind(struct vmw_private *dev_priv,
 
 	*cmd++ = SVGA_CMD_DEFINE_GMR2;
 	memcpy(cmd, &define_cmd, sizeof(define_cmd));
-	cmd += sizeof(define_cmd) / sizeof(*cmd);
 
-	/*
-	 * Need to split the command if there are too many
-	 * pages that goes into the gmr.
-	 */
+	vmw_fifo_commit(dev_priv, define_size);
+
+	return 0;
+}
+
+/*
+ * vmw_gmr2_remap - Emit a REMAP_GMR2 command for the next run of pages.
+ *
+ * @dev_priv:  Pointer to a device private.
+ * @iter:      Page iterator pointing to the first page of the run. It is
+ *             advanced past the pages remapped.
+ * @offset:    Page offset of the run into the GMR.
+ * @num_pages: Number of pages left to remap.
+ * @gmr_id:    Id of the GMR.
+ *
+ * Uses 32-bit PPNs unless a page of the run needs more, which halves the
+ * command size on 64-bit kernels, and sizes the FIFO reservation to the
+ * run. Returns the number of pages remapped, or a negative error code.
+ */
+static long vmw_gmr2_remap(struct vmw_private *dev_priv,
+			   struct vmw_piter *iter,
+			   unsigned long offset,
+			   unsigned long num_pages,
+			   int gmr_id)
+{
+	SVGAFifoCmdRemapGMR2 remap_cmd;
+	struct vmw_piter scan = *iter;
+	unsigned long ppn_size = sizeof(uint32_t);
+	unsigned long nr = min(num_pages, VMW_REMAP_MAX_BYTES / ppn_size);
+	uint32_t cmd_size;
+	uint32_t *cmd;
+	unsigned long i;
+
+	for (i = 0; i < nr; ++i) {
+		if (((u64) vmw_piter_dma_addr(&scan) >> PAGE_SHIFT) >
+		    0xffffffffULL) {
+			ppn_size = sizeof(uint64_t);
+			nr = min(num_pages, VMW_REMAP_MAX_BYTES / ppn_size);
+			break;
+		}
+		vmw_piter_next(&scan);
+	}
+
+	cmd_size = sizeof(*cmd) + sizeof(remap_cmd) + nr * ppn_size;
+	cmd = vmw_fifo_reserve(dev_priv, cmd_size);
+	if (unlikely(cmd == NULL))
+		return -ENOMEM;
 
 	remap_cmd.gmrId = gmr_id;
-	remap_cmd.flags = (VMW_PPN_SIZE > sizeof(*cmd)) ?
+	remap_cmd.flags = (ppn_size > sizeof(*cmd)) ?
 		SVGA_REMAP_GMR2_PPN64 : SVGA_REMAP_GMR2_PPN32;
+	remap_cmd.offsetPages = offset;
+	remap_cmd.numPages = nr;
+
+	*cmd++ = SVGA_CMD_REMAP_GMR2;
+	memcpy(cmd, &remap_cmd, sizeof(remap_cmd));
+	cmd += sizeof(remap_cmd) / sizeof(*cmd);
+
+	for (i = 0; i < nr; ++i) {
+		if (ppn_size == sizeof(*cmd))
+			*cmd = vmw_piter_dma_addr(iter) >> PAGE_SHIFT;
+		else
+			*((uint64_t *)cmd) = (u64) vmw_piter_dma_addr(iter) >>
+				PAGE_SHIFT;
+
+		cmd += ppn_size / sizeof(*cmd);
+		vmw_piter_next(iter);
+	}
 
-	while (num_pages > 0) {
-		unsigned long nr = min(num_pages, (unsigned long)VMW_PPN_PER_REMAP);
+	vmw_fifo_commit(dev_priv, cmd_size);
 
-		remap_cmd.offsetPages = remap_pos;
-		remap_cmd.numPages = nr;
+	return nr;
+}
 
-		*cmd++ = SVGA_CMD_REMAP_GMR2;
-		memcpy(cmd, &remap_cmd, sizeof(remap_cmd));
-		cmd += sizeof(remap_cmd) / sizeof(*cmd);
+static int vmw_gmr2_bind(struct vmw_private *dev_priv,
+			 struct vmw_piter *iter,
+			 unsigned long num_pages,
+			 int gmr_id)
+{
+	unsigned long remap_pos = 0;
+	long nr;
+	int ret;
 
-		for (i = 0; i < nr; ++i) {
-			if (VMW_PPN_SIZE <= 4)
-				*cmd = vmw_piter_dma_addr(iter) >> PAGE_SHIFT;
-			else
-				*((uint64_t *)cmd) = vmw_piter_dma_addr(iter) >>
-					PAGE_SHIFT;
+	ret = vmw_gmr2_define(dev_priv, gmr_id, num_pages);
+	if (unlikely(ret != 0))
+		return ret;
 
-			cmd += VMW_PPN_SIZE / sizeof(*cmd);
-			vmw_piter_next(iter);
+	/*
+	 * Need to split the remapping if there are too many
+	 * pages that goes into the gmr.
+	 */
+
+	while (num_pages > 0) {
+		nr = vmw_gmr2_remap(dev_priv, iter, remap_pos, num_pages,
+				    gmr_id);
+		if (unlikely(nr < 0)) {
+			(void) vmw_gmr2_define(dev_priv, gmr_id, 0);
+			return nr;
 		}
 
 		num_pages -= nr;
 		remap_pos += nr;
 	}
 
-	BUG_ON(cmd != cmd_orig + cmd_size / sizeof(*cmd));
-
-	vmw_fifo_commit(dev_priv, cmd_size);
-
 	return 0;
 }
 
 static void vmw_gmr2_unbind(struct vmw_private *dev_priv,
 			    int gmr_id)
 {
-	SVGAFifoCmdDefineGMR2 define_cmd;
-	uint32_t define_size = sizeof(define_cmd) + 4;
-	uint32_t *cmd;
-
-	cmd = vmw_fifo_reserve(dev_priv, define_size);
-	if (unlikely(cmd == NULL)) {
+	if (unlikely(vmw_gmr2_define(dev_priv, gmr_id, 0) != 0))
 		DRM_ERROR("GMR2 unbind failed.\n");
-		return;
-	}
-	define_cmd.gmrId = gmr_id;
-	define_cmd.numPages = 0;
-
-	*cmd++ = SVGA_CMD_DEFINE_GMR2;
-	memcpy(cmd, &define_cmd, sizeof(define_cmd));
-
-	vmw_fifo_commit(dev_priv, define_size);
 }
 
-
 static void vmw_gmr_free_descriptors(struct device *dev, dma_addr_t desc_dma,
 				     struct list_head *desc_pages)
 {
@@ -246,8 +294,10 @@ static int vmw_gmr_build_descriptors(struct device *dev,
 		desc_dma = dma_map_page(dev, page, 0, PAGE_SIZE,
 					DMA_TO_DEVICE);
 
-		if (unlikely(dma_mapping_error(dev, desc_dma)))
+		if (unlikely(dma_mapping_error(dev, desc_dma))) {
+			ret = -ENOMEM;
 			goto out_err;
+		}
 	}
 	*first_dma = desc_dma;
 
@@ -272,13 +322,37 @@ static void vmw_gmr_fire_descriptors(struct vmw_private *dev_priv,
 	mutex_unlock(&dev_priv->hw_mutex);
 }
 
+/**
+ * vmw_gmr_desc_cache_release - Free cached legacy GMR descriptor pages.
+ *
+ * @dev_priv: Pointer to a device private.
+ * @desc_cache: The descriptor cache to empty.
+ */
+void vmw_gmr_desc_cache_release(struct vmw_private *dev_priv,
+				struct vmw_gmr_desc_cache *desc_cache)
+{
+	vmw_gmr_free_descriptors(dev_priv->dev->dev, desc_cache->first_dma,
+				 &desc_cache->pages);
+	desc_cache->first_dma = DMA_ADDR_INVALID;
+}
+
+/**
+ * vmw_gmr_bind - Bind the pages of a buffer to a GMR.
+ *
+ * @dev_priv: Pointer to a device private.
+ * @vsgt: The buffer's pages.
+ * @num_pages: Number of pages.
+ * @gmr_id: Id of the GMR.
+ * @desc_cache: The buffer's legacy GMR descriptor cache. Descriptors are
+ * built on the first legacy bind and reused until the cache is released,
+ * which the caller must do whenever the DMA addresses of @vsgt change.
+ */
 int vmw_gmr_bind(struct vmw_private *dev_priv,
 		 const struct vmw_sg_table *vsgt,
 		 unsigned long num_pages,
-		 int gmr_id)
+		 int gmr_id,
+		 struct vmw_gmr_desc_cache *desc_cache)
 {
-	struct list_head desc_pages;
-	dma_addr_t desc_dma = 0;
 	struct device *dev = dev_priv->dev->dev;
 	struct vmw_piter data_iter;
 	int ret;
@@ -298,15 +372,15 @@ int vmw_gmr_bind(struct vmw_private *dev_priv,
 	if (vsgt->num_regions > dev_priv->max_gmr_descriptors)
 		return -EINVAL;
 
-	INIT_LIST_HEAD(&desc_pages);
-
-	ret = vmw_gmr_build_descriptors(dev, &desc_pages, &data_iter,
-					num_pages, &desc_dma);
-	if (unlikely(ret != 0))
-		return ret;
+	if (list_empty(&desc_cache->pages)) {
+		ret = vmw_gmr_build_descriptors(dev, &desc_cache->pages,
+						&data_iter, num_pages,
+						&desc_cache->first_dma);
+		if (unlikely(ret != 0))
+			return ret;
+	}
 
-	vmw_gmr_fire_descriptors(dev_priv, gmr_id, desc_dma);
-	vmw_gmr_free_descriptors(dev, desc_dma, &desc_pages);
+	vmw_gmr_fire_descriptors(dev_priv, gmr_id, desc_cache->first_dma);
 
 	return 0;
 }
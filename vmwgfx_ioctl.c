@@ -34,6 +34,41 @@ struct svga_3d_compat_cap {
 	SVGA3dCapPair pairs[SVGA3D_DEVCAP_MAX];
 };
 
+/**
+ * vmw_getparam_res_stat - Read a per-resource-type statistics counter.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @param: The get-param argument.
+ *
+ * Returns -EINVAL if @param isn't a valid DRM_VMW_PARAM_RES_x parameter.
+ */
+static int vmw_getparam_res_stat(struct vmw_private *dev_priv,
+				 struct drm_vmw_getparam_arg *param)
+{
+	uint32_t type = param->param & (DRM_VMW_RES_TYPE_MAX - 1);
+	atomic_t *stats;
+
+	switch (param->param - type) {
+	case DRM_VMW_PARAM_RES_HITS(0):
+		stats = dev_priv->res_hits;
+		break;
+	case DRM_VMW_PARAM_RES_EVICTIONS(0):
+		stats = dev_priv->res_evictions;
+		break;
+	case DRM_VMW_PARAM_RES_READBACKS(0):
+		stats = dev_priv->res_readbacks;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (type >= vmw_res_max)
+		return -EINVAL;
+
+	param->value = atomic_read(&stats[type]);
+	return 0;
+}
+
 int vmw_getparam_ioctl(struct drm_device *dev, void *data,
 		       struct drm_file *file_priv)
 {
@@ -105,7 +140,28 @@ int vmw_getparam_ioctl(struct drm_device *dev, void *data,
 	case DRM_VMW_PARAM_MAX_MOB_SIZE:
 		param->value = dev_priv->max_mob_size;
 		break;
+	case DRM_VMW_PARAM_EXECBUF_ALLOCS_AVOIDED:
+		mutex_lock(&vmw_fp->cmdbuf_mutex);
+		param->value = (vmw_fp->sw_context != NULL) ?
+			vmw_fp->sw_context->allocs_avoided : 0;
+		mutex_unlock(&vmw_fp->cmdbuf_mutex);
+		break;
+	case DRM_VMW_PARAM_DOORBELLS_SENT:
+		param->value = atomic_read(&dev_priv->fifo.doorbells_sent);
+		break;
+	case DRM_VMW_PARAM_DOORBELLS_SAVED:
+		param->value = atomic_read(&dev_priv->fifo.doorbells_saved);
+		break;
+	case DRM_VMW_PARAM_PT_POOL_HITS:
+		param->value = atomic_read(&dev_priv->pt_pool_hits);
+		break;
+	case DRM_VMW_PARAM_PT_POOL_MISSES:
+		param->value = atomic_read(&dev_priv->pt_pool_misses);
+		break;
 	default:
+		if (vmw_getparam_res_stat(dev_priv, param) == 0)
+			break;
+
 		DRM_ERROR("Illegal vmwgfx get param request: %d\n",
 			  param->param);
 		return -EINVAL;
@@ -385,6 +441,212 @@ out_clips:
 }
 
 
+/**
+ * struct vmw_bulk_handle - Handles created for a single bulk define item.
+ *
+ * @handle: Handle of the new resource.
+ * @buffer_handle: Handle of a backup buffer created along with the
+ * resource, or SVGA3D_INVALID_ID.
+ */
+struct vmw_bulk_handle {
+	uint32_t handle;
+	uint32_t buffer_handle;
+};
+
+/**
+ * vmw_bulk_define_one - Create a single resource of a bulk define request.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @file_priv: Pointer to a drm file private structure.
+ * @arg: The bulk define argument.
+ * @acc_size: Graphics memory accounted per resource.
+ * @i: Index of the resource in the request and reply arrays.
+ * @out: Assigned the handles created on success.
+ *
+ * Consumes @acc_size bytes of the caller's graphics memory accounting,
+ * also on failure.
+ */
+static int vmw_bulk_define_one(struct vmw_private *dev_priv,
+			       struct drm_file *file_priv,
+			       const struct drm_vmw_bulk_define_arg *arg,
+			       uint64_t acc_size, uint32_t i,
+			       struct vmw_bulk_handle *out)
+{
+	struct ttm_object_file *tfile = vmw_fpriv(file_priv)->tfile;
+	char __user *req = (char __user *)(unsigned long)arg->req;
+	char __user *rep = (char __user *)(unsigned long)arg->rep;
+	union {
+		struct drm_vmw_context_arg ctx;
+		union drm_vmw_gb_surface_create_arg srf;
+		struct drm_vmw_shader_create_arg shader;
+	} u;
+	const void *rep_data;
+	size_t rep_size;
+	int ret;
+
+	out->buffer_handle = SVGA3D_INVALID_ID;
+
+	switch (arg->type) {
+	case drm_vmw_bulk_context:
+		ret = vmw_context_define(dev_priv, tfile, &out->handle);
+		u.ctx.cid = out->handle;
+		u.ctx.pad64 = 0;
+		rep_data = &u.ctx;
+		rep_size = sizeof(u.ctx);
+		break;
+	case drm_vmw_bulk_gb_surface:
+	{
+		bool own_buffer;
+
+		if (copy_from_user(&u.srf.req, req + i * sizeof(u.srf.req),
+				   sizeof(u.srf.req)))
+			goto out_no_copy;
+
+		own_buffer = u.srf.req.buffer_handle == SVGA3D_INVALID_ID &&
+			(u.srf.req.drm_surface_flags &
+			 drm_vmw_surface_flag_create_buffer);
+		ret = vmw_gb_surface_define(dev_priv, file_priv, &u.srf.req,
+					    &u.srf.rep);
+		out->handle = u.srf.rep.handle;
+		if (own_buffer)
+			out->buffer_handle = u.srf.rep.buffer_handle;
+		rep_data = &u.srf.rep;
+		rep_size = sizeof(u.srf.rep);
+		break;
+	}
+	case drm_vmw_bulk_shader:
+		if (copy_from_user(&u.shader, req + i * sizeof(u.shader),
+				   sizeof(u.shader)))
+			goto out_no_copy;
+
+		ret = vmw_shader_define(dev_priv, tfile, &u.shader);
+		out->handle = u.shader.shader_handle;
+		rep_data = &u.shader;
+		rep_size = sizeof(u.shader);
+		break;
+	default:
+		BUG();
+	}
+
+	if (unlikely(ret != 0))
+		return ret;
+
+	if (copy_to_user(rep + i * rep_size, rep_data, rep_size)) {
+		(void) ttm_ref_object_base_unref(tfile, out->handle,
+						 TTM_REF_USAGE);
+		if (out->buffer_handle != SVGA3D_INVALID_ID)
+			(void) ttm_ref_object_base_unref(tfile,
+							 out->buffer_handle,
+							 TTM_REF_USAGE);
+		return -EFAULT;
+	}
+
+	return 0;
+
+out_no_copy:
+	ttm_mem_global_free(vmw_mem_glob(dev_priv), acc_size);
+	return -EFAULT;
+}
+
+/**
+ * vmw_bulk_define_ioctl - Ioctl function creating a number of resources
+ * of the same type.
+ *
+ * @dev: Pointer to a struct drm_device.
+ * @data: Pointer to a struct drm_vmw_bulk_define_arg.
+ * @file_priv: Pointer to a drm file private structure.
+ *
+ * Takes the reservation_sem and charges graphics memory accounting once
+ * for the whole batch rather than once per resource. On failure, the
+ * resources already created are released again, so that user-space either
+ * gets all handles or none.
+ */
+int vmw_bulk_define_ioctl(struct drm_device *dev, void *data,
+			  struct drm_file *file_priv)
+{
+	struct vmw_private *dev_priv = vmw_priv(dev);
+	struct drm_vmw_bulk_define_arg *arg =
+		(struct drm_vmw_bulk_define_arg *)data;
+	struct ttm_object_file *tfile = vmw_fpriv(file_priv)->tfile;
+	struct vmw_bulk_handle *handles;
+	uint64_t acc_size;
+	uint32_t i;
+	int ret;
+
+	if (unlikely(arg->count == 0))
+		return 0;
+
+	if (unlikely(arg->count > DRM_VMW_BULK_DEFINE_MAX)) {
+		DRM_ERROR("Too many resources in bulk define.\n");
+		return -EINVAL;
+	}
+
+	switch (arg->type) {
+	case drm_vmw_bulk_context:
+		acc_size = vmw_context_acc_size(dev_priv);
+		break;
+	case drm_vmw_bulk_gb_surface:
+		acc_size = vmw_gb_surface_acc_size();
+		break;
+	case drm_vmw_bulk_shader:
+		acc_size = vmw_shader_acc_size();
+		break;
+	default:
+		DRM_ERROR("Illegal bulk define resource type.\n");
+		return -EINVAL;
+	}
+
+	handles = kmalloc(arg->count * sizeof(*handles), GFP_KERNEL);
+	if (unlikely(handles == NULL))
+		return -ENOMEM;
+
+	ret = ttm_read_lock(&dev_priv->reservation_sem, true);
+	if (unlikely(ret != 0))
+		goto out_no_lock;
+
+	ret = ttm_mem_global_alloc(vmw_mem_glob(dev_priv),
+				   arg->count * acc_size, false, true);
+	if (unlikely(ret != 0)) {
+		if (ret != -ERESTARTSYS)
+			DRM_ERROR("Out of graphics memory for bulk resource"
+				  " creation.\n");
+		goto out_unlock;
+	}
+
+	for (i = 0; i < arg->count; ++i) {
+		ret = vmw_bulk_define_one(dev_priv, file_priv, arg, acc_size,
+					  i, &handles[i]);
+		if (unlikely(ret != 0))
+			goto out_rollback;
+	}
+
+	ttm_read_unlock(&dev_priv->reservation_sem);
+	kfree(handles);
+	return 0;
+
+out_rollback:
+	/*
+	 * The failing item has consumed its own accounting. Return that of
+	 * the items never created, and drop the ones already created.
+	 */
+	ttm_mem_global_free(vmw_mem_glob(dev_priv),
+			    (arg->count - i - 1) * acc_size);
+	while (i-- > 0) {
+		(void) ttm_ref_object_base_unref(tfile, handles[i].handle,
+						 TTM_REF_USAGE);
+		if (handles[i].buffer_handle != SVGA3D_INVALID_ID)
+			(void) ttm_ref_object_base_unref
+				(tfile, handles[i].buffer_handle,
+				 TTM_REF_USAGE);
+	}
+out_unlock:
+	ttm_read_unlock(&dev_priv->reservation_sem);
+out_no_lock:
+	kfree(handles);
+	return ret;
+}
+
+
 /**
  * vmw_fops_poll - wrapper around the drm_poll function
  *
@@ -56,6 +56,12 @@ irqreturn_t vmw_irq_handler(DRM_IRQ_ARGS)
 	if (masked_status & SVGA_IRQFLAG_FIFO_PROGRESS)
 		wake_up_all(&dev_priv->fifo_queue);
 
+	if (masked_status & (SVGA_IRQFLAG_COMMAND_BUFFER |
+			     SVGA_IRQFLAG_ERROR)) {
+		wake_up_all(&dev_priv->cmdbuf_queue);
+		if ((masked_status & SVGA_IRQFLAG_ERROR) && dev_priv->cman)
+			vmw_cmdbuf_kick(dev_priv->cman);
+	}
 
 	return IRQ_HANDLED;
 }
@@ -64,6 +70,9 @@ static bool vmw_fifo_idle(struct vmw_private *dev_priv, uint32_t seqno)
 {
 	uint32_t busy;
 
+	if (vmw_fifo_submit_pending(dev_priv))
+		return false;
+
 	mutex_lock(&dev_priv->hw_mutex);
 	busy = vmw_read(dev_priv, SVGA_REG_BUSY);
 	mutex_unlock(&dev_priv->hw_mutex);
@@ -133,11 +142,14 @@ int vmw_fallback_wait(struct vmw_private *dev_priv,
 		&vmw_seqno_passed;
 
 	/**
-	 * Block command submission while waiting for idle.
+	 * Submit queued commands, and block command submission while
+	 * waiting for idle.
 	 */
 
-	if (fifo_idle)
+	if (fifo_idle) {
+		vmw_fifo_flush(dev_priv);
 		down_read(&fifo_state->rwsem);
+	}
 	signal_seq = atomic_read(&dev_priv->marker_seq);
 	ret = 0;
 
@@ -243,6 +255,76 @@ void vmw_goal_waiter_remove(struct vmw_private *dev_priv)
 	mutex_unlock(&dev_priv->hw_mutex);
 }
 
+/**
+ * vmw_cmdbuf_waiter_add - Enable command buffer completion interrupts
+ * for a new waiter on dev_priv::cmdbuf_queue.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ */
+void vmw_cmdbuf_waiter_add(struct vmw_private *dev_priv)
+{
+	mutex_lock(&dev_priv->hw_mutex);
+	if (dev_priv->cmdbuf_waiters++ == 0) {
+		unsigned long irq_flags;
+
+		spin_lock_irqsave(&dev_priv->irq_lock, irq_flags);
+		outl(SVGA_IRQFLAG_COMMAND_BUFFER,
+		     dev_priv->io_start + VMWGFX_IRQSTATUS_PORT);
+		dev_priv->irq_mask |= SVGA_IRQFLAG_COMMAND_BUFFER;
+		vmw_write(dev_priv, SVGA_REG_IRQMASK, dev_priv->irq_mask);
+		spin_unlock_irqrestore(&dev_priv->irq_lock, irq_flags);
+	}
+	mutex_unlock(&dev_priv->hw_mutex);
+}
+
+/**
+ * vmw_cmdbuf_waiter_remove - Drop a waiter added with
+ * vmw_cmdbuf_waiter_add.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ */
+void vmw_cmdbuf_waiter_remove(struct vmw_private *dev_priv)
+{
+	mutex_lock(&dev_priv->hw_mutex);
+	if (--dev_priv->cmdbuf_waiters == 0) {
+		unsigned long irq_flags;
+
+		spin_lock_irqsave(&dev_priv->irq_lock, irq_flags);
+		dev_priv->irq_mask &= ~SVGA_IRQFLAG_COMMAND_BUFFER;
+		vmw_write(dev_priv, SVGA_REG_IRQMASK, dev_priv->irq_mask);
+		spin_unlock_irqrestore(&dev_priv->irq_lock, irq_flags);
+	}
+	mutex_unlock(&dev_priv->hw_mutex);
+}
+
+/**
+ * vmw_cmdbuf_error_irq - Enable or disable command error interrupts.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @enable: Whether to enable the interrupt.
+ *
+ * Command errors stop the command buffer context, so the interrupt stays
+ * enabled for as long as the command buffer manager exists, to have the
+ * context restarted even when nobody waits for command buffers.
+ */
+void vmw_cmdbuf_error_irq(struct vmw_private *dev_priv, bool enable)
+{
+	unsigned long irq_flags;
+
+	mutex_lock(&dev_priv->hw_mutex);
+	spin_lock_irqsave(&dev_priv->irq_lock, irq_flags);
+	if (enable) {
+		outl(SVGA_IRQFLAG_ERROR,
+		     dev_priv->io_start + VMWGFX_IRQSTATUS_PORT);
+		dev_priv->irq_mask |= SVGA_IRQFLAG_ERROR;
+	} else {
+		dev_priv->irq_mask &= ~SVGA_IRQFLAG_ERROR;
+	}
+	vmw_write(dev_priv, SVGA_REG_IRQMASK, dev_priv->irq_mask);
+	spin_unlock_irqrestore(&dev_priv->irq_lock, irq_flags);
+	mutex_unlock(&dev_priv->hw_mutex);
+}
+
 int vmw_wait_seqno(struct vmw_private *dev_priv,
 		      bool lazy, uint32_t seqno,
 		      bool interruptible, unsigned long timeout)
@@ -256,7 +338,10 @@ int vmw_wait_seqno(struct vmw_private *dev_priv,
 	if (likely(vmw_seqno_passed(dev_priv, seqno)))
 		return 0;
 
+	(void) vmw_fifo_fence_flush(dev_priv);
 	vmw_fifo_ping_host(dev_priv, SVGA_SYNC_GENERIC);
+	if (dev_priv->cman)
+		vmw_cmdbuf_kick(dev_priv->cman);
 
 	if (!(fifo->capabilities & SVGA_FIFO_CAP_FENCE))
 		return vmw_fallback_wait(dev_priv, lazy, true, seqno,
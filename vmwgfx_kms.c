@@ -418,6 +418,47 @@ void vmw_framebuffer_surface_destroy(struct drm_framebuffer *framebuffer)
 	kfree(vfbs);
 }
 
+/**
+ * vmw_kms_dirty_buf_get - Get a temporary buffer for a dirty update.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @scratch: One of the preallocated dirty scratch buffers.
+ * @scratch_size: Size of @scratch.
+ * @size: Size needed.
+ *
+ * Returns @scratch if it is large enough and a new allocation otherwise,
+ * or NULL on allocation failure. The caller must hold
+ * dev_priv::dirty_mutex and must release the buffer using
+ * vmw_kms_dirty_buf_put().
+ */
+static void *vmw_kms_dirty_buf_get(struct vmw_private *dev_priv,
+				   void *scratch, size_t scratch_size,
+				   size_t size)
+{
+	void *buf;
+
+	lockdep_assert_held(&dev_priv->dirty_mutex);
+
+	if (likely(size <= scratch_size))
+		return scratch;
+
+	buf = kmalloc(size, GFP_KERNEL);
+	if (unlikely(buf == NULL))
+		DRM_ERROR("Temporary dirty buffer alloc failed.\n");
+
+	return buf;
+}
+
+static void vmw_kms_dirty_buf_put(void *scratch, void *buf)
+{
+	if (buf != scratch)
+		kfree(buf);
+}
+
+/*
+ * Must be called with dev_priv::dirty_mutex held. Blits to all display
+ * units showing the framebuffer are submitted as a single command batch.
+ */
 static int do_surface_dirty_sou(struct vmw_private *dev_priv,
 				struct drm_file *file_priv,
 				struct vmw_framebuffer *framebuffer,
@@ -430,9 +471,11 @@ static int do_surface_dirty_sou(struct vmw_private *dev_priv,
 	struct drm_clip_rect *clips_ptr;
 	struct drm_clip_rect *tmp;
 	struct drm_crtc *crtc;
-	size_t fifo_size;
+	size_t fifo_size, unit_size, tmp_size;
+	void *buf;
+	char *pos;
 	int i, num_units;
-	int ret = 0; /* silence warning */
+	int ret = 0;
 	int left, right, top, bottom;
 
 	struct {
@@ -451,22 +494,20 @@ static int do_surface_dirty_sou(struct vmw_private *dev_priv,
 
 	BUG_ON(!clips || !num_clips);
 
-	tmp = kzalloc(sizeof(*tmp) * num_clips, GFP_KERNEL);
-	if (unlikely(tmp == NULL)) {
-		DRM_ERROR("Temporary cliprect memory alloc failed.\n");
+	/*
+	 * The command buffer holds one blit command per unit, followed by
+	 * the temporary translated cliprects.
+	 */
+	unit_size = sizeof(*cmd) + sizeof(SVGASignedRect) * num_clips;
+	fifo_size = unit_size * num_units;
+	tmp_size = sizeof(*tmp) * num_clips;
+	buf = vmw_kms_dirty_buf_get(dev_priv, dev_priv->dirty_cmd,
+				    VMWGFX_DIRTY_CMD_SIZE,
+				    fifo_size + tmp_size);
+	if (unlikely(buf == NULL))
 		return -ENOMEM;
-	}
-
-	fifo_size = sizeof(*cmd) + sizeof(SVGASignedRect) * num_clips;
-	cmd = kzalloc(fifo_size, GFP_KERNEL);
-	if (unlikely(cmd == NULL)) {
-		DRM_ERROR("Temporary fifo memory alloc failed.\n");
-		ret = -ENOMEM;
-		goto out_free_tmp;
-	}
 
-	/* setup blits pointer */
-	blits = (SVGASignedRect *)&cmd[1];
+	tmp = (struct drm_clip_rect *)((char *)buf + fifo_size);
 
 	/* initial clip region */
 	left = clips->x1;
@@ -483,16 +524,6 @@ static int do_surface_dirty_sou(struct vmw_private *dev_priv,
 		bottom = max_t(int, bottom, (int)clips_ptr->y2);
 	}
 
-	/* only need to do this once */
-	memset(cmd, 0, fifo_size);
-	cmd->header.id = cpu_to_le32(SVGA_3D_CMD_BLIT_SURFACE_TO_SCREEN);
-	cmd->header.size = cpu_to_le32(fifo_size - sizeof(cmd->header));
-
-	cmd->body.srcRect.left = left;
-	cmd->body.srcRect.right = right;
-	cmd->body.srcRect.top = top;
-	cmd->body.srcRect.bottom = bottom;
-
 	clips_ptr = clips;
 	for (i = 0; i < num_clips; i++, clips_ptr += inc) {
 		tmp[i].x1 = clips_ptr->x1 - left;
@@ -501,7 +532,8 @@ static int do_surface_dirty_sou(struct vmw_private *dev_priv,
 		tmp[i].y2 = clips_ptr->y2 - top;
 	}
 
-	/* do per unit writing, reuse fifo for each */
+	/* do per unit writing, appending to the command batch */
+	pos = buf;
 	for (i = 0; i < num_units; i++) {
 		struct vmw_display_unit *unit = units[i];
 		struct vmw_clip_rect clip;
@@ -518,6 +550,16 @@ static int do_surface_dirty_sou(struct vmw_private *dev_priv,
 		    clip.x2 <= 0 || clip.y2 <= 0)
 			continue;
 
+		cmd = (void *) pos;
+		blits = (SVGASignedRect *)&cmd[1];
+		memset(cmd, 0, sizeof(*cmd));
+		cmd->header.id = cpu_to_le32(SVGA_3D_CMD_BLIT_SURFACE_TO_SCREEN);
+
+		cmd->body.srcRect.left = left;
+		cmd->body.srcRect.right = right;
+		cmd->body.srcRect.top = top;
+		cmd->body.srcRect.bottom = bottom;
+
 		/*
 		 * In order for the clip rects to be correctly scaled
 		 * the src and dest rects needs to be the same size.
@@ -533,7 +575,6 @@ static int do_surface_dirty_sou(struct vmw_private *dev_priv,
 		clip.x1 = 0 - clip.x1;
 		clip.y1 = 0 - clip.y1;
 
-		/* need to reset sid as it is changed by execbuf */
 		cmd->body.srcImage.sid = cpu_to_le32(framebuffer->user_handle);
 		cmd->body.destScreenId = unit->unit;
 
@@ -544,24 +585,17 @@ static int do_surface_dirty_sou(struct vmw_private *dev_priv,
 		if (num == 0)
 			continue;
 
-		/* only return the last fence */
-		if (out_fence && *out_fence)
-			vmw_fence_obj_unreference(out_fence);
-
-		/* recalculate package length */
-		fifo_size = sizeof(*cmd) + sizeof(SVGASignedRect) * num;
-		cmd->header.size = cpu_to_le32(fifo_size - sizeof(cmd->header));
-		ret = vmw_execbuf_process(file_priv, dev_priv, NULL, cmd,
-					  fifo_size, 0, NULL, out_fence);
-
-		if (unlikely(ret != 0))
-			break;
+		unit_size = sizeof(*cmd) + sizeof(SVGASignedRect) * num;
+		cmd->header.size = cpu_to_le32(unit_size - sizeof(cmd->header));
+		pos += unit_size;
 	}
 
+	fifo_size = pos - (char *)buf;
+	if (fifo_size != 0)
+		ret = vmw_execbuf_process(file_priv, dev_priv, NULL, buf,
+					  fifo_size, 0, NULL, out_fence);
 
-	kfree(cmd);
-out_free_tmp:
-	kfree(tmp);
+	vmw_kms_dirty_buf_put(dev_priv->dirty_cmd, buf);
 
 	return ret;
 }
@@ -576,6 +610,7 @@ int vmw_framebuffer_surface_dirty(struct drm_framebuffer *framebuffer,
 	struct vmw_framebuffer_surface *vfbs =
 		vmw_framebuffer_to_vfbs(framebuffer);
 	struct drm_clip_rect norect;
+	struct drm_clip_rect *damage;
 	int ret, inc = 1;
 
 	if (unlikely(vfbs->master != file_priv->master))
@@ -600,10 +635,25 @@ int vmw_framebuffer_surface_dirty(struct drm_framebuffer *framebuffer,
 		inc = 2; /* skip source rects */
 	}
 
-	ret = do_surface_dirty_sou(dev_priv, file_priv, &vfbs->base,
-				   flags, color,
-				   clips, num_clips, inc, NULL);
-
+	mutex_lock(&dev_priv->dirty_mutex);
+	damage = vmw_kms_dirty_buf_get(dev_priv, dev_priv->dirty_rects,
+				       VMWGFX_DIRTY_RECTS_SIZE,
+				       sizeof(*damage) * num_clips);
+	if (unlikely(damage == NULL))
+		goto out_dirty_unlock;
+
+	num_clips = vmw_damage_coalesce(clips, num_clips, inc,
+					dev_priv->damage_max_rects,
+					dev_priv->damage_waste_pct, damage);
+	if (num_clips != 0)
+		ret = do_surface_dirty_sou(dev_priv, file_priv, &vfbs->base,
+					   flags, color,
+					   damage, num_clips, 1, NULL);
+
+	vmw_kms_dirty_buf_put(dev_priv->dirty_rects, damage);
+out_dirty_unlock:
+	mutex_unlock(&dev_priv->dirty_mutex);
+out_unlock:
 	ttm_read_unlock(&dev_priv->reservation_sem);
 	return 0;
 }
@@ -775,18 +825,15 @@ static int do_dmabuf_dirty_ldu(struct vmw_private *dev_priv,
 	return 0;
 }
 
-static int do_dmabuf_define_gmrfb(struct drm_file *file_priv,
-				  struct vmw_private *dev_priv,
-				  struct vmw_framebuffer *framebuffer)
+static void do_dmabuf_define_gmrfb(struct vmw_framebuffer *framebuffer,
+				   void *cmd_buf)
 {
 	int depth = framebuffer->base.depth;
-	size_t fifo_size;
-	int ret;
 
 	struct {
 		uint32_t header;
 		SVGAFifoCmdDefineGMRFB body;
-	} *cmd;
+	} *cmd = cmd_buf;
 
 	/* Emulate RGBA support, contrary to svga_reg.h this is not
 	 * supported by hosts. This is only a problem if we are reading
@@ -795,14 +842,7 @@ static int do_dmabuf_define_gmrfb(struct drm_file *file_priv,
 	if (depth == 32)
 		depth = 24;
 
-	fifo_size = sizeof(*cmd);
-	cmd = kmalloc(fifo_size, GFP_KERNEL);
-	if (unlikely(cmd == NULL)) {
-		DRM_ERROR("Failed to allocate temporary cmd buffer.\n");
-		return -ENOMEM;
-	}
-
-	memset(cmd, 0, fifo_size);
+	memset(cmd, 0, sizeof(*cmd));
 	cmd->header = SVGA_CMD_DEFINE_GMRFB;
 	cmd->body.format.bitsPerPixel = framebuffer->base.bits_per_pixel;
 	cmd->body.format.colorDepth = depth;
@@ -810,15 +850,13 @@ static int do_dmabuf_define_gmrfb(struct drm_file *file_priv,
 	cmd->body.bytesPerLine = framebuffer->base.pitch;
 	cmd->body.ptr.gmrId = framebuffer->user_handle;
 	cmd->body.ptr.offset = 0;
-
-	ret = vmw_execbuf_process(file_priv, dev_priv, NULL, cmd,
-				  fifo_size, 0, NULL, NULL);
-
-	kfree(cmd);
-
-	return ret;
 }
 
+/*
+ * Must be called with dev_priv::dirty_mutex held. The GMRFB definition
+ * and the blits to all display units showing the framebuffer are
+ * submitted as a single command batch.
+ */
 static int do_dmabuf_dirty_sou(struct drm_file *file_priv,
 			       struct vmw_private *dev_priv,
 			       struct vmw_framebuffer *framebuffer,
@@ -829,26 +867,21 @@ static int do_dmabuf_dirty_sou(struct drm_file *file_priv,
 {
 	struct vmw_display_unit *units[VMWGFX_NUM_DISPLAY_UNITS];
 	struct drm_clip_rect *clips_ptr;
-	int i, k, num_units, ret;
+	int i, k, num_units, hit_num, ret = 0;
 	struct drm_crtc *crtc;
 	size_t fifo_size;
+	void *buf;
+
+	struct {
+		uint32_t header;
+		SVGAFifoCmdDefineGMRFB body;
+	} *define;
 
 	struct {
 		uint32_t header;
 		SVGAFifoCmdBlitGMRFBToScreen body;
 	} *blits;
 
-	ret = do_dmabuf_define_gmrfb(file_priv, dev_priv, framebuffer);
-	if (unlikely(ret != 0))
-		return ret; /* define_gmrfb prints warnings */
-
-	fifo_size = sizeof(*blits) * num_clips;
-	blits = kmalloc(fifo_size, GFP_KERNEL);
-	if (unlikely(blits == NULL)) {
-		DRM_ERROR("Failed to allocate temporary cmd buffer.\n");
-		return -ENOMEM;
-	}
-
 	num_units = 0;
 	list_for_each_entry(crtc, &dev_priv->dev->mode_config.crtc_list, head) {
 		if (crtc->fb != &framebuffer->base)
@@ -856,9 +889,19 @@ static int do_dmabuf_dirty_sou(struct drm_file *file_priv,
 		units[num_units++] = vmw_crtc_to_du(crtc);
 	}
 
+	fifo_size = sizeof(*define) + sizeof(*blits) * num_clips * num_units;
+	buf = vmw_kms_dirty_buf_get(dev_priv, dev_priv->dirty_cmd,
+				    VMWGFX_DIRTY_CMD_SIZE, fifo_size);
+	if (unlikely(buf == NULL))
+		return -ENOMEM;
+
+	define = buf;
+	do_dmabuf_define_gmrfb(framebuffer, define);
+	blits = (void *) &define[1];
+
+	hit_num = 0;
 	for (k = 0; k < num_units; k++) {
 		struct vmw_display_unit *unit = units[k];
-		int hit_num = 0;
 
 		clips_ptr = clips;
 		for (i = 0; i < num_clips; i++, clips_ptr += increment) {
@@ -893,24 +936,16 @@ static int do_dmabuf_dirty_sou(struct drm_file *file_priv,
 			blits[hit_num].body.destRect.bottom = clip_y2;
 			hit_num++;
 		}
+	}
 
-		/* no clips hit the crtc */
-		if (hit_num == 0)
-			continue;
-
-		/* only return the last fence */
-		if (out_fence && *out_fence)
-			vmw_fence_obj_unreference(out_fence);
-
-		fifo_size = sizeof(*blits) * hit_num;
-		ret = vmw_execbuf_process(file_priv, dev_priv, NULL, blits,
+	/* no clips hit any crtc */
+	if (hit_num != 0) {
+		fifo_size = sizeof(*define) + sizeof(*blits) * hit_num;
+		ret = vmw_execbuf_process(file_priv, dev_priv, NULL, buf,
 					  fifo_size, 0, NULL, out_fence);
-
-		if (unlikely(ret != 0))
-			break;
 	}
 
-	kfree(blits);
+	vmw_kms_dirty_buf_put(dev_priv->dirty_cmd, buf);
 
 	return ret;
 }
@@ -925,6 +960,7 @@ int vmw_framebuffer_dmabuf_dirty(struct drm_framebuffer *framebuffer,
 	struct vmw_framebuffer_dmabuf *vfbd =
 		vmw_framebuffer_to_vfbd(framebuffer);
 	struct drm_clip_rect norect;
+	struct drm_clip_rect *damage;
 	int ret, increment = 1;
 
 	ret = ttm_read_lock(&dev_priv->reservation_sem, true);
@@ -942,16 +978,34 @@ int vmw_framebuffer_dmabuf_dirty(struct drm_framebuffer *framebuffer,
 		increment = 2;
 	}
 
-	if (dev_priv->ldu_priv) {
+	mutex_lock(&dev_priv->dirty_mutex);
+	damage = vmw_kms_dirty_buf_get(dev_priv, dev_priv->dirty_rects,
+				       VMWGFX_DIRTY_RECTS_SIZE,
+				       sizeof(*damage) * num_clips);
+	if (unlikely(damage == NULL)) {
+		ret = -ENOMEM;
+		goto out_dirty_unlock;
+	}
+
+	num_clips = vmw_damage_coalesce(clips, num_clips, increment,
+					dev_priv->damage_max_rects,
+					dev_priv->damage_waste_pct, damage);
+	if (num_clips == 0)
+		ret = 0;
+	else if (dev_priv->ldu_priv) {
 		ret = do_dmabuf_dirty_ldu(dev_priv, &vfbd->base,
 					  flags, color,
-					  clips, num_clips, increment);
+					  damage, num_clips, 1);
 	} else {
 		ret = do_dmabuf_dirty_sou(file_priv, dev_priv, &vfbd->base,
 					  flags, color,
-					  clips, num_clips, increment, NULL);
+					  damage, num_clips, 1, NULL);
 	}
 
+	vmw_kms_dirty_buf_put(dev_priv->dirty_rects, damage);
+out_dirty_unlock:
+	mutex_unlock(&dev_priv->dirty_mutex);
+out_unlock:
 	ttm_read_unlock(&dev_priv->reservation_sem);
 	return ret;
 }
@@ -1432,6 +1486,20 @@ int vmw_kms_init(struct vmw_private *dev_priv)
 	struct drm_device *dev = dev_priv->dev;
 	int ret;
 
+	/*
+	 * Preallocate the dirty update scratch buffers so that the common
+	 * dirty path doesn't need to allocate memory.
+	 */
+	mutex_init(&dev_priv->dirty_mutex);
+	dev_priv->dirty_rects = kmalloc(VMWGFX_DIRTY_RECTS_SIZE, GFP_KERNEL);
+	dev_priv->dirty_cmd = kmalloc(VMWGFX_DIRTY_CMD_SIZE, GFP_KERNEL);
+	if (unlikely(dev_priv->dirty_rects == NULL ||
+		     dev_priv->dirty_cmd == NULL)) {
+		kfree(dev_priv->dirty_rects);
+		kfree(dev_priv->dirty_cmd);
+		return -ENOMEM;
+	}
+
 	drm_mode_config_init(dev);
 	dev->mode_config.funcs = &vmw_kms_funcs;
 	dev->mode_config.min_width = 1;
@@ -1465,6 +1533,9 @@ int vmw_kms_close(struct vmw_private *dev_priv)
 		vmw_kms_close_screen_object_display(dev_priv);
 	else
 		vmw_kms_close_legacy_display_system(dev_priv);
+
+	kfree(dev_priv->dirty_cmd);
+	kfree(dev_priv->dirty_rects);
 	return 0;
 }
 
@@ -1727,13 +1798,14 @@ int vmw_du_page_flip(struct drm_crtc *crtc,
 	clips.x2 = fb->width;
 	clips.y2 = fb->height;
 
+	mutex_lock(&dev_priv->dirty_mutex);
 	if (vfb->dmabuf)
 		ret = do_dmabuf_dirty_sou(file_priv, dev_priv, vfb,
 					  0, 0, &clips, 1, 1, &fence);
 	else
 		ret = do_surface_dirty_sou(dev_priv, file_priv, vfb,
 					   0, 0, &clips, 1, 1, &fence);
-
+	mutex_unlock(&dev_priv->dirty_mutex);
 
 	if (ret != 0)
 		goto out_no_fence;
@@ -30,9 +30,17 @@
 
 #include "drmP.h"
 #include "vmwgfx_drv.h"
+#include "vmwgfx_damage.h"
 
 #define VMWGFX_NUM_DISPLAY_UNITS 8
 
+/*
+ * Sizes of the preallocated dirty update scratch buffers. Larger updates
+ * fall back to a temporary allocation.
+ */
+#define VMWGFX_DIRTY_RECTS_SIZE (256 * sizeof(struct drm_clip_rect))
+#define VMWGFX_DIRTY_CMD_SIZE (16 * 1024)
+
 
 #define vmw_framebuffer_to_vfb(x) \
 	container_of(x, struct vmw_framebuffer, base)
@@ -26,6 +26,7 @@
  **************************************************************************/
 
 #include "vmwgfx_drv.h"
+#include "vmwgfx_mob.h"
 
 /*
  * If we set up the screen target otable, screen objects stop working.
@@ -34,41 +35,17 @@
 #define VMW_OTABLE_SETUP_SUB ((VMWGFX_ENABLE_SCREEN_TARGET_OTABLE) ? 0 : 1)
 
 #ifdef CONFIG_64BIT
-#define VMW_PPN_SIZE 8
 #define vmw_cmd_set_otable_base SVGA3dCmdSetOTableBase64
 #define VMW_ID_SET_OTABLE_BASE SVGA_3D_CMD_SET_OTABLE_BASE64
 #define vmw_cmd_define_gb_mob SVGA3dCmdDefineGBMob64
 #define VMW_ID_DEFINE_GB_MOB SVGA_3D_CMD_DEFINE_GB_MOB64
-#define VMW_MOBFMT_PTDEPTH_0 SVGA3D_MOBFMT_PTDEPTH64_0
-#define VMW_MOBFMT_PTDEPTH_1 SVGA3D_MOBFMT_PTDEPTH64_1
-#define VMW_MOBFMT_PTDEPTH_2 SVGA3D_MOBFMT_PTDEPTH64_2
 #else
-#define VMW_PPN_SIZE 4
 #define vmw_cmd_set_otable_base SVGA3dCmdSetOTableBase
 #define VMW_ID_SET_OTABLE_BASE SVGA_3D_CMD_SET_OTABLE_BASE
 #define vmw_cmd_define_gb_mob SVGA3dCmdDefineGBMob
 #define VMW_ID_DEFINE_GB_MOB SVGA_3D_CMD_DEFINE_GB_MOB
-#define VMW_MOBFMT_PTDEPTH_0 SVGA3D_MOBFMT_PTDEPTH_0
-#define VMW_MOBFMT_PTDEPTH_1 SVGA3D_MOBFMT_PTDEPTH_1
-#define VMW_MOBFMT_PTDEPTH_2 SVGA3D_MOBFMT_PTDEPTH_2
 #endif
 
-/*
- * struct vmw_mob - Structure containing page table and metadata for a
- * Guest Memory OBject.
- *
- * @num_pages       Number of pages that make up the page table.
- * @pt_level        The indirection level of the page table. 0-2.
- * @pt_root_page    DMA address of the level 0 page of the page table.
- */
-struct vmw_mob {
-	struct ttm_buffer_object *pt_bo;
-	unsigned long num_pages;
-	unsigned pt_level;
-	dma_addr_t pt_root_page;
-	uint32_t id;
-};
-
 /*
  * struct vmw_otable - Guest Memory OBject table metadata
  *
@@ -124,13 +101,9 @@ static int vmw_setup_otable_base(struct vmw_private *dev_priv,
 		return -ENOMEM;
 	}
 
-	if (otable->size <= PAGE_SIZE) {
-		mob->pt_level = VMW_MOBFMT_PTDEPTH_0;
-		mob->pt_root_page = vmw_piter_dma_addr(&iter);
-	} else if (vsgt->num_regions == 1) {
-		mob->pt_level = SVGA3D_MOBFMT_RANGE;
-		mob->pt_root_page = vmw_piter_dma_addr(&iter);
-	} else {
+	if (!vmw_mob_set_direct(mob, &iter, otable->size >> PAGE_SHIFT,
+				vmw_mob_is_contig(iter,
+						  otable->size >> PAGE_SHIFT))) {
 		ret = vmw_mob_pt_populate(dev_priv, mob);
 		if (unlikely(ret != 0))
 			goto out_no_populate;
@@ -380,6 +353,119 @@ struct vmw_mob *vmw_mob_create(unsigned long data_pages)
 	return mob;
 }
 
+/*
+ * vmw_mob_pt_pool_get - Take a page table buffer from the pool.
+ *
+ * @dev_priv:    Pointer to a device private.
+ * @num_pages:   Size of the page table buffer in pages.
+ *
+ * Returns a populated and DMA-mapped page table buffer of exactly
+ * @num_pages pages, or NULL if the pool has none. The buffer may still
+ * be in use by the device for a destroyed mob. vmw_mob_pt_setup() waits
+ * for that before writing to it.
+ */
+static struct ttm_buffer_object *
+vmw_mob_pt_pool_get(struct vmw_private *dev_priv, unsigned long num_pages)
+{
+	struct vmw_mob *entry, *pooled = NULL;
+	struct ttm_buffer_object *bo;
+	int order = ilog2(num_pages);
+
+	if (order >= VMW_PT_POOL_ORDERS)
+		return NULL;
+
+	spin_lock(&dev_priv->pt_pool_lock);
+	list_for_each_entry(entry, &dev_priv->pt_pool[order], pool_head) {
+		if (entry->num_pages == num_pages) {
+			list_del_init(&entry->pool_head);
+			dev_priv->pt_pool_pages -= num_pages;
+			pooled = entry;
+			break;
+		}
+	}
+	spin_unlock(&dev_priv->pt_pool_lock);
+
+	if (pooled == NULL)
+		return NULL;
+
+	bo = pooled->pt_bo;
+	kfree(pooled);
+
+	return bo;
+}
+
+/*
+ * vmw_mob_pt_pool_put - Put the page table buffer of a mob in the pool.
+ *
+ * @mob:         Pointer to a mob being destroyed.
+ *
+ * On success the mob is kept as a holder of its page table buffer and
+ * owned by the pool. Returns false if the pool has no room for it.
+ */
+static bool vmw_mob_pt_pool_put(struct vmw_mob *mob)
+{
+	struct vmw_private *dev_priv =
+		container_of(mob->pt_bo->bdev, struct vmw_private, bdev);
+	int order = ilog2(mob->num_pages);
+
+	if (order >= VMW_PT_POOL_ORDERS)
+		return false;
+
+	spin_lock(&dev_priv->pt_pool_lock);
+	if (dev_priv->pt_pool_pages + mob->num_pages >
+	    VMW_PT_POOL_MAX_PAGES) {
+		spin_unlock(&dev_priv->pt_pool_lock);
+		return false;
+	}
+	list_add_tail(&mob->pool_head, &dev_priv->pt_pool[order]);
+	dev_priv->pt_pool_pages += mob->num_pages;
+	spin_unlock(&dev_priv->pt_pool_lock);
+
+	return true;
+}
+
+/*
+ * vmw_mob_pt_pool_release - Free all pooled page table buffers.
+ *
+ * @dev_priv:    Pointer to a device private.
+ */
+void vmw_mob_pt_pool_release(struct vmw_private *dev_priv)
+{
+	struct vmw_mob *mob, *next;
+	struct list_head list;
+	int order;
+
+	INIT_LIST_HEAD(&list);
+	spin_lock(&dev_priv->pt_pool_lock);
+	for (order = 0; order < VMW_PT_POOL_ORDERS; ++order)
+		list_splice_init(&dev_priv->pt_pool[order], &list);
+	dev_priv->pt_pool_pages = 0;
+	spin_unlock(&dev_priv->pt_pool_lock);
+
+	list_for_each_entry_safe(mob, next, &list, pool_head) {
+		list_del_init(&mob->pool_head);
+		ttm_bo_unref(&mob->pt_bo);
+		kfree(mob);
+	}
+}
+
+/*
+ * vmw_mob_pt_pool_init - Initialize the page table buffer pool.
+ *
+ * @dev_priv:    Pointer to a device private.
+ */
+void vmw_mob_pt_pool_init(struct vmw_private *dev_priv)
+{
+	int order;
+
+	spin_lock_init(&dev_priv->pt_pool_lock);
+	for (order = 0; order < VMW_PT_POOL_ORDERS; ++order)
+		INIT_LIST_HEAD(&dev_priv->pt_pool[order]);
+	dev_priv->pt_pool_pages = 0;
+	atomic_set(&dev_priv->pt_pool_hits, 0);
+	atomic_set(&dev_priv->pt_pool_misses, 0);
+}
+
 /*
  * vmw_mob_pt_populate - Populate the mob pagetable
  *
@@ -397,6 +483,13 @@ static int vmw_mob_pt_populate(struct vmw_private *dev_priv,
 	int ret;
 	BUG_ON(mob->pt_bo != NULL);
 
+	mob->pt_bo = vmw_mob_pt_pool_get(dev_priv, mob->num_pages);
+	if (mob->pt_bo != NULL) {
+		atomic_inc(&dev_priv->pt_pool_hits);
+		return 0;
+	}
+	atomic_inc(&dev_priv->pt_pool_misses);
+
 	ret = ttm_bo_create(&dev_priv->bdev, mob->num_pages * PAGE_SIZE,
 			    ttm_bo_type_device,
 			    &vmw_sys_ne_placement,
@@ -519,6 +612,14 @@ static void vmw_mob_pt_setup(struct vmw_mob *mob,
 	ret = ttm_bo_reserve(bo, false, true, false, 0);
 	BUG_ON(ret != 0);
 
+	/*
+	 * When rebuilding a page table, make sure the device is done with
+	 * the previous mob using it.
+	 */
+	spin_lock(&bo->bdev->fence_lock);
+	(void) ttm_bo_wait(bo, false, false, false);
+	spin_unlock(&bo->bdev->fence_lock);
+
 	vsgt = vmw_bo_sg_table(bo);
 	vmw_piter_start(&pt_iter, vsgt, 0);
 	BUG_ON(!vmw_piter_next(&pt_iter));
@@ -541,11 +642,17 @@ static void vmw_mob_pt_setup(struct vmw_mob *mob,
  * vmw_mob_destroy - Destroy a mob, unpopulating first if necessary.
  *
  * @mob:            Pointer to a mob to destroy.
+ *
+ * The page table buffer, if any, is pooled for reuse by mobs of the same
+ * page table size.
  */
 void vmw_mob_destroy(struct vmw_mob *mob)
 {
-	if (mob->pt_bo)
+	if (mob->pt_bo) {
+		if (vmw_mob_pt_pool_put(mob))
+			return;
 		ttm_bo_unref(&mob->pt_bo);
+	}
 	kfree(mob);
 }
 
@@ -624,12 +731,9 @@ int vmw_mob_bind(struct vmw_private *dev_priv,
 	if (unlikely(!vmw_piter_next(&data_iter)))
 		return 0;
 
-	if (likely(num_data_pages == 1)) {
-		mob->pt_level = VMW_MOBFMT_PTDEPTH_0;
-		mob->pt_root_page = vmw_piter_dma_addr(&data_iter);
-	} else if (vsgt->num_regions == 1) {
-		mob->pt_level = SVGA3D_MOBFMT_RANGE;
-		mob->pt_root_page = vmw_piter_dma_addr(&data_iter);
+	if (vmw_mob_set_direct(mob, &data_iter, num_data_pages,
+			       vsgt->num_regions == 1)) {
+		/* No page table needed. */
 	} else if (unlikely(mob->pt_bo == NULL)) {
 		ret = vmw_mob_pt_populate(dev_priv, mob);
 		if (unlikely(ret != 0))
@@ -638,6 +742,16 @@ int vmw_mob_bind(struct vmw_private *dev_priv,
 		vmw_mob_pt_setup(mob, data_iter, num_data_pages);
 		pt_set_up = true;
 		mob->pt_level += VMW_MOBFMT_PTDEPTH_1 - SVGA3D_MOBFMT_PTDEPTH_1;
+	} else if (dev_priv->map_mode == vmw_dma_map_bind ||
+		   mob->pt_level == VMW_MOBFMT_PTDEPTH_0 ||
+		   mob->pt_level == SVGA3D_MOBFMT_RANGE) {
+		/*
+		 * The data pages may have been remapped since the page table
+		 * was last built. Rebuild it in place, reusing the page
+		 * table buffer object, which is sized for this mob.
+		 */
+		vmw_mob_pt_setup(mob, data_iter, num_data_pages);
+		mob->pt_level += VMW_MOBFMT_PTDEPTH_1 - SVGA3D_MOBFMT_PTDEPTH_1;
 	}
 
 	(void) vmw_3d_resource_inc(dev_priv, false);
@@ -0,0 +1,125 @@
+/**************************************************************************
+ *
+ * Copyright © 2012 VMware, Inc., Palo Alto, CA., USA
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sub license, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial portions
+ * of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT. IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDERS, AUTHORS AND/OR ITS SUPPLIERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ **************************************************************************/
+
+#ifndef _VMWGFX_MOB_H_
+#define _VMWGFX_MOB_H_
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <asm/page.h>
+#include "vmwgfx_reg.h"
+#include "vmwgfx_piter.h"
+
+#ifdef CONFIG_64BIT
+#define VMW_PPN_SIZE 8
+#define VMW_MOBFMT_PTDEPTH_0 SVGA3D_MOBFMT_PTDEPTH64_0
+#define VMW_MOBFMT_PTDEPTH_1 SVGA3D_MOBFMT_PTDEPTH64_1
+#define VMW_MOBFMT_PTDEPTH_2 SVGA3D_MOBFMT_PTDEPTH64_2
+#else
+#define VMW_PPN_SIZE 4
+#define VMW_MOBFMT_PTDEPTH_0 SVGA3D_MOBFMT_PTDEPTH_0
+#define VMW_MOBFMT_PTDEPTH_1 SVGA3D_MOBFMT_PTDEPTH_1
+#define VMW_MOBFMT_PTDEPTH_2 SVGA3D_MOBFMT_PTDEPTH_2
+#endif
+
+struct ttm_buffer_object;
+
+/*
+ * struct vmw_mob - Structure containing page table and metadata for a
+ * Guest Memory OBject.
+ *
+ * @num_pages       Number of pages that make up the page table.
+ * @pt_level        The indirection level of the page table. 0-2.
+ * @pt_root_page    DMA address of the level 0 page of the page table.
+ * @pool_head       List head for the page table buffer pool, used
+ *                  while the mob is only a holder of a pooled page table
+ *                  buffer.
+ */
+struct vmw_mob {
+	struct ttm_buffer_object *pt_bo;
+	unsigned long num_pages;
+	unsigned pt_level;
+	dma_addr_t pt_root_page;
+	uint32_t id;
+	struct list_head pool_head;
+};
+
+/*
+ * vmw_mob_is_contig - Check whether a range of data pages is contiguous
+ * in device address space.
+ *
+ * @iter:      Page iterator pointing to the first page of the range.
+ * @num_pages: Number of pages in the range.
+ *
+ * The iterator is passed by value and left untouched for the caller.
+ */
+static inline bool vmw_mob_is_contig(struct vmw_piter iter,
+				     unsigned long num_pages)
+{
+	dma_addr_t next = vmw_piter_dma_addr(&iter) + PAGE_SIZE;
+
+	while (--num_pages) {
+		if (!vmw_piter_next(&iter) ||
+		    vmw_piter_dma_addr(&iter) != next)
+			return false;
+		next += PAGE_SIZE;
+	}
+
+	return true;
+}
+
+/*
+ * vmw_mob_set_direct - Describe a mob without a page table if possible.
+ *
+ * @mob:            Pointer to the mob.
+ * @data_iter:      Page iterator pointing to the first data page.
+ * @num_data_pages: Number of data pages.
+ * @contig:         Whether the data pages are contiguous in device
+ *                  address space.
+ *
+ * A single data page is described by a depth 0 table, and a single
+ * contiguous run of data pages by a range, neither of which needs any
+ * page table memory. Returns true and sets up @mob accordingly if
+ * either applies, false if the caller needs to build a page table.
+ */
+static inline bool vmw_mob_set_direct(struct vmw_mob *mob,
+				      struct vmw_piter *data_iter,
+				      unsigned long num_data_pages,
+				      bool contig)
+{
+	if (num_data_pages == 1)
+		mob->pt_level = VMW_MOBFMT_PTDEPTH_0;
+	else if (contig)
+		mob->pt_level = SVGA3D_MOBFMT_RANGE;
+	else
+		return false;
+
+	mob->pt_root_page = vmw_piter_dma_addr(data_iter);
+	return true;
+}
+
+#endif
@@ -33,6 +33,8 @@
 #include "vmwgfx_resource_priv.h"
 
 #define VMW_RES_EVICT_ERR_COUNT 10
+#define VMW_RES_EVICT_SCAN 16
+#define VMW_RES_EVICT_BATCH_MAX 16
 
 struct vmw_user_dma_buffer {
 	struct ttm_prime_object prime;
@@ -113,6 +115,46 @@ void vmw_resource_release_id(struct vmw_resource *res)
 	write_unlock(&dev_priv->resource_lock);
 }
 
+/**
+ * vmw_resource_backup_put - Drop the backup buffer of a resource, caching
+ *                           it for reuse if possible.
+ *
+ * @res:            The resource whose backup buffer to drop.
+ *
+ * Only kernel-allocated backup buffers that nobody else references are
+ * cached. Their contents is cleared on reuse.
+ */
+static void vmw_resource_backup_put(struct vmw_resource *res)
+{
+	struct vmw_private *dev_priv = res->dev_priv;
+	struct vmw_dma_buffer *backup = res->backup;
+	struct ttm_buffer_object *bo = &backup->base;
+	unsigned long num_pages = bo->num_pages;
+	int order = ilog2(num_pages);
+
+	if (bo->destroy != &vmw_dmabuf_bo_free ||
+	    atomic_read(&bo->kref.refcount) != 1 ||
+	    order >= VMW_BACKUP_POOL_ORDERS)
+		goto out_unref;
+
+	spin_lock(&dev_priv->backup_pool_lock);
+	if (dev_priv->backup_pool_pages + num_pages >
+	    VMW_BACKUP_POOL_MAX_PAGES) {
+		spin_unlock(&dev_priv->backup_pool_lock);
+		goto out_unref;
+	}
+	backup->pool_placement = res->func->backup_placement;
+	list_add_tail(&backup->pool_head, &dev_priv->backup_pool[order]);
+	dev_priv->backup_pool_pages += num_pages;
+	spin_unlock(&dev_priv->backup_pool_lock);
+
+	res->backup = NULL;
+	return;
+
+out_unref:
+	vmw_dmabuf_unreference(&res->backup);
+}
+
 static void vmw_resource_release(struct kref *kref)
 {
 	struct vmw_resource *res =
@@ -122,7 +164,9 @@ static void vmw_resource_release(struct kref *kref)
 	struct idr *idr = &dev_priv->res_idr[res->func->res_type];
 
 	res->avail = false;
+	spin_lock(&dev_priv->res_lru_lock[res->func->res_type]);
 	list_del_init(&res->lru_head);
+	spin_unlock(&dev_priv->res_lru_lock[res->func->res_type]);
 	write_unlock(&dev_priv->resource_lock);
 	if (res->backup) {
 		struct ttm_buffer_object *bo = &res->backup->base;
@@ -141,7 +185,7 @@ static void vmw_resource_release(struct kref *kref)
 		res->backup_dirty = false;
 		list_del_init(&res->mob_head);
 		ttm_bo_unreserve(bo);
-		vmw_dmabuf_unreference(&res->backup);
+		vmw_resource_backup_put(res);
 	}
 
 	if (likely(res->hw_destroy != NULL)) {
@@ -163,12 +207,23 @@ static void vmw_resource_release(struct kref *kref)
 		idr_remove(idr, id);
 }
 
+/**
+ * vmw_resource_unreference - Drop a resource reference.
+ *
+ * @p_res: Pointer to the resource pointer. Cleared on return.
+ *
+ * Only the final put needs to exclude id lookups, so references that
+ * are not the last one are dropped without taking the resource lock.
+ */
 void vmw_resource_unreference(struct vmw_resource **p_res)
 {
 	struct vmw_resource *res = *p_res;
 	struct vmw_private *dev_priv = res->dev_priv;
 
 	*p_res = NULL;
+	if (likely(atomic_add_unless(&res->kref.refcount, -1, 1)))
+		return;
+
 	write_lock(&dev_priv->resource_lock);
 	kref_put(&res->kref, vmw_resource_release);
 	write_unlock(&dev_priv->resource_lock);
@@ -317,6 +372,8 @@ struct vmw_resource *vmw_resource_lookup(struct vmw_private *dev_priv,
  *
  * If the handle can't be found or is associated with an incorrect resource
  * type, -EINVAL will be returned.
+ * The base object reference held during the lookup keeps the resource
+ * alive, so no resource lock is needed to take the resource reference.
  */
 int vmw_user_resource_lookup_handle(struct vmw_private *dev_priv,
 				    struct ttm_object_file *tfile,
@@ -338,14 +395,10 @@ int vmw_user_resource_lookup_handle(struct vmw_private *dev_priv,
 
 	res = converter->base_obj_to_res(base);
 
-	read_lock(&dev_priv->resource_lock);
-	if (!res->avail || res->res_free != converter->res_free) {
-		read_unlock(&dev_priv->resource_lock);
+	if (!ACCESS_ONCE(res->avail) || res->res_free != converter->res_free)
 		goto out_bad_resource;
-	}
 
 	kref_get(&res->kref);
-	read_unlock(&dev_priv->resource_lock);
 
 	*p_res = res;
 	ret = 0;
@@ -452,6 +505,7 @@ int vmw_dmabuf_init(struct vmw_private *dev_priv,
 	acc_size = vmw_dmabuf_acc_size(dev_priv, size, user);
 	memset(vmw_bo, 0, sizeof(*vmw_bo));
 	INIT_LIST_HEAD(&vmw_bo->res_list);
+	INIT_LIST_HEAD(&vmw_bo->pool_head);
 	vmw_bo->base.glob = bdev->glob;
 
 	ret = ttm_mem_global_alloc(mem_glob, acc_size, false, false);
@@ -1090,6 +1144,174 @@ int vmw_dumb_destroy(struct drm_file *file_priv,
 					 handle, TTM_REF_USAGE);
 }
 
+/**
+ * vmw_resource_backup_get - Take an idle buffer from the backup buffer
+ *                           cache.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ * @num_pages:      Required size of the buffer in pages.
+ * @placement:      Required backup placement.
+ * @interruptible:  Whether to sleep interruptible.
+ *
+ * Returns a cleared buffer, or NULL if there is no compatible idle buffer
+ * in the cache.
+ */
+static struct vmw_dma_buffer *
+vmw_resource_backup_get(struct vmw_private *dev_priv,
+			unsigned long num_pages,
+			struct ttm_placement *placement,
+			bool interruptible)
+{
+	struct vmw_dma_buffer *backup = NULL, *entry;
+	struct ttm_buffer_object *bo;
+	struct ttm_bo_kmap_obj map;
+	bool is_iomem;
+	void *virtual;
+	int order = ilog2(num_pages);
+	int ret;
+
+	if (order >= VMW_BACKUP_POOL_ORDERS)
+		return NULL;
+
+	spin_lock(&dev_priv->backup_pool_lock);
+	list_for_each_entry(entry, &dev_priv->backup_pool[order], pool_head) {
+		if (entry->base.num_pages == num_pages &&
+		    entry->pool_placement == placement) {
+			list_del_init(&entry->pool_head);
+			dev_priv->backup_pool_pages -= num_pages;
+			backup = entry;
+			break;
+		}
+	}
+	spin_unlock(&dev_priv->backup_pool_lock);
+
+	if (backup == NULL)
+		return NULL;
+
+	bo = &backup->base;
+	spin_lock(&bo->bdev->fence_lock);
+	ret = ttm_bo_wait(bo, false, false, true);
+	spin_unlock(&bo->bdev->fence_lock);
+
+	if (ret != 0) {
+		/* Still busy. Put it back at the tail. */
+		spin_lock(&dev_priv->backup_pool_lock);
+		list_add_tail(&backup->pool_head,
+			      &dev_priv->backup_pool[order]);
+		dev_priv->backup_pool_pages += num_pages;
+		spin_unlock(&dev_priv->backup_pool_lock);
+		return NULL;
+	}
+
+	/*
+	 * Clear the previous owner's contents, since the device may
+	 * read the backup as initial resource contents.
+	 */
+	ret = ttm_bo_reserve(bo, interruptible, false, false, 0);
+	if (unlikely(ret != 0))
+		goto out_unref;
+
+	ret = ttm_bo_kmap(bo, 0, num_pages, &map);
+	if (likely(ret == 0)) {
+		virtual = ttm_kmap_obj_virtual(&map, &is_iomem);
+		if (is_iomem)
+			memset_io((void __iomem *) virtual, 0,
+				  num_pages << PAGE_SHIFT);
+		else
+			memset(virtual, 0, num_pages << PAGE_SHIFT);
+		ttm_bo_kunmap(&map);
+	}
+	ttm_bo_unreserve(bo);
+
+	if (unlikely(ret != 0))
+		goto out_unref;
+
+	return backup;
+
+out_unref:
+	vmw_dmabuf_unreference(&backup);
+	return NULL;
+}
+
+/**
+ * vmw_resource_backup_pool_release - Empty the backup buffer cache.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ */
+void vmw_resource_backup_pool_release(struct vmw_private *dev_priv)
+{
+	struct vmw_dma_buffer *backup, *next;
+	struct list_head list;
+	int order;
+
+	INIT_LIST_HEAD(&list);
+	spin_lock(&dev_priv->backup_pool_lock);
+	for (order = 0; order < VMW_BACKUP_POOL_ORDERS; ++order)
+		list_splice_init(&dev_priv->backup_pool[order], &list);
+	dev_priv->backup_pool_pages = 0;
+	spin_unlock(&dev_priv->backup_pool_lock);
+
+	list_for_each_entry_safe(backup, next, &list, pool_head) {
+		list_del_init(&backup->pool_head);
+		vmw_dmabuf_unreference(&backup);
+	}
+}
+
+/**
+ * vmw_resource_backup_pool_work - Worker emptying the backup buffer cache.
+ *
+ * @work:           The backup_pool_work member of a struct vmw_private.
+ */
+static void vmw_resource_backup_pool_work(struct work_struct *work)
+{
+	struct vmw_private *dev_priv =
+		container_of(work, struct vmw_private, backup_pool_work);
+
+	vmw_resource_backup_pool_release(dev_priv);
+}
+
+/**
+ * vmw_resource_backup_pool_init - Initialize the backup buffer cache.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ */
+void vmw_resource_backup_pool_init(struct vmw_private *dev_priv)
+{
+	int order;
+
+	spin_lock_init(&dev_priv->backup_pool_lock);
+	for (order = 0; order < VMW_BACKUP_POOL_ORDERS; ++order)
+		INIT_LIST_HEAD(&dev_priv->backup_pool[order]);
+	dev_priv->backup_pool_pages = 0;
+	INIT_WORK(&dev_priv->backup_pool_work,
+		  vmw_resource_backup_pool_work);
+}
+
+/**
+ * vmw_resource_swap_notify - TTM swap_notify callback for resources.
+ *
+ * @bo:             The TTM buffer object about to be swapped out.
+ *
+ * The TTM shrinker swapping out a cached backup buffer means there is
+ * memory pressure, so schedule emptying the backup buffer cache.
+ */
+void vmw_resource_swap_notify(struct ttm_buffer_object *bo)
+{
+	struct vmw_private *dev_priv =
+		container_of(bo->bdev, struct vmw_private, bdev);
+	bool pooled;
+
+	if (bo->destroy != &vmw_dmabuf_bo_free)
+		return;
+
+	spin_lock(&dev_priv->backup_pool_lock);
+	pooled = !list_empty(&vmw_dma_buffer(bo)->pool_head);
+	spin_unlock(&dev_priv->backup_pool_lock);
+
+	if (pooled)
+		(void) schedule_work(&dev_priv->backup_pool_work);
+}
+
 /**
  * vmw_resource_buf_alloc - Allocate a backup buffer for a resource.
  *
@@ -1110,6 +1332,14 @@ static int vmw_resource_buf_alloc(struct vmw_resource *res,
 		return 0;
 	}
 
+	backup = vmw_resource_backup_get(res->dev_priv, size >> PAGE_SHIFT,
+					 res->func->backup_placement,
+					 interruptible);
+	if (backup) {
+		res->backup = backup;
+		return 0;
+	}
+
 	backup = kzalloc(sizeof(*backup), GFP_KERNEL);
 	if (unlikely(backup == NULL))
 		return -ENOMEM;
@@ -1178,22 +1408,28 @@ out_bind_failed:
 }
 
 /**
- * vmw_resource_unreserve - Unreserve a resource previously reserved for
- * command submission.
+ * vmw_resource_unreserve_deferred - Unreserve a resource previously reserved
+ * for command submission, deferring the lru list update.
  *
  * @res:               Pointer to the struct vmw_resource to unreserve.
  * @new_backup:        Pointer to new backup buffer if command submission
  *                     switched.
  * @new_backup_offset: New backup offset if @new_backup is !NULL.
+ * @lru_batch:         Array of vmw_res_max list heads. If the resource is
+ *                     evictable it is queued on the list of its type.
  *
- * Currently unreserving a resource means putting it back on the device's
- * resource lru list, so that it can be evicted if necessary.
+ * The caller must hold a reference on the resource until the queued
+ * resources have been moved to the device lru lists using
+ * vmw_resource_lru_splice().
+ * Must be called with the cmdbuf mutex held, since @res::lru_head is
+ * checked and queued without the lru lock.
  */
-void vmw_resource_unreserve(struct vmw_resource *res,
-			    struct vmw_dma_buffer *new_backup,
-			    unsigned long new_backup_offset)
+void vmw_resource_unreserve_deferred(struct vmw_resource *res,
+				     struct vmw_dma_buffer *new_backup,
+				     unsigned long new_backup_offset,
+				     struct list_head *lru_batch)
 {
-	struct vmw_private *dev_priv = res->dev_priv;
+	lockdep_assert_held(&res->dev_priv->cmdbuf_mutex);
 
 	if (!list_empty(&res->lru_head))
 		return;
@@ -1216,10 +1452,63 @@ void vmw_resource_unreserve(struct vmw_resource *res,
 	if (!res->func->may_evict || res->id == -1 || res->pin_count)
 		return;
 
-	write_lock(&dev_priv->resource_lock);
-	list_add_tail(&res->lru_head,
-		      &res->dev_priv->res_lru[res->func->res_type]);
-	write_unlock(&dev_priv->resource_lock);
+	list_add_tail(&res->lru_head, &lru_batch[res->func->res_type]);
+}
+
+/**
+ * vmw_resource_lru_splice - Move resources queued by
+ * vmw_resource_unreserve_deferred() to the device lru lists.
+ *
+ * @dev_priv:          Pointer to a device private struct.
+ * @lru_batch:         Array of vmw_res_max list heads. Empty on return.
+ *
+ * Each lru list lock is taken at most once, regardless of the number
+ * of resources queued. Must be called with the cmdbuf mutex held.
+ */
+void vmw_resource_lru_splice(struct vmw_private *dev_priv,
+			     struct list_head *lru_batch)
+{
+	enum vmw_res_type type;
+
+	lockdep_assert_held(&dev_priv->cmdbuf_mutex);
+
+	for (type = vmw_res_context; type < vmw_res_max; ++type) {
+		if (list_empty(&lru_batch[type]))
+			continue;
+
+		spin_lock(&dev_priv->res_lru_lock[type]);
+		list_splice_tail_init(&lru_batch[type],
+				      &dev_priv->res_lru[type]);
+		spin_unlock(&dev_priv->res_lru_lock[type]);
+	}
+}
+
+/**
+ * vmw_resource_unreserve - Unreserve a resource previously reserved for
+ * command submission.
+ *
+ * @res:               Pointer to the struct vmw_resource to unreserve.
+ * @new_backup:        Pointer to new backup buffer if command submission
+ *                     switched.
+ * @new_backup_offset: New backup offset if @new_backup is !NULL.
+ *
+ * Currently unreserving a resource means putting it back on the device's
+ * resource lru list, so that it can be evicted if necessary.
+ * Must be called with the cmdbuf mutex held.
+ */
+void vmw_resource_unreserve(struct vmw_resource *res,
+			    struct vmw_dma_buffer *new_backup,
+			    unsigned long new_backup_offset)
+{
+	struct list_head lru_batch[vmw_res_max];
+	enum vmw_res_type type;
+
+	for (type = vmw_res_context; type < vmw_res_max; ++type)
+		INIT_LIST_HEAD(&lru_batch[type]);
+
+	vmw_resource_unreserve_deferred(res, new_backup, new_backup_offset,
+					lru_batch);
+	vmw_resource_lru_splice(res->dev_priv, lru_batch);
 }
 
 /**
@@ -1287,16 +1576,21 @@ out_no_reserve:
  * This function takes the resource off the LRU list and make sure
  * a backup buffer is present for guest-backed resources. However,
  * the buffer may not be bound to the resource at this point.
- *
+ * Must be called with the cmdbuf mutex held. Since resources are only
+ * put on the LRU lists under that mutex, an empty lru head can be
+ * trusted without taking the lru lock.
  */
 int vmw_resource_reserve(struct vmw_resource *res, bool no_backup)
 {
 	struct vmw_private *dev_priv = res->dev_priv;
+	spinlock_t *lru_lock = &dev_priv->res_lru_lock[res->func->res_type];
 	int ret;
 
-	write_lock(&dev_priv->resource_lock);
-	list_del_init(&res->lru_head);
-	write_unlock(&dev_priv->resource_lock);
+	if (!list_empty(&res->lru_head)) {
+		spin_lock(lru_lock);
+		list_del_init(&res->lru_head);
+		spin_unlock(lru_lock);
+	}
 
 	if (res->func->needs_backup && res->backup == NULL &&
 	    !no_backup) {
@@ -1355,6 +1649,12 @@ int vmw_resource_do_evict(struct vmw_resource *res, bool interruptible)
 		list_del_init(&res->mob_head);
 	}
 	ret = func->destroy(res);
+	if (likely(ret == 0)) {
+		atomic_inc(&res->dev_priv->res_evictions[func->res_type]);
+		if (res->res_dirty)
+			atomic_inc(&res->dev_priv->res_readbacks
+				   [func->res_type]);
+	}
 	res->backup_dirty = true;
 	res->res_dirty = false;
 out_no_unbind:
@@ -1364,6 +1664,65 @@ out_no_unbind:
 }
 
 
+/**
+ * vmw_resource_evict_cost - The cost of evicting a resource under the
+ *                           current eviction policy.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ * @res:            The eviction candidate.
+ *
+ * Clean resources need no readback and are always cheapest.
+ */
+static unsigned long vmw_resource_evict_cost(struct vmw_private *dev_priv,
+					     struct vmw_resource *res)
+{
+	if (!res->res_dirty)
+		return 0;
+
+	if (dev_priv->evict_policy == vmw_evict_size_weighted)
+		return res->backup_size;
+
+	return 1;
+}
+
+/**
+ * vmw_resource_evict_pick - Pick a resource to evict.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ * @lru_list:       Non-empty lru list to pick from.
+ *
+ * Must be called with the lru lock of the list held.
+ * Except for the plain LRU policy, the first VMW_RES_EVICT_SCAN resources
+ * on the lru list are considered, and the cheapest one to evict is picked.
+ * Ties are resolved in LRU order.
+ */
+static struct vmw_resource *
+vmw_resource_evict_pick(struct vmw_private *dev_priv,
+			struct list_head *lru_list)
+{
+	struct vmw_resource *res, *best = NULL;
+	unsigned long cost, best_cost = 0;
+	unsigned int scanned = 0;
+
+	if (dev_priv->evict_policy == vmw_evict_lru)
+		return list_first_entry(lru_list, struct vmw_resource,
+					lru_head);
+
+	list_for_each_entry(res, lru_list, lru_head) {
+		cost = vmw_resource_evict_cost(dev_priv, res);
+		if (best == NULL || cost < best_cost) {
+			best = res;
+			best_cost = cost;
+			if (cost == 0)
+				break;
+		}
+		if (++scanned == VMW_RES_EVICT_SCAN)
+			break;
+	}
+
+	return best;
+}
+
 /**
  * vmw_resource_validate - Make a resource up-to-date and visible
  *                         to the device.
@@ -1372,8 +1731,13 @@ out_no_unbind:
  *
  * On succesful return, any backup DMA buffer pointed to by @res->backup will
  * be reserved and validated.
+ * Create and bind commands are committed without flushing, so that they
+ * are submitted together with the caller's next command batch. Callers
+ * not submitting commands must call vmw_fifo_flush().
  * On hardware resource shortage, this function will repeatedly evict
- * resources of the same type until the validation succeeds.
+ * resources of the same type until the validation succeeds. The number
+ * of resources evicted between validation attempts doubles with each
+ * failed attempt, up to VMW_RES_EVICT_BATCH_MAX.
  */
 int vmw_resource_validate(struct vmw_resource *res)
 {
@@ -1381,14 +1745,20 @@ int vmw_resource_validate(struct vmw_resource *res)
 	struct vmw_resource *evict_res;
 	struct vmw_private *dev_priv = res->dev_priv;
 	struct list_head *lru_list = &dev_priv->res_lru[res->func->res_type];
+	spinlock_t *lru_lock = &dev_priv->res_lru_lock[res->func->res_type];
 	struct ttm_validate_buffer val_buf;
 	unsigned err_count = 0;
+	unsigned int batch = 1;
+	unsigned int i;
 
 	if (likely(!res->func->may_evict))
 		return 0;
 
+	if (res->id != -1)
+		atomic_inc(&dev_priv->res_hits[res->func->res_type]);
+
 	val_buf.bo = NULL;
-	if (res->backup) {
+	if (res->backup && !vmw_resource_backup_retained(res)) {
 		val_buf.bo = &res->backup->base;
 		val_buf.new_sync_obj_arg = (void *)(unsigned long)
 			DRM_VMW_FENCE_FLAG_EXEC;
@@ -1398,40 +1768,55 @@ int vmw_resource_validate(struct vmw_resource *res)
 		if (likely(ret != -EBUSY))
 			break;
 
-		write_lock(&dev_priv->resource_lock);
-		if (list_empty(lru_list) || !res->func->may_evict) {
-			DRM_ERROR("Out of device device resources "
-				  "for %s.\n", res->func->type_name);
-			ret = -EBUSY;
-			write_unlock(&dev_priv->resource_lock);
-			break;
-		}
-
-		evict_res = vmw_resource_reference
-			(list_first_entry(lru_list, struct vmw_resource,
-					  lru_head));
-		list_del_init(&evict_res->lru_head);
-
-		write_unlock(&dev_priv->resource_lock);
-
-		ret = vmw_resource_do_evict(evict_res, true);
-		if (unlikely(ret != 0)) {
-			write_lock(&dev_priv->resource_lock);
-			list_add_tail(&evict_res->lru_head, lru_list);
-			write_unlock(&dev_priv->resource_lock);
-			if (ret == -ERESTARTSYS ||
-			    ++err_count > VMW_RES_EVICT_ERR_COUNT) {
-				vmw_resource_unreference(&evict_res);
+		for (i = 0; i < batch; ++i) {
+			spin_lock(lru_lock);
+			do {
+				if (list_empty(lru_list) ||
+				    !res->func->may_evict) {
+					evict_res = NULL;
+					break;
+				}
+				evict_res = vmw_resource_evict_pick(dev_priv,
+								   lru_list);
+				list_del_init(&evict_res->lru_head);
+				evict_res = vmw_resource_reference_unless_doomed
+					(evict_res);
+			} while (evict_res == NULL);
+			spin_unlock(lru_lock);
+
+			if (evict_res == NULL) {
+				if (i != 0)
+					break;
+
+				DRM_ERROR("Out of device device resources "
+					  "for %s.\n", res->func->type_name);
+				ret = -EBUSY;
 				goto out_no_validate;
 			}
+
+			ret = vmw_resource_do_evict(evict_res, true);
+			if (unlikely(ret != 0)) {
+				spin_lock(lru_lock);
+				list_add_tail(&evict_res->lru_head, lru_list);
+				spin_unlock(lru_lock);
+				if (ret == -ERESTARTSYS ||
+				    ++err_count > VMW_RES_EVICT_ERR_COUNT) {
+					vmw_resource_unreference(&evict_res);
+					goto out_no_validate;
+				}
+			}
+
+			vmw_resource_unreference(&evict_res);
 		}
 
-		vmw_resource_unreference(&evict_res);
+		if (batch < VMW_RES_EVICT_BATCH_MAX)
+			batch <<= 1;
 	} while (1);
 
 	if (unlikely(ret != 0))
 		goto out_no_validate;
-	else if (!res->func->needs_backup && res->backup) {
+	else if (!res->func->needs_backup && !res->func->keep_backup &&
+		 res->backup) {
 		list_del_init(&res->mob_head);
 		vmw_dmabuf_unreference(&res->backup);
 	}
@@ -1540,6 +1925,21 @@ void vmw_resource_move_notify(struct ttm_buffer_object *bo,
 	}
 }
 
+/**
+ * vmw_resource_backup_retained - Return whether a resource is resident on
+ * the device while retaining its backup buffer.
+ *
+ * @res:            The resource being queried.
+ *
+ * A retained backup buffer isn't accessed by the device until the resource
+ * is evicted, so it needn't be reserved or validated when the resource is
+ * used.
+ */
+bool vmw_resource_backup_retained(const struct vmw_resource *res)
+{
+	return res->func->keep_backup && res->id != -1 && res->backup != NULL;
+}
+
 /**
  * vmw_resource_needs_backup - Return whether a resource needs a backup buffer.
  *
@@ -1563,27 +1963,33 @@ static void vmw_resource_evict_type(struct vmw_private *dev_priv,
 				    enum vmw_res_type type)
 {
 	struct list_head *lru_list = &dev_priv->res_lru[type];
+	spinlock_t *lru_lock = &dev_priv->res_lru_lock[type];
 	struct vmw_resource *evict_res;
 	unsigned err_count = 0;
 	int ret;
 
 	do {
-		write_lock(&dev_priv->resource_lock);
-
-		if (list_empty(lru_list))
-			goto out_unlock;
+		spin_lock(lru_lock);
+		do {
+			if (list_empty(lru_list)) {
+				spin_unlock(lru_lock);
+				return;
+			}
 
-		evict_res = vmw_resource_reference(
-			list_first_entry(lru_list, struct vmw_resource,
-					 lru_head));
-		list_del_init(&evict_res->lru_head);
-		write_unlock(&dev_priv->resource_lock);
+			evict_res = list_first_entry(lru_list,
+						     struct vmw_resource,
+						     lru_head);
+			list_del_init(&evict_res->lru_head);
+			evict_res = vmw_resource_reference_unless_doomed
+				(evict_res);
+		} while (evict_res == NULL);
+		spin_unlock(lru_lock);
 
 		ret = vmw_resource_do_evict(evict_res, false);
 		if (unlikely(ret != 0)) {
-			write_lock(&dev_priv->resource_lock);
+			spin_lock(lru_lock);
 			list_add_tail(&evict_res->lru_head, lru_list);
-			write_unlock(&dev_priv->resource_lock);
+			spin_unlock(lru_lock);
 			if (++err_count > VMW_RES_EVICT_ERR_COUNT) {
 				vmw_resource_unreference(&evict_res);
 				return;
@@ -1592,9 +1998,6 @@ static void vmw_resource_evict_type(struct vmw_private *dev_priv,
 
 		vmw_resource_unreference(&evict_res);
 	} while (1);
-
-out_unlock:
-	write_unlock(&dev_priv->resource_lock);
 }
 
 /**
@@ -1616,6 +2019,7 @@ void vmw_resource_evict_all(struct vmw_private *dev_priv)
 	for (type = 0; type < vmw_res_max; ++type)
 		vmw_resource_evict_type(dev_priv, type);
 
+	vmw_resource_backup_pool_release(dev_priv);
 	mutex_unlock(&dev_priv->cmdbuf_mutex);
 }
 
@@ -1661,6 +2065,9 @@ int vmw_resource_pin(struct vmw_resource *res)
 			ttm_bo_unreserve(bo);
 		if (ret)
 			goto out_no_validate;
+
+		/* Not followed by a command submission. */
+		vmw_fifo_flush(dev_priv);
 	}
 	res->pin_count++;
 	
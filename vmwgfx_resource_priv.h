@@ -50,6 +50,10 @@ struct vmw_user_resource_conv {
  * @type_name:         String that identifies the resource type.
  * @backup_placement:  TTM placement for backup buffers.
  * @may_evict          Whether the resource may be evicted.
+ * @keep_backup:       Whether a resource that isn't guest-backed keeps
+ *                     its backup buffer after having been restored from it.
+ *                     The buffer isn't validated while the resource is
+ *                     resident, and may be dropped under memory pressure.
  * @create:            Create a hardware resource.
  * @destroy:           Destroy a hardware resource.
  * @bind:              Bind a hardware resource to persistent buffer storage.
@@ -63,6 +67,7 @@ struct vmw_res_func {
 	const char *type_name;
 	struct ttm_placement *backup_placement;
 	bool may_evict;
+	bool keep_backup;
 
 	int (*create) (struct vmw_resource *res);
 	int (*destroy) (struct vmw_resource *res);
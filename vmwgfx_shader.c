@@ -164,7 +164,7 @@ static int vmw_gb_shader_create(struct vmw_resource *res)
 	cmd->body.shid = res->id;
 	cmd->body.type = shader->type;
 	cmd->body.sizeInBytes = shader->size;
-	vmw_fifo_commit(dev_priv, sizeof(*cmd));
+	vmw_fifo_commit_noflush(dev_priv, sizeof(*cmd));
 	(void) vmw_3d_resource_inc(dev_priv, false);
 
 	return 0;
@@ -200,7 +200,7 @@ static int vmw_gb_shader_bind(struct vmw_resource *res,
 	cmd->body.mobid = bo->mem.start;
 	cmd->body.offsetInBytes = res->backup_offset;
 	res->backup_dirty = false;
-	vmw_fifo_commit(dev_priv, sizeof(*cmd));
+	vmw_fifo_commit_noflush(dev_priv, sizeof(*cmd));
 
 	return 0;
 }
@@ -230,7 +230,7 @@ static int vmw_gb_shader_unbind(struct vmw_resource *res,
 	cmd->body.shid = res->id;
 	cmd->body.mobid = SVGA3D_INVALID_ID;
 	cmd->body.offsetInBytes = 0;
-	vmw_fifo_commit(dev_priv, sizeof(*cmd));
+	vmw_fifo_commit_noflush(dev_priv, sizeof(*cmd));
 
 	/*
 	 * Create a fence object and fence the backup buffer.
@@ -337,6 +337,26 @@ int vmw_shader_destroy_ioctl(struct drm_device *dev, void *data,
 					 TTM_REF_USAGE);
 }
 
+/**
+ * vmw_shader_acc_size - Graphics memory accounted per user shader.
+ */
+uint64_t vmw_shader_acc_size(void)
+{
+	/*
+	 * Approximate idr memory usage with 128 bytes. It will be limited
+	 * by maximum number_of shaders anyway.
+	 */
+	if (unlikely(vmw_user_shader_size == 0))
+		vmw_user_shader_size =
+			ttm_round_pot(sizeof(struct vmw_user_shader)) + 128;
+
+	return vmw_user_shader_size;
+}
+
+/*
+ * The caller must have accounted vmw_shader_acc_size() bytes of graphics
+ * memory, which are released by the shader destructor or on failure.
+ */
 static int vmw_user_shader_alloc(struct vmw_private *dev_priv,
 				 struct vmw_dma_buffer *buffer,
 				 size_t shader_size,
@@ -349,28 +369,10 @@ static int vmw_user_shader_alloc(struct vmw_private *dev_priv,
 	struct vmw_resource *res, *tmp;
 	int ret;
 
-	/*
-	 * Approximate idr memory usage with 128 bytes. It will be limited
-	 * by maximum number_of shaders anyway.
-	 */
-	if (unlikely(vmw_user_shader_size == 0))
-		vmw_user_shader_size =
-			ttm_round_pot(sizeof(struct vmw_user_shader)) + 128;
-
-	ret = ttm_mem_global_alloc(vmw_mem_glob(dev_priv),
-				   vmw_user_shader_size,
-				   false, true);
-	if (unlikely(ret != 0)) {
-		if (ret != -ERESTARTSYS)
-			DRM_ERROR("Out of graphics memory for shader "
-				  "creation.\n");
-		goto out;
-	}
-
 	ushader = kzalloc(sizeof(*ushader), GFP_KERNEL);
 	if (unlikely(ushader == NULL)) {
 		ttm_mem_global_free(vmw_mem_glob(dev_priv),
-				    vmw_user_shader_size);
+				    vmw_shader_acc_size());
 		ret = -ENOMEM;
 		goto out;
 	}
@@ -458,13 +460,23 @@ out_err:
 }
 
 
-int vmw_shader_define_ioctl(struct drm_device *dev, void *data,
-			     struct drm_file *file_priv)
+/**
+ * vmw_shader_define - Create a user guest-backed shader.
+ *
+ * @dev_priv: Pointer to the device private structure.
+ * @tfile: The ttm object file the shader handle is registered with.
+ * @arg: The shader create request. On success, @arg->shader_handle is
+ * assigned the handle of the new shader.
+ *
+ * The caller must hold the reservation_sem in read mode and must already
+ * have accounted vmw_shader_acc_size() bytes of graphics memory for the
+ * shader. That accounting is handed over to the shader and released
+ * by its destructor, or by this function on failure.
+ */
+int vmw_shader_define(struct vmw_private *dev_priv,
+		      struct ttm_object_file *tfile,
+		      struct drm_vmw_shader_create_arg *arg)
 {
-	struct vmw_private *dev_priv = vmw_priv(dev);
-	struct drm_vmw_shader_create_arg *arg =
-		(struct drm_vmw_shader_create_arg *)data;
-	struct ttm_object_file *tfile = vmw_fpriv(file_priv)->tfile;
 	struct vmw_dma_buffer *buffer = NULL;
 	SVGA3dShaderType shader_type;
 	int ret;
@@ -475,7 +487,7 @@ int vmw_shader_define_ioctl(struct drm_device *dev, void *data,
 		if (unlikely(ret != 0)) {
 			DRM_ERROR("Could not find buffer for shader "
 				  "creation.\n");
-			return ret;
+			goto out_no_buffer;
 		}
 
 		if ((u64)buffer->base.num_pages * PAGE_SIZE <
@@ -502,16 +514,44 @@ int vmw_shader_define_ioctl(struct drm_device *dev, void *data,
 		goto out_bad_arg;
 	}
 
-	ret = ttm_read_lock(&dev_priv->reservation_sem, true);
-	if (unlikely(ret != 0))
-		goto out_bad_arg;
-
 	ret = vmw_user_shader_alloc(dev_priv, buffer, arg->size, arg->offset,
 				    shader_type, tfile, &arg->shader_handle);
+	vmw_dmabuf_unreference(&buffer);
+	return ret;
 
-	ttm_read_unlock(&dev_priv->reservation_sem);
 out_bad_arg:
 	vmw_dmabuf_unreference(&buffer);
+out_no_buffer:
+	ttm_mem_global_free(vmw_mem_glob(dev_priv), vmw_shader_acc_size());
+	return ret;
+}
+
+int vmw_shader_define_ioctl(struct drm_device *dev, void *data,
+			     struct drm_file *file_priv)
+{
+	struct vmw_private *dev_priv = vmw_priv(dev);
+	struct drm_vmw_shader_create_arg *arg =
+		(struct drm_vmw_shader_create_arg *)data;
+	struct ttm_object_file *tfile = vmw_fpriv(file_priv)->tfile;
+	int ret;
+
+	ret = ttm_read_lock(&dev_priv->reservation_sem, true);
+	if (unlikely(ret != 0))
+		return ret;
+
+	ret = ttm_mem_global_alloc(vmw_mem_glob(dev_priv),
+				   vmw_shader_acc_size(),
+				   false, true);
+	if (unlikely(ret != 0)) {
+		if (ret != -ERESTARTSYS)
+			DRM_ERROR("Out of graphics memory for shader "
+				  "creation.\n");
+		goto out_unlock;
+	}
+
+	ret = vmw_shader_define(dev_priv, tfile, arg);
+out_unlock:
+	ttm_read_unlock(&dev_priv->reservation_sem);
 	return ret;
 }
 
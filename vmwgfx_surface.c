@@ -28,8 +28,11 @@
 #include "vmwgfx_drv.h"
 #include "vmwgfx_resource_priv.h"
 #include <ttm/ttm_placement.h>
+#include <linux/jhash.h>
 #include "svga3d_surfacedefs.h"
 
+#define VMW_SURFACE_LAYOUT_HT_ORDER 8
+
 /**
  * struct vmw_user_surface - User-space visible surface resource
  *
@@ -59,6 +62,34 @@ struct vmw_surface_offset {
 	uint32_t bo_offset;
 };
 
+/**
+ * struct vmw_surface_layout - Immutable legacy surface layout, shared
+ * between surfaces with identical format, mip chain and image sizes.
+ *
+ * @kref:           Reference count. Protected by the surface layout lock.
+ * @dev_priv:       Pointer to the device private struct.
+ * @hash:           Hash table item, keyed on a hash of the signature.
+ * @cached:         Whether the layout is in the device layout cache.
+ * @backup_size:    Size of the backing store.
+ * @offsets:        Backing store offset of each image.
+ * @format:         Surface format. Start of the signature.
+ * @mip_levels:     Number of mip levels of each face.
+ * @num_sizes:      Number of images.
+ * @sizes:          Size of each image. End of the signature.
+ */
+struct vmw_surface_layout {
+	struct kref kref;
+	struct vmw_private *dev_priv;
+	struct drm_hash_item hash;
+	bool cached;
+	uint32_t backup_size;
+	struct vmw_surface_offset *offsets;
+	uint32_t format;
+	uint32_t mip_levels[DRM_VMW_MAX_SURFACE_FACES];
+	uint32_t num_sizes;
+	struct drm_vmw_size sizes[];
+};
+
 static void vmw_user_surface_free(struct vmw_resource *res);
 static struct vmw_resource *
 vmw_user_surface_base_to_res(struct ttm_base_object *base);
@@ -94,6 +125,7 @@ static const struct vmw_res_func vmw_legacy_surface_func = {
 	.res_type = vmw_res_surface,
 	.needs_backup = false,
 	.may_evict = true,
+	.keep_backup = true,
 	.type_name = "legacy surfaces",
 	.backup_placement = &vmw_srf_placement,
 	.create = &vmw_legacy_srf_create,
@@ -235,6 +267,16 @@ static void vmw_surface_define_encode(const struct vmw_surface *srf,
 	}
 }
 
+/**
+ * vmw_surface_box_empty - Whether a box covers no texels.
+ *
+ * @box: The box to check.
+ */
+static inline bool vmw_surface_box_empty(const SVGA3dBox *box)
+{
+	return box->w == 0 || box->h == 0 || box->d == 0;
+}
+
 /**
  * vmw_surface_dma_encode - Encode a surface_dma command.
  *
@@ -243,11 +285,17 @@ static void vmw_surface_define_encode(const struct vmw_surface *srf,
  * @ptr: Pointer to an SVGAGuestPtr indicating where the surface contents
  * should be placed or read from.
  * @to_surface: Boolean whether to DMA to the surface or from the surface.
+ * @dirty_only: Boolean whether to only transfer the dirty box of each
+ * image, skipping clean images.
+ *
+ * Returns the size of the encoded commands, which is at most
+ * vmw_surface_dma_size().
  */
-static void vmw_surface_dma_encode(struct vmw_surface *srf,
-				   void *cmd_space,
-				   const SVGAGuestPtr *ptr,
-				   bool to_surface)
+static uint32_t vmw_surface_dma_encode(struct vmw_surface *srf,
+				       void *cmd_space,
+				       const SVGAGuestPtr *ptr,
+				       bool to_surface,
+				       bool dirty_only)
 {
 	uint32_t i;
 	struct vmw_surface_dma *cmd = (struct vmw_surface_dma *)cmd_space;
@@ -261,6 +309,10 @@ static void vmw_surface_dma_encode(struct vmw_surface *srf,
 		SVGA3dCmdSurfaceDMASuffix *suffix = &cmd->suffix;
 		const struct vmw_surface_offset *cur_offset = &srf->offsets[i];
 		const struct drm_vmw_size *cur_size = &srf->sizes[i];
+		const SVGA3dBox *dirty = (dirty_only) ? &srf->dirty[i] : NULL;
+
+		if (dirty && vmw_surface_box_empty(dirty))
+			continue;
 
 		header->id = SVGA_3D_CMD_SURFACE_DMA;
 		header->size = sizeof(*body) + sizeof(*cb) + sizeof(*suffix);
@@ -274,15 +326,24 @@ static void vmw_surface_dma_encode(struct vmw_surface *srf,
 		body->host.mipmap = cur_offset->mip;
 		body->transfer = ((to_surface) ?  SVGA3D_WRITE_HOST_VRAM :
 				  SVGA3D_READ_HOST_VRAM);
-		cb->x = 0;
-		cb->y = 0;
-		cb->z = 0;
-		cb->srcx = 0;
-		cb->srcy = 0;
-		cb->srcz = 0;
-		cb->w = cur_size->width;
-		cb->h = cur_size->height;
-		cb->d = cur_size->depth;
+		if (dirty) {
+			cb->x = dirty->x;
+			cb->y = dirty->y;
+			cb->z = dirty->z;
+			cb->w = dirty->w;
+			cb->h = dirty->h;
+			cb->d = dirty->d;
+		} else {
+			cb->x = 0;
+			cb->y = 0;
+			cb->z = 0;
+			cb->w = cur_size->width;
+			cb->h = cur_size->height;
+			cb->d = cur_size->depth;
+		}
+		cb->srcx = cb->x;
+		cb->srcy = cb->y;
+		cb->srcz = cb->z;
 
 		suffix->suffixSize = sizeof(*suffix);
 		suffix->maximumOffset =
@@ -293,7 +354,164 @@ static void vmw_surface_dma_encode(struct vmw_surface *srf,
 		suffix->flags.reserved = 0;
 		++cmd;
 	}
-};
+
+	return (uint8_t *) cmd - (uint8_t *) cmd_space;
+}
+
+/**
+ * vmw_surface_subres - Compute the image index of a surface face and mip
+ * level.
+ *
+ * @srf: Pointer to a struct vmw_surface.
+ * @face: Surface face.
+ * @mip: Mip level.
+ *
+ * Returns the index into @srf->sizes of the image, or -1 if the image
+ * doesn't exist.
+ */
+static int vmw_surface_subres(const struct vmw_surface *srf,
+			      uint32_t face, uint32_t mip)
+{
+	int subres = 0;
+	uint32_t i;
+
+	if (face >= DRM_VMW_MAX_SURFACE_FACES || mip >= srf->mip_levels[face])
+		return -1;
+
+	for (i = 0; i < face; ++i)
+		subres += srf->mip_levels[i];
+
+	return subres + mip;
+}
+
+/**
+ * vmw_surface_box_union - Grow a box to include another box.
+ *
+ * @dst: The box to grow. May be empty.
+ * @src: A non-empty box.
+ */
+static void vmw_surface_box_union(SVGA3dBox *dst, const SVGA3dBox *src)
+{
+	uint32_t x2, y2, z2;
+
+	if (vmw_surface_box_empty(dst)) {
+		*dst = *src;
+		return;
+	}
+
+	x2 = max(dst->x + dst->w, src->x + src->w);
+	y2 = max(dst->y + dst->h, src->y + src->h);
+	z2 = max(dst->z + dst->d, src->z + src->d);
+	dst->x = min(dst->x, src->x);
+	dst->y = min(dst->y, src->y);
+	dst->z = min(dst->z, src->z);
+	dst->w = x2 - dst->x;
+	dst->h = y2 - dst->y;
+	dst->d = z2 - dst->z;
+}
+
+/**
+ * vmw_surface_dirty_stage - Stage a host-side modification of a surface
+ * image.
+ *
+ * @res: Pointer to a struct vmw_resource embedded in a struct vmw_surface.
+ * @dirty: The staged damage of the command batch being verified.
+ * @face: Surface face of the modified image.
+ * @mip: Mip level of the modified image.
+ * @box: The modified region of the image.
+ *
+ * Called by the command verifier without the device lock held. Damage
+ * that doesn't fit the staging area falls back to the whole surface.
+ */
+void vmw_surface_dirty_stage(struct vmw_resource *res,
+			     struct vmw_surface_dirty *dirty,
+			     uint32_t face, uint32_t mip,
+			     const SVGA3dBox *box)
+{
+	const struct vmw_surface *srf = vmw_res_to_srf(res);
+	int subres;
+	unsigned int i;
+
+	if (srf->dirty == NULL || dirty->all || vmw_surface_box_empty(box))
+		return;
+
+	subres = vmw_surface_subres(srf, face, mip);
+	if (unlikely(subres < 0 || box->x + box->w < box->x ||
+		     box->y + box->h < box->y || box->z + box->d < box->z)) {
+		dirty->all = true;
+		return;
+	}
+
+	for (i = 0; i < dirty->num; ++i) {
+		if (dirty->subres[i] == (uint32_t) subres) {
+			vmw_surface_box_union(&dirty->box[i], box);
+			return;
+		}
+	}
+
+	if (dirty->num == VMW_SURFACE_DIRTY_STAGED) {
+		dirty->all = true;
+		return;
+	}
+
+	dirty->subres[dirty->num] = subres;
+	dirty->box[dirty->num++] = *box;
+}
+
+/**
+ * vmw_surface_dirty_commit - Add staged damage to a surface.
+ *
+ * @res: Pointer to a struct vmw_resource embedded in a struct vmw_surface.
+ * @dirty: The damage staged while verifying the submitted command batch.
+ *
+ * Called with the device lock held once the command batch has been
+ * submitted. Boxes are aligned to the format block size and clipped to
+ * the image sizes.
+ */
+void vmw_surface_dirty_commit(struct vmw_resource *res,
+			      const struct vmw_surface_dirty *dirty)
+{
+	struct vmw_surface *srf = vmw_res_to_srf(res);
+	const struct svga3d_surface_desc *desc;
+	unsigned int i;
+
+	if (srf->dirty == NULL)
+		return;
+
+	if (dirty->all) {
+		for (i = 0; i < srf->num_sizes; ++i) {
+			SVGA3dBox *box = &srf->dirty[i];
+
+			box->x = box->y = box->z = 0;
+			box->w = srf->sizes[i].width;
+			box->h = srf->sizes[i].height;
+			box->d = srf->sizes[i].depth;
+		}
+		return;
+	}
+
+	desc = svga3dsurface_get_desc(srf->format);
+	for (i = 0; i < dirty->num; ++i) {
+		const struct drm_vmw_size *size = &srf->sizes[dirty->subres[i]];
+		const struct drm_vmw_size *block = &desc->block_size;
+		SVGA3dBox box = dirty->box[i];
+		uint32_t x2 = round_up(box.x + box.w, block->width);
+		uint32_t y2 = round_up(box.y + box.h, block->height);
+		uint32_t z2 = round_up(box.z + box.d, block->depth);
+
+		box.x = round_down(box.x, block->width);
+		box.y = round_down(box.y, block->height);
+		box.z = round_down(box.z, block->depth);
+		if (box.x >= size->width || box.y >= size->height ||
+		    box.z >= size->depth)
+			continue;
+
+		box.w = min(x2, size->width) - box.x;
+		box.h = min(y2, size->height) - box.y;
+		box.d = min(z2, size->depth) - box.z;
+		vmw_surface_box_union(&srf->dirty[dirty->subres[i]], &box);
+	}
+}
 
 
 /**
@@ -401,7 +619,14 @@ static int vmw_legacy_srf_create(struct vmw_resource *res)
 	}
 
 	vmw_surface_define_encode(srf, cmd);
-	vmw_fifo_commit(dev_priv, submit_size);
+	vmw_fifo_commit_noflush(dev_priv, submit_size);
+
+	/*
+	 * The new surface is only in sync with the backup buffer after
+	 * a full upload from it.
+	 */
+	srf->dirty_tracked = false;
+
 	/*
 	 * Surface memory usage accounting.
 	 */
@@ -425,7 +650,9 @@ out_no_id:
  * @bind:           Boolean wether to DMA to the surface.
  *
  * Transfer backup data to or from a legacy surface as part of the
- * validation process.
+ * validation process. If the backup buffer is known to hold the
+ * surface contents outside of the dirty boxes, only the dirty boxes
+ * are read back.
  * May return other errors if the kernel is out of guest resources.
  * The backup buffer will be fenced or idle upon successful completion,
  * and if the surface needs persistent backup storage, the backup buffer
@@ -441,9 +668,20 @@ static int vmw_legacy_srf_dma(struct vmw_resource *res,
 	struct vmw_surface *srf = vmw_res_to_srf(res);
 	uint8_t *cmd;
 	struct vmw_private *dev_priv = res->dev_priv;
+	bool dirty_only = !bind && srf->dirty_tracked;
+	uint32_t i;
 
 	BUG_ON(val_buf->bo == NULL);
 
+	if (dirty_only) {
+		for (i = 0; i < srf->num_sizes; ++i)
+			if (!vmw_surface_box_empty(&srf->dirty[i]))
+				break;
+
+		if (i == srf->num_sizes)
+			return 0;
+	}
+
 	submit_size = vmw_surface_dma_size(srf);
 	cmd = vmw_fifo_reserve(dev_priv, submit_size);
 	if (unlikely(cmd == NULL)) {
@@ -452,9 +690,18 @@ static int vmw_legacy_srf_dma(struct vmw_resource *res,
 		return -ENOMEM;
 	}
 	vmw_bo_get_guest_ptr(val_buf->bo, &ptr);
-	vmw_surface_dma_encode(srf, cmd, &ptr, bind);
+	submit_size = vmw_surface_dma_encode(srf, cmd, &ptr, bind,
+					     dirty_only);
 
-	vmw_fifo_commit(dev_priv, submit_size);
+	vmw_fifo_commit_noflush(dev_priv, submit_size);
+
+	/*
+	 * The backup buffer now holds the full surface contents.
+	 */
+	if (srf->dirty) {
+		memset(srf->dirty, 0, srf->num_sizes * sizeof(*srf->dirty));
+		srf->dirty_tracked = true;
+	}
 
 	/*
 	 * Create a fence object and fence the backup buffer.
@@ -487,10 +734,16 @@ static int vmw_legacy_srf_dma(struct vmw_resource *res,
 static int vmw_legacy_srf_bind(struct vmw_resource *res,
 			       struct ttm_validate_buffer *val_buf)
 {
+	int ret;
+
 	if (!res->backup_dirty)
 		return 0;
 
-	return vmw_legacy_srf_dma(res, val_buf, true);
+	ret = vmw_legacy_srf_dma(res, val_buf, true);
+	if (likely(ret == 0))
+		res->backup_dirty = false;
+
+	return ret;
 }
 
 
@@ -503,7 +756,9 @@ static int vmw_legacy_srf_bind(struct vmw_resource *res,
  * @val_buf:        Pointer to a struct ttm_validate_buffer containing
  *                  information about the backup buffer.
  *
- * This function will copy backup data from the surface.
+ * This function will copy backup data from the surface. Only regions
+ * modified since the surface was last restored from its backup buffer
+ * are copied.
  */
 static int vmw_legacy_srf_unbind(struct vmw_resource *res,
 				 bool readback,
@@ -514,6 +769,97 @@ static int vmw_legacy_srf_unbind(struct vmw_resource *res,
 	return 0;
 }
 
+/**
+ * vmw_surface_backup_drop_one - Drop the backup buffer retained by the
+ *                               least recently used resident legacy surface.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ *
+ * Must be called with the cmdbuf mutex held. The surface contents is then
+ * read back in full on its next eviction.
+ * Returns the number of pages released, or 0 if no surface retains a
+ * backup buffer.
+ */
+static unsigned long vmw_surface_backup_drop_one(struct vmw_private *dev_priv)
+{
+	struct list_head *lru_list = &dev_priv->res_lru[vmw_res_surface];
+	spinlock_t *lru_lock = &dev_priv->res_lru_lock[vmw_res_surface];
+	struct vmw_resource *res, *found = NULL;
+	unsigned long num_pages;
+
+	spin_lock(lru_lock);
+	list_for_each_entry(res, lru_list, lru_head) {
+		if (!vmw_resource_backup_retained(res))
+			continue;
+
+		found = vmw_resource_reference_unless_doomed(res);
+		if (found != NULL) {
+			list_del_init(&found->lru_head);
+			break;
+		}
+	}
+	spin_unlock(lru_lock);
+
+	if (found == NULL)
+		return 0;
+
+	num_pages = found->backup->base.num_pages;
+	vmw_dmabuf_unreference(&found->backup);
+	vmw_res_to_srf(found)->dirty_tracked = false;
+
+	spin_lock(lru_lock);
+	list_add_tail(&found->lru_head, lru_list);
+	spin_unlock(lru_lock);
+	vmw_resource_unreference(&found);
+
+	return num_pages;
+}
+
+/**
+ * vmw_surface_backup_shrink - Shrinker callback dropping retained legacy
+ *                             surface backup buffers.
+ *
+ * @shrink:         Pointer to the struct shrinker embedded in the device
+ *                  private struct.
+ * @nr_to_scan:     Number of pages to release. Zero to only query.
+ * @gfp_mask:       Allocation flags of the reclaiming allocation.
+ *
+ * Resident legacy surfaces keep their backup buffers only to speed up
+ * their next eviction, so the buffers can be released at any time the
+ * surfaces aren't in use. Returns the number of pages still retained,
+ * or -1 if the cmdbuf mutex is contended.
+ */
+int vmw_surface_backup_shrink(struct shrinker *shrink, int nr_to_scan,
+			      gfp_t gfp_mask)
+{
+	struct vmw_private *dev_priv =
+		container_of(shrink, struct vmw_private, backup_shrinker);
+	spinlock_t *lru_lock = &dev_priv->res_lru_lock[vmw_res_surface];
+	struct vmw_resource *res;
+	unsigned long num_pages;
+	unsigned long retained = 0;
+
+	if (!mutex_trylock(&dev_priv->cmdbuf_mutex))
+		return (nr_to_scan) ? -1 : 0;
+
+	while (nr_to_scan > 0) {
+		num_pages = vmw_surface_backup_drop_one(dev_priv);
+		if (num_pages == 0)
+			break;
+		nr_to_scan -= min_t(unsigned long, num_pages, nr_to_scan);
+	}
+
+	spin_lock(lru_lock);
+	list_for_each_entry(res, &dev_priv->res_lru[vmw_res_surface],
+			    lru_head)
+		if (vmw_resource_backup_retained(res))
+			retained += res->backup->base.num_pages;
+	spin_unlock(lru_lock);
+	mutex_unlock(&dev_priv->cmdbuf_mutex);
+
+	return min_t(unsigned long, retained, INT_MAX);
+}
+
 /**
  * vmw_legacy_srf_destroy - Destroy a device surface as part of a
  *                          resource eviction process.
@@ -604,6 +950,192 @@ static int vmw_surface_init(struct vmw_private *dev_priv,
 	return ret;
 }
 
+/**
+ * vmw_surface_layout_sig_size - Size of a surface layout signature.
+ *
+ * @num_sizes:      Number of images of the surface.
+ */
+static inline size_t vmw_surface_layout_sig_size(uint32_t num_sizes)
+{
+	return offsetof(struct vmw_surface_layout, sizes) -
+		offsetof(struct vmw_surface_layout, format) +
+		num_sizes * sizeof(struct drm_vmw_size);
+}
+
+/**
+ * vmw_surface_layout_compute - Compute the backing store layout of a
+ * surface.
+ *
+ * @layout:         The layout, with a filled in signature.
+ * @desc:           Format description of the surface.
+ */
+static void vmw_surface_layout_compute(struct vmw_surface_layout *layout,
+				       const struct svga3d_surface_desc *desc)
+{
+	struct vmw_surface_offset *cur_offset = layout->offsets;
+	struct drm_vmw_size *cur_size = layout->sizes;
+	uint32_t cur_bo_offset = 0;
+	int i, j;
+
+	for (i = 0; i < DRM_VMW_MAX_SURFACE_FACES; ++i) {
+		for (j = 0; j < layout->mip_levels[i]; ++j) {
+			uint32_t stride = svga3dsurface_calculate_pitch
+				(desc, cur_size);
+
+			cur_offset->face = i;
+			cur_offset->mip = j;
+			cur_offset->bo_offset = cur_bo_offset;
+			cur_bo_offset += svga3dsurface_get_image_buffer_size
+				(desc, cur_size, stride);
+			++cur_offset;
+			++cur_size;
+		}
+	}
+	layout->backup_size = cur_bo_offset;
+}
+
+/**
+ * vmw_surface_layout_get - Look up or create a legacy surface layout.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ * @req:            The surface define request.
+ * @num_sizes:      Total number of images of the surface.
+ * @desc:           Format description of the surface.
+ * @p_layout:       On successful return, points to a refcounted layout.
+ *
+ * Surfaces with the same format, mip chain and image sizes share a single
+ * layout, so that the image offsets only need to be computed once.
+ */
+static int vmw_surface_layout_get(struct vmw_private *dev_priv,
+				  const struct drm_vmw_surface_create_req *req,
+				  uint32_t num_sizes,
+				  const struct svga3d_surface_desc *desc,
+				  struct vmw_surface_layout **p_layout)
+{
+	struct drm_vmw_size __user *user_sizes =
+		(struct drm_vmw_size __user *)(unsigned long) req->size_addr;
+	size_t sig_size = vmw_surface_layout_sig_size(num_sizes);
+	struct vmw_surface_layout *layout, *cached;
+	struct drm_hash_item *hash;
+	uint32_t i;
+
+	layout = kmalloc(sizeof(*layout) + num_sizes *
+			 (sizeof(*layout->sizes) + sizeof(*layout->offsets)),
+			 GFP_KERNEL);
+	if (unlikely(layout == NULL))
+		return -ENOMEM;
+
+	if (unlikely(copy_from_user(layout->sizes, user_sizes,
+				    num_sizes * sizeof(*layout->sizes)) != 0)) {
+		kfree(layout);
+		return -EFAULT;
+	}
+
+	layout->format = req->format;
+	memcpy(layout->mip_levels, req->mip_levels,
+	       sizeof(layout->mip_levels));
+	layout->num_sizes = num_sizes;
+	for (i = 0; i < num_sizes; ++i)
+		layout->sizes[i].pad64 = 0;
+
+	layout->hash.key = jhash2(&layout->format, sig_size / sizeof(u32), 0);
+
+	spin_lock(&dev_priv->surface_layout_lock);
+	if (drm_ht_find_item(&dev_priv->surface_layouts, layout->hash.key,
+			     &hash) == 0) {
+		cached = drm_hash_entry(hash, struct vmw_surface_layout, hash);
+		if (memcmp(&cached->format, &layout->format, sig_size) == 0) {
+			kref_get(&cached->kref);
+			spin_unlock(&dev_priv->surface_layout_lock);
+			kfree(layout);
+			*p_layout = cached;
+			return 0;
+		}
+	}
+	spin_unlock(&dev_priv->surface_layout_lock);
+
+	kref_init(&layout->kref);
+	layout->dev_priv = dev_priv;
+	layout->offsets = (struct vmw_surface_offset *)
+		&layout->sizes[num_sizes];
+	vmw_surface_layout_compute(layout, desc);
+
+	/*
+	 * On a hash collision or a racing insert, the layout is simply
+	 * kept private to the surface.
+	 */
+	spin_lock(&dev_priv->surface_layout_lock);
+	layout->cached = (drm_ht_insert_item(&dev_priv->surface_layouts,
+					     &layout->hash) == 0);
+	spin_unlock(&dev_priv->surface_layout_lock);
+
+	*p_layout = layout;
+	return 0;
+}
+
+/**
+ * vmw_surface_layout_release - kref release callback for surface layouts.
+ *
+ * @kref:           The kref embedded in a struct vmw_surface_layout.
+ *
+ * Called with the surface layout lock held.
+ */
+static void vmw_surface_layout_release(struct kref *kref)
+{
+	struct vmw_surface_layout *layout =
+		container_of(kref, struct vmw_surface_layout, kref);
+
+	if (layout->cached)
+		(void) drm_ht_remove_item(&layout->dev_priv->surface_layouts,
+					  &layout->hash);
+	kfree(layout);
+}
+
+/**
+ * vmw_surface_layout_put - Drop a surface layout reference.
+ *
+ * @p_layout:       Pointer to the layout pointer. May point to NULL.
+ *                  Cleared on return.
+ */
+static void vmw_surface_layout_put(struct vmw_surface_layout **p_layout)
+{
+	struct vmw_surface_layout *layout = *p_layout;
+	struct vmw_private *dev_priv;
+
+	*p_layout = NULL;
+	if (layout == NULL)
+		return;
+
+	dev_priv = layout->dev_priv;
+	spin_lock(&dev_priv->surface_layout_lock);
+	kref_put(&layout->kref, vmw_surface_layout_release);
+	spin_unlock(&dev_priv->surface_layout_lock);
+}
+
+/**
+ * vmw_surface_layout_cache_init - Initialize the surface layout cache.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ */
+int vmw_surface_layout_cache_init(struct vmw_private *dev_priv)
+{
+	spin_lock_init(&dev_priv->surface_layout_lock);
+	return drm_ht_create(&dev_priv->surface_layouts,
+			     VMW_SURFACE_LAYOUT_HT_ORDER);
+}
+
+/**
+ * vmw_surface_layout_cache_takedown - Take down the surface layout cache.
+ *
+ * @dev_priv:       Pointer to a device private struct.
+ *
+ * All surfaces must have been destroyed.
+ */
+void vmw_surface_layout_cache_takedown(struct vmw_private *dev_priv)
+{
+	drm_ht_remove(&dev_priv->surface_layouts);
+}
+
 /**
  * vmw_user_surface_base_to_res - TTM base object to resource converter for
  *                                user visible surfaces
@@ -635,8 +1167,8 @@ static void vmw_user_surface_free(struct vmw_resource *res)
 
 	if (user_srf->master)
 		drm_master_put(&user_srf->master);
-	kfree(srf->offsets);
-	kfree(srf->sizes);
+	kfree(srf->dirty);
+	vmw_surface_layout_put(&srf->layout);
 	kfree(srf->snooper.image);
 	ttm_prime_object_kfree(user_srf, prime);
 	ttm_mem_global_free(vmw_mem_glob(dev_priv), size);
@@ -700,12 +1232,8 @@ int vmw_surface_define_ioctl(struct drm_device *dev, void *data,
 	struct drm_vmw_surface_create_req *req = &arg->req;
 	struct drm_vmw_surface_arg *rep = &arg->rep;
 	struct ttm_object_file *tfile = vmw_fpriv(file_priv)->tfile;
-	struct drm_vmw_size __user *user_sizes;
 	int ret;
-	int i, j;
-	uint32_t cur_bo_offset;
-	struct drm_vmw_size *cur_size;
-	struct vmw_surface_offset *cur_offset;
+	int i;
 	uint32_t num_sizes;
 	uint32_t size;
 	const struct svga3d_surface_desc *desc;
@@ -718,13 +1246,15 @@ int vmw_surface_define_ioctl(struct drm_device *dev, void *data,
 	for (i = 0; i < DRM_VMW_MAX_SURFACE_FACES; ++i)
 		num_sizes += req->mip_levels[i];
 
-	if (num_sizes > DRM_VMW_MAX_SURFACE_FACES *
-	    DRM_VMW_MAX_MIP_LEVELS)
+	if (num_sizes == 0 ||
+	    num_sizes > DRM_VMW_MAX_SURFACE_FACES * DRM_VMW_MAX_MIP_LEVELS)
 		return -EINVAL;
 
 	size = vmw_user_surface_size + 128 +
 		ttm_round_pot(num_sizes * sizeof(struct drm_vmw_size)) +
 		ttm_round_pot(num_sizes * sizeof(struct vmw_surface_offset));
+	if (!dev_priv->has_mob)
+		size += ttm_round_pot(num_sizes * sizeof(SVGA3dBox));
 
 
 	desc = svga3dsurface_get_desc(req->format);
@@ -763,51 +1293,31 @@ int vmw_surface_define_ioctl(struct drm_device *dev, void *data,
 	srf->num_sizes = num_sizes;
 	user_srf->size = size;
 
-	srf->sizes = kmalloc(srf->num_sizes * sizeof(*srf->sizes), GFP_KERNEL);
-	if (unlikely(srf->sizes == NULL)) {
-		ret = -ENOMEM;
-		goto out_no_sizes;
-	}
-	srf->offsets = kmalloc(srf->num_sizes * sizeof(*srf->offsets),
-			       GFP_KERNEL);
-	if (unlikely(srf->sizes == NULL)) {
-		ret = -ENOMEM;
-		goto out_no_offsets;
-	}
+	ret = vmw_surface_layout_get(dev_priv, req, num_sizes, desc,
+				     &srf->layout);
+	if (unlikely(ret != 0))
+		goto out_no_layout;
 
-	user_sizes = (struct drm_vmw_size __user *)(unsigned long)
-	    req->size_addr;
+	srf->sizes = srf->layout->sizes;
+	srf->offsets = srf->layout->offsets;
 
-	ret = copy_from_user(srf->sizes, user_sizes,
-			     srf->num_sizes * sizeof(*srf->sizes));
-	if (unlikely(ret != 0)) {
-		ret = -EFAULT;
-		goto out_no_copy;
+	/*
+	 * Legacy surfaces track host-side damage to limit readback
+	 * on eviction.
+	 */
+	if (!dev_priv->has_mob) {
+		srf->dirty = kcalloc(srf->num_sizes, sizeof(*srf->dirty),
+				     GFP_KERNEL);
+		if (unlikely(srf->dirty == NULL)) {
+			ret = -ENOMEM;
+			goto out_no_dirty;
+		}
 	}
 
 	srf->base_size = *srf->sizes;
 	srf->autogen_filter = SVGA3D_TEX_FILTER_NONE;
 	srf->multisample_count = 0;
-
-	cur_bo_offset = 0;
-	cur_offset = srf->offsets;
-	cur_size = srf->sizes;
-
-	for (i = 0; i < DRM_VMW_MAX_SURFACE_FACES; ++i) {
-		for (j = 0; j < srf->mip_levels[i]; ++j) {
-			uint32_t stride = svga3dsurface_calculate_pitch
-				(desc, cur_size);
-
-			cur_offset->face = i;
-			cur_offset->mip = j;
-			cur_offset->bo_offset = cur_bo_offset;
-			cur_bo_offset += svga3dsurface_get_image_buffer_size
-				(desc, cur_size, stride);
-			++cur_offset;
-			++cur_size;
-		}
-	}
-	res->backup_size = cur_bo_offset;
+	res->backup_size = srf->layout->backup_size;
 	if (srf->scanout &&
 	    srf->num_sizes == 1 &&
 	    srf->sizes[0].width == 64 &&
@@ -877,10 +1387,10 @@ int vmw_surface_define_ioctl(struct drm_device *dev, void *data,
 	ttm_read_unlock(&dev_priv->reservation_sem);
 	return 0;
 out_no_copy:
-	kfree(srf->offsets);
-out_no_offsets:
-	kfree(srf->sizes);
-out_no_sizes:
+	kfree(srf->dirty);
+out_no_dirty:
+	vmw_surface_layout_put(&srf->layout);
+out_no_layout:
 	ttm_prime_object_kfree(user_srf, prime);
 out_no_user_srf:
 	ttm_mem_global_free(vmw_mem_glob(dev_priv), size);
@@ -1068,7 +1578,7 @@ static int vmw_gb_surface_create(struct vmw_resource *res)
 	cmd->body.size.width = srf->base_size.width;
 	cmd->body.size.height = srf->base_size.height;
 	cmd->body.size.depth = srf->base_size.depth;
-	vmw_fifo_commit(dev_priv, submit_len);
+	vmw_fifo_commit_noflush(dev_priv, submit_len);
 
 	return 0;
 
@@ -1117,7 +1627,7 @@ static int vmw_gb_surface_bind(struct vmw_resource *res,
 		cmd2->body.sid = res->id;
 		res->backup_dirty = false;
 	}
-	vmw_fifo_commit(dev_priv, submit_size);
+	vmw_fifo_commit_noflush(dev_priv, submit_size);
 
 	return 0;
 }
@@ -1175,7 +1685,7 @@ static int vmw_gb_surface_unbind(struct vmw_resource *res,
 	cmd3->body.sid = res->id;
 	cmd3->body.mobid = SVGA3D_INVALID_ID;
 
-	vmw_fifo_commit(dev_priv, submit_size);
+	vmw_fifo_commit_noflush(dev_priv, submit_size);
 
 	/*
 	 * Create a fence object and fence the backup buffer.
@@ -1226,54 +1736,52 @@ static int vmw_gb_surface_destroy(struct vmw_resource *res)
 }
 
 /**
- * vmw_gb_surface_define_ioctl - Ioctl function implementing
- *                               the user surface define functionality.
+ * vmw_gb_surface_acc_size - Graphics memory accounted per user
+ *                           guest-backed surface.
+ */
+uint64_t vmw_gb_surface_acc_size(void)
+{
+	if (unlikely(vmw_user_surface_size == 0))
+		vmw_user_surface_size =
+			ttm_round_pot(sizeof(struct vmw_user_surface)) + 128;
+
+	return vmw_user_surface_size + 128;
+}
+
+/**
+ * vmw_gb_surface_define - Create a user guest-backed surface.
  *
- * @dev:            Pointer to a struct drm_device.
- * @data:           Pointer to data copied from / to user-space.
+ * @dev_priv:       Pointer to the device private structure.
  * @file_priv:      Pointer to a drm file private structure.
+ * @req:            The surface create request.
+ * @rep:            Assigned the surface create reply on success. May
+ *                  alias @req.
+ *
+ * The caller must hold the reservation_sem in read mode and must already
+ * have accounted vmw_gb_surface_acc_size() bytes of graphics memory for
+ * the surface. That accounting is handed over to the surface and released
+ * by its destructor, or by this function on failure.
  */
-int vmw_gb_surface_define_ioctl(struct drm_device *dev, void *data,
-				struct drm_file *file_priv)
+int vmw_gb_surface_define(struct vmw_private *dev_priv,
+			  struct drm_file *file_priv,
+			  const struct drm_vmw_gb_surface_create_req *req,
+			  struct drm_vmw_gb_surface_create_rep *rep)
 {
-	struct vmw_private *dev_priv = vmw_priv(dev);
 	struct vmw_user_surface *user_srf;
 	struct vmw_surface *srf;
 	struct vmw_resource *res;
 	struct vmw_resource *tmp;
-	union drm_vmw_gb_surface_create_arg *arg =
-	    (union drm_vmw_gb_surface_create_arg *)data;
-	struct drm_vmw_gb_surface_create_req *req = &arg->req;
-	struct drm_vmw_gb_surface_create_rep *rep = &arg->rep;
 	struct ttm_object_file *tfile = vmw_fpriv(file_priv)->tfile;
 	int ret;
-	uint32_t size;
+	uint32_t size = vmw_gb_surface_acc_size();
 	const struct svga3d_surface_desc *desc;
 	uint32_t backup_handle;
 
-	if (unlikely(vmw_user_surface_size == 0))
-		vmw_user_surface_size = ttm_round_pot(sizeof(*user_srf)) +
-			128;
-
-	size = vmw_user_surface_size + 128;
-
 	desc = svga3dsurface_get_desc(req->format);
 	if (unlikely(desc->block_desc == SVGA3DBLOCKDESC_NONE)) {
 		DRM_ERROR("Invalid surface format for surface creation.\n");
-		return -EINVAL;
-	}
-
-	ret = ttm_read_lock(&dev_priv->reservation_sem, true);
-	if (unlikely(ret != 0))
-		return ret;
-
-	ret = ttm_mem_global_alloc(vmw_mem_glob(dev_priv),
-				   size, false, true);
-	if (unlikely(ret != 0)) {
-		if (ret != -ERESTARTSYS)
-			DRM_ERROR("Out of graphics memory for surface"
-				  " creation.\n");
-		goto out_unlock;
+		ret = -EINVAL;
+		goto out_no_user_srf;
 	}
 
 	user_srf = kzalloc(sizeof(*user_srf), GFP_KERNEL);
@@ -1312,7 +1820,7 @@ int vmw_gb_surface_define_ioctl(struct drm_device *dev, void *data,
 
 	ret = vmw_surface_init(dev_priv, srf, vmw_user_surface_free);
 	if (unlikely(ret != 0))
-		goto out_unlock;
+		return ret;
 
 	if (req->buffer_handle != SVGA3D_INVALID_ID) {
 		ret = vmw_user_dmabuf_lookup(tfile, req->buffer_handle,
@@ -1328,7 +1836,7 @@ int vmw_gb_surface_define_ioctl(struct drm_device *dev, void *data,
 
 	if (unlikely(ret != 0)) {
 		vmw_resource_unreference(&res);
-		goto out_unlock;
+		return ret;
 	}
 
 	tmp = vmw_resource_reference(&srf->res);
@@ -1341,7 +1849,7 @@ int vmw_gb_surface_define_ioctl(struct drm_device *dev, void *data,
 	if (unlikely(ret != 0)) {
 		vmw_resource_unreference(&tmp);
 		vmw_resource_unreference(&res);
-		goto out_unlock;
+		return ret;
 	}
 
 	rep->handle = user_srf->prime.base.hash.key;
@@ -1357,11 +1865,43 @@ int vmw_gb_surface_define_ioctl(struct drm_device *dev, void *data,
 	}
 
 	vmw_resource_unreference(&res);
-
-	ttm_read_unlock(&dev_priv->reservation_sem);
 	return 0;
+
 out_no_user_srf:
 	ttm_mem_global_free(vmw_mem_glob(dev_priv), size);
+	return ret;
+}
+
+/**
+ * vmw_gb_surface_define_ioctl - Ioctl function implementing
+ *                               the user surface define functionality.
+ *
+ * @dev:            Pointer to a struct drm_device.
+ * @data:           Pointer to data copied from / to user-space.
+ * @file_priv:      Pointer to a drm file private structure.
+ */
+int vmw_gb_surface_define_ioctl(struct drm_device *dev, void *data,
+				struct drm_file *file_priv)
+{
+	struct vmw_private *dev_priv = vmw_priv(dev);
+	union drm_vmw_gb_surface_create_arg *arg =
+	    (union drm_vmw_gb_surface_create_arg *)data;
+	int ret;
+
+	ret = ttm_read_lock(&dev_priv->reservation_sem, true);
+	if (unlikely(ret != 0))
+		return ret;
+
+	ret = ttm_mem_global_alloc(vmw_mem_glob(dev_priv),
+				   vmw_gb_surface_acc_size(), false, true);
+	if (unlikely(ret != 0)) {
+		if (ret != -ERESTARTSYS)
+			DRM_ERROR("Out of graphics memory for surface"
+				  " creation.\n");
+		goto out_unlock;
+	}
+
+	ret = vmw_gb_surface_define(dev_priv, file_priv, &arg->req, &arg->rep);
 out_unlock:
 	ttm_read_unlock(&dev_priv->reservation_sem);
 	return ret;